@@ -0,0 +1,468 @@
+/**\file
+ * \brief FSSD actions.
+ *
+ * Implements the shutdown strategies and pre-shutdown hooks declared in
+ * action.h. Nothing in here blocks, so that the pulse train can carry on while
+ * the system shuts down.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "action.h"
+
+/* for posix_spawn() */
+#include <spawn.h>
+
+/* for sched_param, SCHED_OTHER */
+#include <sched.h>
+
+/* for kill(), SIGRTMIN */
+#include <signal.h>
+
+/* for waitpid() */
+#include <sys/wait.h>
+
+/* for reboot() */
+#include <sys/reboot.h>
+
+/* for sync(), access() */
+#include <unistd.h>
+
+/* for memset(), strncpy(), strtok(), strcmp() */
+#include <string.h>
+
+/* for opendir(), readdir() */
+#include <dirent.h>
+
+/* for stat() */
+#include <sys/stat.h>
+
+/* for snprintf(), printf() */
+#include <stdio.h>
+
+/* for qsort() */
+#include <stdlib.h>
+
+/**\brief Process environment
+ *
+ * Passed on to spawned programmes as is.
+ */
+extern char **environ;
+
+/**\brief Set the command for the spawn strategy.
+ *
+ * Splits the given command into words at whitespace, which become the
+ * programme to run and its arguments. There is no shell involved, so there is
+ * no quoting, and the programme should be given with its full path.
+ *
+ * \param[out] action  The action to set the command of.
+ * \param[in]  command The command, e.g. ACTION_COMMAND.
+ *
+ * \returns 0 on success, negative numbers if the command is empty or too long.
+ */
+int actionCommand(struct action *action, const char *command) {
+  char *word;
+  int n = 0;
+
+  if (strlen(command) >= ACTION_MAX_COMMAND) {
+    return -1;
+  }
+
+  strncpy(action->command, command, ACTION_MAX_COMMAND - 1);
+  action->command[ACTION_MAX_COMMAND - 1] = 0;
+
+  for (word = strtok(action->command, " \t"); word != NULL;
+       word = strtok(NULL, " \t")) {
+    if (n >= ACTION_MAX_ARGS) {
+      return -2;
+    }
+    action->argv[n++] = word;
+  }
+
+  action->argv[n] = NULL;
+
+  return (n > 0) ? 0 : -3;
+}
+
+/**\brief Spawn a programme.
+ *
+ * Starts a programme with posix_spawn(). The child is put on the normal
+ * scheduling policy, so that a daemon in real-time mode doesn't run its
+ * shutdown at real-time priority, and optionally into its own process group,
+ * so that it can be killed along with anything it started. It also gets an
+ * empty signal mask, as the daemon blocks its signals most of the time.
+ *
+ * \param[out] pid   Set to the child's process ID.
+ * \param[in]  argv  The programme to run and its arguments, NULL-terminated.
+ * \param[in]  group Nonzero to put the child in a new process group.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int spawn(pid_t *pid, char *const argv[], char group) {
+  posix_spawnattr_t attr;
+  struct sched_param param;
+  sigset_t signals;
+  short flags = POSIX_SPAWN_SETSCHEDULER | POSIX_SPAWN_SETSIGMASK;
+  int rv = 0;
+
+  if (posix_spawnattr_init(&attr) != 0) {
+    return -1;
+  }
+
+  if (group) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+
+  memset(&param, 0, sizeof(param));
+  sigemptyset(&signals);
+  if ((posix_spawnattr_setflags(&attr, flags) != 0) ||
+      (posix_spawnattr_setsigmask(&attr, &signals) != 0) ||
+      (posix_spawnattr_setpgroup(&attr, 0) != 0) ||
+      (posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER) != 0) ||
+      (posix_spawnattr_setschedparam(&attr, &param) != 0)) {
+    rv = -2;
+  } else if (posix_spawn(pid, argv[0], NULL, &attr, argv, environ) != 0) {
+    *pid = 0;
+    rv = -3;
+  }
+
+  (void)posix_spawnattr_destroy(&attr);
+
+  return rv;
+}
+
+/**\brief Seconds since a point in time.
+ *
+ * \param[in] then A CLOCK_MONOTONIC time in the past.
+ *
+ * \returns The number of seconds since 'then'.
+ */
+static double since(const struct timespec *then) {
+  struct timespec now;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - then->tv_sec) +
+         (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Point in time after another.
+ *
+ * \param[out] out     Set to 'then' plus the given number of seconds.
+ * \param[in]  then    A CLOCK_MONOTONIC time.
+ * \param[in]  seconds The number of seconds to add.
+ */
+static void after(struct timespec *out, const struct timespec *then,
+                  double seconds) {
+  long nsec = (long)((seconds - (time_t)seconds) * 1e9);
+
+  out->tv_sec = then->tv_sec + (time_t)seconds;
+  out->tv_nsec = then->tv_nsec + nsec;
+  if (out->tv_nsec >= 1000000000) {
+    out->tv_sec++;
+    out->tv_nsec -= 1000000000;
+  }
+}
+
+/**\brief Earlier of two points in time.
+ *
+ * \param[in] a A point in time.
+ * \param[in] b Another point in time.
+ *
+ * \returns Nonzero if 'a' is before 'b'.
+ */
+static int before(const struct timespec *a, const struct timespec *b) {
+  return (a->tv_sec < b->tv_sec) ||
+         ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+/**\brief Check whether time is up.
+ *
+ * \param[in] then    A CLOCK_MONOTONIC time in the past.
+ * \param[in] seconds A number of seconds.
+ *
+ * \returns Nonzero if the given number of seconds have passed since 'then'.
+ */
+static int expired(const struct timespec *then, double seconds) {
+  struct timespec now;
+  struct timespec end;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  after(&end, then, seconds);
+
+  return !before(&now, &end);
+}
+
+/**\brief Compare two hooks.
+ *
+ * Comparison function for qsort(), to order hooks by path.
+ *
+ * \param[in] a Pointer to the first hook.
+ * \param[in] b Pointer to the second hook.
+ *
+ * \returns Negative, zero or positive numbers if 'a' sorts before, with or
+ *          after 'b'.
+ */
+static int compareHook(const void *a, const void *b) {
+  return strcmp(((const struct hook *)a)->path, ((const struct hook *)b)->path);
+}
+
+/**\brief Start the hooks.
+ *
+ * Starts every executable regular file in the action's hook directory, all at
+ * once, each in its own process group. Entries starting with a dot are
+ * skipped.
+ *
+ * \param[in,out] action The action to start the hooks of.
+ *
+ * \returns The number of hooks that were started, negative numbers if the hook
+ *          directory could not be read.
+ */
+static int startHooks(struct action *action) {
+  DIR *dir = opendir(action->hooks);
+  struct dirent *entry;
+  int i;
+
+  if (dir == NULL) {
+    return -1;
+  }
+
+  action->hookCount = 0;
+  action->hooksRunning = 0;
+
+  while (((entry = readdir(dir)) != NULL) &&
+         (action->hookCount < ACTION_MAX_HOOKS)) {
+    struct hook *hook = &action->hook[action->hookCount];
+    struct stat st;
+
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    if (snprintf(hook->path, ACTION_MAX_PATH, "%s/%s", action->hooks,
+                 entry->d_name) >= ACTION_MAX_PATH) {
+      continue;
+    }
+
+    if ((stat(hook->path, &st) < 0) || !S_ISREG(st.st_mode) ||
+        (access(hook->path, X_OK) < 0)) {
+      continue;
+    }
+
+    action->hookCount++;
+  }
+
+  (void)closedir(dir);
+
+  qsort(action->hook, action->hookCount, sizeof(struct hook), compareHook);
+
+  for (i = 0; i < action->hookCount; i++) {
+    struct hook *hook = &action->hook[i];
+    char *argv[2] = {hook->path, NULL};
+
+    hook->killed = 0;
+    (void)clock_gettime(CLOCK_MONOTONIC, &hook->started);
+
+    if (spawn(&hook->pid, argv, 1) == 0) {
+      action->hooksRunning++;
+    } else {
+      printf("# could not start hook '%s'\n", hook->path);
+    }
+  }
+
+  fflush(stdout);
+
+  return action->hooksRunning;
+}
+
+/**\brief Start the shutdown.
+ *
+ * Starts the shutdown with the action's strategy, once the hooks are done.
+ *
+ * \param[in,out] action The action to start the shutdown of.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int startShutdown(struct action *action) {
+  action->final = 1;
+
+  if (action->strategy == actionSignal) {
+    return (kill(action->init, SIGRTMIN + 4) < 0) ? -1 : 0;
+  }
+
+  return spawn(&action->child, action->argv, 0);
+}
+
+/**\brief Log a hook's result.
+ *
+ * Prints how long a hook ran for, and how it ended, in the same format as the
+ * daemon's statistics.
+ *
+ * \param[in] hook   The hook that has ended.
+ * \param[in] status The hook's exit status, as returned by waitpid().
+ */
+static void logHook(const struct hook *hook, int status) {
+  printf("picod_hook_duration_seconds{hook=\"%s\"} %.6f\n", hook->path,
+         since(&hook->started));
+  if (hook->killed) {
+    printf("picod_hook_killed{hook=\"%s\"} 1\n", hook->path);
+  } else if (WIFEXITED(status)) {
+    printf("picod_hook_exit_status{hook=\"%s\"} %d\n", hook->path,
+           WEXITSTATUS(status));
+  }
+  fflush(stdout);
+}
+
+/**\brief Start an action.
+ *
+ * Starts the clock on the power-off deadline, if there is one, and then either
+ * starts the action's hooks or, if there aren't any, the shutdown. Starting an
+ * action that is already running does nothing.
+ *
+ * \param[in,out] action The action to start.
+ *
+ * \returns 0 on success, negative numbers on failure. The deadline applies
+ *          either way.
+ */
+int actionStart(struct action *action) {
+  if (action->running) {
+    return 0;
+  }
+
+  action->running = 1;
+  (void)clock_gettime(CLOCK_MONOTONIC, &action->started);
+
+  if ((action->hooks != NULL) && (startHooks(action) > 0)) {
+    return 0;
+  }
+
+  return startShutdown(action);
+}
+
+/**\brief Keep an action going.
+ *
+ * To be called regularly, e.g. once per pulse, and whenever a child process
+ * may have exited. Collects any child processes that have exited, without
+ * blocking, and logs how long hooks took. Hooks that have run out of time are
+ * killed, and once no hooks are left running, the shutdown is started. If the
+ * action's power-off deadline has passed, this syncs the file systems and
+ * powers off; if that fails, it's tried again ACTION_RETRY seconds later.
+ *
+ * \param[in,out] action The action to look after.
+ *
+ * \returns 0 on success, negative numbers if starting the shutdown or powering
+ *          off failed.
+ */
+int actionPoll(struct action *action) {
+  int status;
+  pid_t pid;
+  int i;
+  int rv = 0;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == action->child) {
+      action->child = 0;
+    }
+
+    for (i = 0; i < action->hookCount; i++) {
+      struct hook *hook = &action->hook[i];
+
+      if (pid == hook->pid) {
+        logHook(hook, status);
+        hook->pid = 0;
+        if (!hook->killed) {
+          action->hooksRunning--;
+        }
+      }
+    }
+  }
+
+  if (!action->running) {
+    return 0;
+  }
+
+  if (!action->final) {
+    int late = expired(&action->started, action->hookDeadline);
+
+    for (i = 0; i < action->hookCount; i++) {
+      struct hook *hook = &action->hook[i];
+
+      if ((hook->pid > 0) && !hook->killed &&
+          (late || expired(&hook->started, action->hookTimeout))) {
+        (void)kill(-hook->pid, SIGKILL);
+        hook->killed = 1;
+        action->hooksRunning--;
+      }
+    }
+
+    if (action->hooksRunning <= 0) {
+      rv = startShutdown(action);
+    }
+  }
+
+  if ((action->deadline == 0) || !expired(&action->started, action->deadline)) {
+    return rv;
+  }
+
+  sync();
+  if (reboot(RB_POWER_OFF) < 0) {
+    action->deadline = since(&action->started) + ACTION_RETRY;
+    /* try again later, rather than on every poll until then. */
+    return -2;
+  }
+
+  return rv;
+}
+
+/**\brief When an action needs looking after.
+ *
+ * Finds the next point in time at which actionPoll() needs to be called for the
+ * action's timeouts and deadlines to be enforced on time, so that callers can
+ * include that in their waits.
+ *
+ * \param[in]  action The action to check.
+ * \param[out] due    Set to the CLOCK_MONOTONIC time actionPoll() is due at.
+ *
+ * \returns 1 if there's such a point in time, 0 if there isn't.
+ */
+int actionDue(const struct action *action, struct timespec *due) {
+  struct timespec t;
+  int rv = 0;
+  int i;
+
+  if (!action->running) {
+    return 0;
+  }
+
+  if (!action->final) {
+    after(due, &action->started, action->hookDeadline);
+    rv = 1;
+
+    for (i = 0; i < action->hookCount; i++) {
+      const struct hook *hook = &action->hook[i];
+
+      if ((hook->pid > 0) && !hook->killed) {
+        after(&t, &hook->started, action->hookTimeout);
+        if (before(&t, due)) {
+          *due = t;
+        }
+      }
+    }
+  }
+
+  if (action->deadline > 0) {
+    after(&t, &action->started, action->deadline);
+    if ((rv == 0) || before(&t, due)) {
+      *due = t;
+    }
+    rv = 1;
+  }
+
+  return rv;
+}
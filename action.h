@@ -0,0 +1,231 @@
+/**\file
+ * \brief FSSD actions.
+ *
+ * What picod does when the PIco signals that the battery is about to run out:
+ * start a shutdown, either by running a programme - without a shell, so this
+ * still works when little else does - or by signalling init directly. If the
+ * system is still up after a given deadline, the action can fall back to
+ * sync() and reboot(RB_POWER_OFF) as a last resort.
+ *
+ * Before any of that, an action can run the programmes in a hook directory, all
+ * at the same time, to flush databases, stop writers, unmount volumes and the
+ * like. Each hook gets a timeout, and all of them together get a deadline,
+ * after which any that are still running are killed and the shutdown goes
+ * ahead regardless.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_ACTION_H)
+#define PICO_ACTION_H
+
+/* for pid_t */
+#include <sys/types.h>
+
+/* for struct timespec */
+#include <time.h>
+
+/**\brief Default shutdown command
+ *
+ * The programme and arguments to run with the spawn strategy, unless told
+ * otherwise. Equivalent to the "shutdown -h now" of the vendor's script, but
+ * without relying on a shell or on PATH.
+ */
+#define ACTION_COMMAND "/sbin/shutdown -h now"
+
+/**\brief Maximum number of command arguments
+ *
+ * The maximum number of words in a command for the spawn strategy, including
+ * the programme itself.
+ */
+#define ACTION_MAX_ARGS 16
+
+/**\brief Maximum command length
+ *
+ * The maximum length of a command for the spawn strategy.
+ */
+#define ACTION_MAX_COMMAND 256
+
+/**\brief Maximum number of hooks
+ *
+ * The maximum number of hooks that are run from a hook directory; any further
+ * entries are ignored.
+ */
+#define ACTION_MAX_HOOKS 32
+
+/**\brief Power-off retry interval
+ *
+ * Seconds to wait before trying to power off again, if reboot() failed at the
+ * deadline, e.g. because we aren't allowed to.
+ */
+#define ACTION_RETRY 1
+
+/**\brief Maximum hook path length
+ *
+ * The maximum length of the full path to a hook.
+ */
+#define ACTION_MAX_PATH 256
+
+/**\brief Shutdown strategy
+ *
+ * Selects how an action starts the shutdown.
+ */
+enum actionStrategy {
+  /**\brief Spawn a programme
+   *
+   * Run a programme with posix_spawn(), without a shell.
+   */
+  actionSpawn,
+
+  /**\brief Signal init
+   *
+   * Send SIGRTMIN+4 to a process, which makes systemd power off the system.
+   */
+  actionSignal
+};
+
+/**\brief Pre-shutdown hook
+ *
+ * A programme from the hook directory, and the state of its process.
+ */
+struct hook {
+  /**\brief Hook path
+   *
+   * The full path to the programme.
+   */
+  char path[ACTION_MAX_PATH];
+
+  /**\brief Hook process
+   *
+   * The process ID of the hook while it's running or hasn't been collected, 0
+   * otherwise. Hooks run in their own process group with the same ID.
+   */
+  pid_t pid;
+
+  /**\brief Hook killed
+   *
+   * Nonzero if the hook had to be killed.
+   */
+  char killed;
+
+  /**\brief Start time
+   *
+   * The CLOCK_MONOTONIC time the hook was started at.
+   */
+  struct timespec started;
+};
+
+/**\brief FSSD action
+ *
+ * How to shut down, and the state of a shutdown that is in progress.
+ */
+struct action {
+  /**\brief Shutdown strategy
+   *
+   * How to start the shutdown.
+   */
+  enum actionStrategy strategy;
+
+  /**\brief Command arguments
+   *
+   * The programme to run and its arguments, NULL-terminated, for the spawn
+   * strategy.
+   */
+  char *argv[ACTION_MAX_ARGS + 1];
+
+  /**\brief Command buffer
+   *
+   * The command for the spawn strategy, split into words that argv points to.
+   */
+  char command[ACTION_MAX_COMMAND];
+
+  /**\brief Process to signal
+   *
+   * The process ID to send the signal to, for the signal strategy. This would
+   * be 1 - init - except for testing.
+   */
+  pid_t init;
+
+  /**\brief Hook directory
+   *
+   * The directory with the hooks to run before shutting down, or NULL for no
+   * hooks.
+   */
+  const char *hooks;
+
+  /**\brief Hook timeout
+   *
+   * Seconds after which an individual hook is killed.
+   */
+  double hookTimeout;
+
+  /**\brief Hook deadline
+   *
+   * Seconds after the action was started at which all hooks that are still
+   * running are killed, and the shutdown goes ahead.
+   */
+  double hookDeadline;
+
+  /**\brief Hooks
+   *
+   * The hooks that were started.
+   */
+  struct hook hook[ACTION_MAX_HOOKS];
+
+  /**\brief Number of hooks
+   *
+   * The number of entries in the hook array.
+   */
+  int hookCount;
+
+  /**\brief Number of running hooks
+   *
+   * The number of hooks that are still running and haven't been killed.
+   */
+  int hooksRunning;
+
+  /**\brief Power-off deadline
+   *
+   * Seconds after the action was started to sync() and reboot(RB_POWER_OFF)
+   * if we're still running. 0 to never do that. If that fails, this is pushed
+   * back by ACTION_RETRY, so it's never left in the past.
+   */
+  double deadline;
+
+  /**\brief Start time
+   *
+   * The CLOCK_MONOTONIC time the action was started at.
+   */
+  struct timespec started;
+
+  /**\brief Action started
+   *
+   * Nonzero once the action has been started.
+   */
+  char running;
+
+  /**\brief Shutdown started
+   *
+   * Nonzero once the hooks are done and the shutdown has been started with the
+   * action's strategy.
+   */
+  char final;
+
+  /**\brief Child process
+   *
+   * The process ID of the spawned programme while it's running, 0 otherwise.
+   */
+  pid_t child;
+};
+
+int actionCommand(struct action *action, const char *command);
+int actionStart(struct action *action);
+int actionPoll(struct action *action);
+int actionDue(const struct action *action, struct timespec *due);
+
+#endif
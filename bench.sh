@@ -0,0 +1,158 @@
+#!/bin/sh
+#
+# Benchmarks picod and pico-i2cd against pico-emu, once without and once with
+# CPU stress, and prints the results in the Prometheus text format, with a
+# 'stress' label for the number of busy processes that ran alongside. Each run
+# is repeated with pico-upsd doing the work of both daemons, with a 'daemons'
+# label of "separate" or "combined" to tell the two apart.
+#
+# Each run holds a key down every two seconds, alternating between short and
+# long presses, and forces the FSSD signal LOW near the end; picod is told to
+# shut down by signalling pico-emu, which measures how long that took. Each
+# daemon prints its statistics when it's told to terminate.
+#
+# After that, the bus is contended: pico-emu emulates a 100kHz bus, and one
+# pico-i2cd scans the keys while others poll the PIco's status as fast as they
+# can. This is run once with the bus arbitrated and once without, with a
+# 'contenders' label for the number of polling processes and an 'arbiter' label
+# of "on" or "off", to show what the arbiter does to the key scans' latency.
+#
+# Environment:
+#   BENCH_SECONDS     How long each run takes. The default is 30.
+#   BENCH_STRESS      The numbers of busy processes to run, separated by
+#                     spaces. The default is "0" and the number of CPUs.
+#   BENCH_CONTENDERS  The number of polling processes on the contended bus. The
+#                     default is 4; 0 skips the contention runs.
+#
+# This programme is released as open source, under the terms of an MIT/X style
+# licence. See the accompanying LICENSE file for details.
+
+set -e
+
+seconds=${BENCH_SECONDS:-30}
+stress=${BENCH_STRESS:-"0 $(getconf _NPROCESSORS_ONLN)"}
+contenders=${BENCH_CONTENDERS:-4}
+tick=$(getconf CLK_TCK)
+page=$(getconf PAGESIZE)
+bin=$(cd "$(dirname "$0")" && pwd)
+
+# label A B C D: adds A="B" and C="D" labels to the metrics on stdin, and drops
+# comments.
+label() {
+  grep -v '^#' |
+    sed -e "s/^\([a-z0-9_]*\){/\1{$1=\"$2\",$3=\"$4\",/" \
+        -e "s/^\([a-z0-9_]*\) /\1{$1=\"$2\",$3=\"$4\"} /"
+}
+
+# cpu PID NAME: prints a daemon's CPU time, scaled to an hour, and its resident
+# set size.
+cpu() {
+  awk -v tick="$tick" -v page="$page" -v seconds="$seconds" -v name="$2" \
+    '{print name "_cpu_seconds_per_hour", ($14 + $15) / tick / seconds * 3600;
+      print name "_resident_bytes", $24 * page}' \
+    "/proc/$1/stat"
+}
+
+for n in $stress; do
+  for daemons in separate combined; do
+    dir=$(mktemp -d)
+
+    {
+      echo "0 mode 2"
+      t=1000
+      while [ $t -lt $((seconds * 1000 - 4000)) ]; do
+        echo "$t press b $((t / 1000 % 2 * 600 + 100))"
+        t=$((t + 2000))
+      done
+      echo "$((seconds * 1000 - 3000)) fssd 0"
+      echo "$((seconds * 1000)) quit"
+    } > "$dir/script"
+
+    workers=""
+    i=0
+    while [ $i -lt "$n" ]; do
+      yes > /dev/null &
+      workers="$workers $!"
+      i=$((i + 1))
+    done
+
+    "$bin/pico-emu" -a "$dir/sock" -g "$dir/gpio" -u "$dir/input" \
+      -x "$dir/script" > "$dir/emu" &
+    emu=$!
+    sleep 0.2
+
+    if [ "$daemons" = separate ]; then
+      "$bin/pico-i2cd" -a "$dir/sock" -u "$dir/input" > "$dir/out-i2cd" &
+      i2cd=$!
+      "$bin/picod" -g "$dir/gpio" -k "$emu" > "$dir/out-picod" &
+      picod=$!
+      pids="$i2cd $picod"
+    else
+      "$bin/pico-upsd" -a "$dir/sock" -u "$dir/input" -g "$dir/gpio" \
+        -k "$emu" > "$dir/out-upsd" &
+      upsd=$!
+      pids="$upsd"
+    fi
+
+    sleep "$((seconds - 1))"
+    if [ "$daemons" = separate ]; then
+      cpu $i2cd pico_bench_i2cd > "$dir/cpu"
+      cpu $picod pico_bench_picod >> "$dir/cpu"
+    else
+      cpu $upsd pico_bench_upsd > "$dir/cpu"
+    fi
+    wait $emu || true
+
+    sleep 0.1
+    kill $pids $workers
+    for pid in $pids; do
+      wait "$pid" || true
+    done
+
+    cat "$dir/emu" "$dir"/out-* "$dir/cpu" |
+      label stress "$n" daemons "$daemons"
+    rm -rf "$dir"
+  done
+done
+
+if [ "$contenders" -gt 0 ]; then
+  for arbiter in on off; do
+    dir=$(mktemp -d)
+    flags=""
+    if [ "$arbiter" = off ]; then
+      flags="-b"
+    fi
+
+    {
+      echo "0 mode 2"
+      echo "$((seconds * 1000)) quit"
+    } > "$dir/script"
+
+    "$bin/pico-emu" -a "$dir/sock" -u "$dir/input" -s 100 \
+      -x "$dir/script" > "$dir/emu" &
+    emu=$!
+    sleep 0.2
+
+    "$bin/pico-i2cd" -a "$dir/sock" -u "$dir/input" $flags > "$dir/out-keys" &
+    keys=$!
+    pids=""
+    i=0
+    while [ $i -lt "$contenders" ]; do
+      "$bin/pico-i2cd" -a "$dir/sock" -i -l 127.0.0.1:0 -t 0.001 -H 0 $flags \
+        > /dev/null &
+      pids="$pids $!"
+      i=$((i + 1))
+    done
+
+    wait $emu || true
+
+    kill $keys $pids
+    for pid in $keys $pids; do
+      wait "$pid" || true
+    done
+
+    cat "$dir/emu" "$dir/out-keys" |
+      label contenders "$contenders" arbiter "$arbiter"
+    rm -rf "$dir"
+  done
+fi
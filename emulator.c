@@ -0,0 +1,366 @@
+/**\file
+ * \brief PIco emulator.
+ *
+ * Implements the PIco model declared in emulator.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Hardware: http://pimodules.com/_pdf/_pico/UPS_PIco_BL_FSSD_V1.0.pdf
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "emulator.h"
+
+/* for sscanf() */
+#include <stdio.h>
+
+/* for memset(), memcpy(), strchr(), strcmp() */
+#include <string.h>
+
+/**\brief Key names
+ *
+ * The names of the keys in commands, in register order.
+ */
+static const char keyName[EMULATOR_KEYS + 1] = "abf";
+
+/**\brief Seconds between two points in time.
+ *
+ * \param[in] a A point in time.
+ * \param[in] b Another point in time.
+ *
+ * \returns The number of seconds from 'b' to 'a'.
+ */
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+  return (double)(a->tv_sec - b->tv_sec) +
+         (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**\brief Encode BCD values
+ *
+ * The reverse of pico.c's decode(): every decimal digit goes into a nibble of
+ * its own.
+ *
+ * \param[in] value The value to encode, from 0 to 9999.
+ *
+ * \returns The encoded value.
+ */
+static unsigned int setBCD(long value) {
+  if (value < 0) {
+    value = 0;
+  } else if (value > 9999) {
+    value = 9999;
+  }
+
+  return (value % 10) | ((value / 10 % 10) << 4) | ((value / 100 % 10) << 8) |
+         ((value / 1000 % 10) << 12);
+}
+
+/**\brief Latch a key
+ *
+ * \param[out] emulator The emulator.
+ * \param[out] key      The key to latch.
+ */
+static void latch(struct emulator *emulator, struct emulatorKey *key) {
+  if (!key->latched) {
+    key->latched = 1;
+    key->since = emulator->now;
+    emulator->latches++;
+  }
+}
+
+/**\brief Set up an emulator.
+ *
+ * Starts out with a PIco that is plugged in, with a full battery, a healthy 5V
+ * line, no keys pressed, and the FSSD pin HIGH.
+ *
+ * \param[out] emulator The emulator to set up.
+ * \param[in]  now      The CLOCK_MONOTONIC time to start at.
+ */
+void emulatorInit(struct emulator *emulator, const struct timespec *now) {
+  memset(emulator, 0, sizeof(*emulator));
+
+  emulator->version = 0x38;
+  emulator->mode = 1;
+  emulator->battery = 420;
+  emulator->host = 510;
+  emulator->temperature[0] = 31;
+  emulator->temperature[1] = 25;
+  emulator->threshold = 340;
+  emulator->forced = -1;
+  emulator->now = *now;
+}
+
+/**\brief Advance the model.
+ *
+ * Discharges the battery for the time that passed, releases keys whose time is
+ * up, and latches keys that are still held down again if the host cleared
+ * them.
+ *
+ * \param[out] emulator The emulator.
+ * \param[in]  now      The CLOCK_MONOTONIC time to advance to.
+ */
+void emulatorAdvance(struct emulator *emulator, const struct timespec *now) {
+  const double minutes = elapsed(now, &emulator->now) / 60;
+  int i;
+
+  if (minutes <= 0) {
+    return;
+  }
+
+  emulator->now = *now;
+
+  if (emulator->mode == 2) {
+    emulator->battery -= emulator->discharge * minutes;
+    if (emulator->battery < 0) {
+      emulator->battery = 0;
+    }
+  }
+
+  for (i = 0; i < EMULATOR_KEYS; i++) {
+    struct emulatorKey *key = &emulator->key[i];
+
+    if (key->held && (elapsed(now, &key->release) >= 0)) {
+      key->held = 0;
+    }
+    if (key->held) {
+      latch(emulator, key);
+    }
+  }
+}
+
+/**\brief FSSD pin state
+ *
+ * \param[in] emulator The emulator.
+ *
+ * \returns 0 if the FSSD pin is LOW, i.e. the PIco wants the Pi to shut down,
+ *          1 if it's HIGH.
+ */
+int emulatorFSSD(const struct emulator *emulator) {
+  if (emulator->forced >= 0) {
+    return emulator->forced;
+  }
+
+  return !((emulator->mode == 2) &&
+           (emulator->battery <= emulator->threshold));
+}
+
+/**\brief Registers at 0x69
+ *
+ * Lays out the model's state the way the PIco does at address 0x69.
+ *
+ * \param[in]  emulator The emulator.
+ * \param[out] reg      The registers.
+ */
+static void status(const struct emulator *emulator,
+                   uint8_t reg[EMULATOR_REGISTERS]) {
+  const unsigned int battery = setBCD((long)emulator->battery);
+  const unsigned int host = setBCD(emulator->host);
+  int i;
+
+  memcpy(reg, emulator->reg[0], EMULATOR_REGISTERS);
+
+  reg[0x00] = emulator->mode;
+  reg[0x01] = battery & 0xff;
+  reg[0x02] = battery >> 8;
+  reg[0x03] = host & 0xff;
+  reg[0x04] = host >> 8;
+  for (i = 0; i < EMULATOR_KEYS; i++) {
+    reg[0x09 + i] = emulator->key[i].latched;
+  }
+  reg[0x0c] = setBCD(emulator->temperature[0]);
+  reg[0x0d] = setBCD(emulator->temperature[1]);
+}
+
+/**\brief Clear a key
+ *
+ * Handles the host writing to a key register: writing 0 clears the latch, and
+ * records how long the key was latched for.
+ *
+ * \param[out] emulator The emulator.
+ * \param[in]  i        The key.
+ * \param[in]  value    The value the host wrote.
+ */
+static void clear(struct emulator *emulator, int i, uint8_t value) {
+  struct emulatorKey *key = &emulator->key[i];
+  double latency;
+
+  if (value != 0) {
+    latch(emulator, key);
+    return;
+  }
+
+  if (!key->latched) {
+    return;
+  }
+
+  key->latched = 0;
+  latency = elapsed(&emulator->now, &key->since);
+  if ((emulator->clears == 0) || (latency < emulator->latencyMin)) {
+    emulator->latencyMin = latency;
+  }
+  if (latency > emulator->latencyMax) {
+    emulator->latencyMax = latency;
+  }
+  emulator->latency += latency;
+  emulator->clears++;
+}
+
+/**\brief Answer a request.
+ *
+ * Carries out a read or write request, and turns the message into the answer.
+ * Requests for any address other than 0x69 and 0x6b, or for registers beyond
+ * the modelled ones, aren't acknowledged, as with the real bus.
+ *
+ * \param[out]    emulator The emulator.
+ * \param[in,out] message  The request, replaced by the answer.
+ *
+ * \returns 0 if the request was acknowledged, negative numbers otherwise.
+ */
+int emulatorTransfer(struct emulator *emulator,
+                     struct emulatorMessage *message) {
+  uint8_t reg[EMULATOR_REGISTERS];
+  const int operation = message->operation;
+  int device, i;
+
+  if ((message->addr != 0x69) && (message->addr != 0x6b)) {
+    device = -1;
+  } else {
+    device = message->addr == 0x69 ? 0 : 1;
+  }
+
+  message->operation = 1;
+
+  if ((device < 0) || (message->length > EMULATOR_MAX_LENGTH) ||
+      (message->reg + message->length > EMULATOR_REGISTERS)) {
+    emulator->naks++;
+    return -1;
+  }
+
+  if (operation == emulatorRead) {
+    if (device == 0) {
+      status(emulator, reg);
+    } else {
+      memcpy(reg, emulator->reg[1], EMULATOR_REGISTERS);
+      reg[0x00] = emulator->version;
+    }
+    memcpy(message->data, reg + message->reg, message->length);
+    emulator->reads++;
+  } else if (operation == emulatorWrite) {
+    for (i = 0; i < message->length; i++) {
+      const int r = message->reg + i;
+
+      if ((device == 0) && (r >= 0x09) && (r < 0x09 + EMULATOR_KEYS)) {
+        clear(emulator, r - 0x09, message->data[i]);
+      } else {
+        emulator->reg[device][r] = message->data[i];
+      }
+    }
+    emulator->writes++;
+  } else {
+    emulator->naks++;
+    return -1;
+  }
+
+  message->operation = 0;
+  return 0;
+}
+
+/**\brief Run a command.
+ *
+ * Changes the model's state. The commands are:
+ *
+ * * "mode [1|2]" plugs the PIco in, or switches it to battery.
+ * * "battery [cV]" and "host [cV]" set the voltages.
+ * * "temperature [1|2] [degrees]" sets a temperature.
+ * * "discharge [cV/min]" sets the rate at which the battery drains while on
+ *   battery.
+ * * "threshold [cV]" sets the battery voltage at which the FSSD pin goes LOW.
+ * * "fssd [0|1|auto]" forces the FSSD pin LOW or HIGH, or lets the battery
+ *   voltage decide again.
+ * * "press [a|b|f] [ms]" holds a key down for the given time.
+ * * "version [n]" sets the firmware version.
+ *
+ * \param[out] emulator The emulator.
+ * \param[in]  command  The command.
+ *
+ * \returns 0 on success, negative numbers if the command isn't valid.
+ */
+int emulatorCommand(struct emulator *emulator, const char *command) {
+  char name[16], argument[16];
+  double value;
+  long n;
+  const char *k;
+  struct emulatorKey *key;
+
+  if (sscanf(command, "%15s %15s", name, argument) != 2) {
+    return -1;
+  }
+
+  if (strcmp(name, "press") == 0) {
+    if ((argument[1] != 0) || ((k = strchr(keyName, argument[0])) == 0) ||
+        (sscanf(command, "%*s %*s %ld", &n) != 1) || (n < 0)) {
+      return -1;
+    }
+    key = &emulator->key[k - keyName];
+    key->held = 1;
+    key->pressed = emulator->now;
+    key->pending = 1;
+    key->release = emulator->now;
+    key->release.tv_sec += n / 1000;
+    key->release.tv_nsec += (n % 1000) * 1000000;
+    if (key->release.tv_nsec >= 1000000000) {
+      key->release.tv_sec++;
+      key->release.tv_nsec -= 1000000000;
+    }
+    latch(emulator, key);
+    return 0;
+  }
+
+  if (strcmp(name, "fssd") == 0) {
+    if (strcmp(argument, "auto") == 0) {
+      emulator->forced = -1;
+    } else if (strcmp(argument, "0") == 0) {
+      emulator->forced = 0;
+    } else if (strcmp(argument, "1") == 0) {
+      emulator->forced = 1;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  if (strcmp(name, "temperature") == 0) {
+    if ((sscanf(command, "%*s %ld %lf", &n, &value) != 2) || (n < 1) ||
+        (n > 2)) {
+      return -1;
+    }
+    emulator->temperature[n - 1] = value;
+    return 0;
+  }
+
+  if (sscanf(argument, "%lf", &value) != 1) {
+    return -1;
+  }
+
+  if ((strcmp(name, "mode") == 0) && ((value == 1) || (value == 2))) {
+    emulator->mode = value;
+  } else if (strcmp(name, "battery") == 0) {
+    emulator->battery = value;
+  } else if (strcmp(name, "host") == 0) {
+    emulator->host = value;
+  } else if (strcmp(name, "discharge") == 0) {
+    emulator->discharge = value;
+  } else if (strcmp(name, "threshold") == 0) {
+    emulator->threshold = value;
+  } else if (strcmp(name, "version") == 0) {
+    emulator->version = value;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+/**\file
+ * \brief PIco emulator.
+ *
+ * A model of the PIco, for running pico-i2cd and picod without the hardware:
+ * the register map at I2C addresses 0x69 and 0x6b, with BCD-encoded voltages
+ * and temperatures, the keys that latch when pressed until the host clears
+ * them, and the FSSD pin that goes LOW when the battery runs out. The model is
+ * driven by simple timed commands, such as "discharge 5" or "press b 700", so
+ * that a scenario plays out the same way every time.
+ *
+ * pico-emu serves the register map on a Unix domain socket, which the I2C layer
+ * talks to instead of an I2C device file when it's given the socket's path, and
+ * keeps the pins in a directory tree with the same layout as the sysfs GPIO
+ * interface, for picod's '-g'.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_EMULATOR_H)
+#define PICO_EMULATOR_H
+
+/* for uint8_t */
+#include <stdint.h>
+
+/* for struct timespec */
+#include <time.h>
+
+/**\brief Default emulator socket
+ *
+ * Where pico-emu serves the register map, unless told otherwise.
+ */
+#define EMULATOR_SOCKET "/tmp/pico-emu.sock"
+
+/**\brief Maximum transfer length
+ *
+ * The most registers a single request may read or write; the same as the SMBus
+ * block limit.
+ */
+#define EMULATOR_MAX_LENGTH 32
+
+/**\brief Number of registers
+ *
+ * The number of registers the emulator models at each address.
+ */
+#define EMULATOR_REGISTERS 0x20
+
+/**\brief Number of keys
+ *
+ * The number of keys the emulator models; the same as PICO_KEYS.
+ */
+#define EMULATOR_KEYS 3
+
+/**\brief Request type
+ *
+ * What a request on the emulator socket asks for.
+ */
+enum emulatorOperation {
+  /**\brief Read registers
+   *
+   * Read 'length' registers, starting at 'reg'.
+   */
+  emulatorRead,
+
+  /**\brief Write registers
+   *
+   * Write 'length' registers, starting at 'reg'.
+   */
+  emulatorWrite
+};
+
+/**\brief Emulator message
+ *
+ * A request on the emulator socket, or the answer to one. Each is sent as a
+ * single datagram on a SOCK_SEQPACKET socket, and every request gets exactly
+ * one answer, which stands in for a single bus transaction.
+ */
+struct emulatorMessage {
+  /**\brief Operation or result
+   *
+   * An enum emulatorOperation in requests; 0 in answers if the transfer was
+   * acknowledged, nonzero if it wasn't.
+   */
+  uint8_t operation;
+
+  /**\brief I2C address
+   *
+   * The device to talk to, e.g. 0x69.
+   */
+  uint8_t addr;
+
+  /**\brief Register
+   *
+   * The first register to read or write.
+   */
+  uint8_t reg;
+
+  /**\brief Length
+   *
+   * The number of registers to read or write.
+   */
+  uint8_t length;
+
+  /**\brief Data
+   *
+   * The register contents: written in write requests, read in answers to read
+   * requests.
+   */
+  uint8_t data[EMULATOR_MAX_LENGTH];
+};
+
+/**\brief Emulated key
+ *
+ * The state of one of the PIco's keys.
+ */
+struct emulatorKey {
+  /**\brief Latch
+   *
+   * Nonzero once the key was pressed, until the host clears the register.
+   */
+  char latched;
+
+  /**\brief Held
+   *
+   * Nonzero while the key is held down. A key that is held down is latched
+   * again as soon as the host clears it.
+   */
+  char held;
+
+  /**\brief Release time
+   *
+   * The CLOCK_MONOTONIC time to release the key at, while it's held down.
+   */
+  struct timespec release;
+
+  /**\brief Latch time
+   *
+   * The CLOCK_MONOTONIC time the key was last latched at.
+   */
+  struct timespec since;
+
+  /**\brief Press time
+   *
+   * The CLOCK_MONOTONIC time the key was last pressed at.
+   */
+  struct timespec pressed;
+
+  /**\brief Press pending
+   *
+   * Nonzero from the time the key was pressed until the host reported the
+   * press to the input layer; see pico-emu's '-u'.
+   */
+  char pending;
+};
+
+/**\brief Emulated PIco
+ *
+ * The state of the emulated hardware, and what the host did with it.
+ */
+struct emulator {
+  /**\brief Firmware version
+   *
+   * The byte in register 0x00 at address 0x6b.
+   */
+  long version;
+
+  /**\brief Power mode
+   *
+   * 1 when plugged in, 2 when on battery.
+   */
+  long mode;
+
+  /**\brief Battery voltage
+   *
+   * In centi-volts; kept as a fraction, so that slow discharge rates add up.
+   */
+  double battery;
+
+  /**\brief Host voltage
+   *
+   * In centi-volts.
+   */
+  long host;
+
+  /**\brief Temperatures
+   *
+   * In degrees Celsius, for the built-in and the external sensor.
+   */
+  long temperature[2];
+
+  /**\brief Discharge rate
+   *
+   * Centi-volts per minute that the battery loses while on battery.
+   */
+  double discharge;
+
+  /**\brief FSSD threshold
+   *
+   * The battery voltage at or below which the FSSD pin goes LOW while on
+   * battery, in centi-volts.
+   */
+  double threshold;
+
+  /**\brief FSSD override
+   *
+   * -1 to drive the FSSD pin from the battery voltage, or the pin state to
+   * force.
+   */
+  int forced;
+
+  /**\brief Keys
+   *
+   * KEY_A, KEY_B and KEY_F.
+   */
+  struct emulatorKey key[EMULATOR_KEYS];
+
+  /**\brief Other registers
+   *
+   * Whatever the host wrote to registers that the model doesn't use, at 0x69
+   * and 0x6b.
+   */
+  uint8_t reg[2][EMULATOR_REGISTERS];
+
+  /**\brief Model time
+   *
+   * The CLOCK_MONOTONIC time the model was last advanced to.
+   */
+  struct timespec now;
+
+  /**\brief Reads
+   *
+   * The number of read requests that were answered.
+   */
+  unsigned long reads;
+
+  /**\brief Writes
+   *
+   * The number of write requests that were answered.
+   */
+  unsigned long writes;
+
+  /**\brief NAKs
+   *
+   * The number of requests that weren't acknowledged.
+   */
+  unsigned long naks;
+
+  /**\brief Key latches
+   *
+   * The number of times a key was latched.
+   */
+  unsigned long latches;
+
+  /**\brief Key clears
+   *
+   * The number of times the host cleared a latched key.
+   */
+  unsigned long clears;
+
+  /**\brief Key latency
+   *
+   * The total, lowest and highest number of seconds between a key being
+   * latched and the host clearing it.
+   */
+  double latency, latencyMin, latencyMax;
+};
+
+void emulatorInit(struct emulator *emulator, const struct timespec *now);
+void emulatorAdvance(struct emulator *emulator, const struct timespec *now);
+int emulatorFSSD(const struct emulator *emulator);
+int emulatorTransfer(struct emulator *emulator,
+                     struct emulatorMessage *message);
+int emulatorCommand(struct emulator *emulator, const char *command);
+
+#endif
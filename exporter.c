@@ -0,0 +1,449 @@
+/**\file
+ * \brief Prometheus exporter.
+ *
+ * Implements the HTTP exporter declared in exporter.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#define _GNU_SOURCE
+
+#include "exporter.h"
+
+/* for socket(), bind(), listen(), accept4(), send(), recv() */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* for epoll_ctl() */
+#include <sys/epoll.h>
+
+/* for getaddrinfo() */
+#include <netdb.h>
+
+/* for close() */
+#include <unistd.h>
+
+/* for malloc(), free() */
+#include <stdlib.h>
+
+/* for strrchr(), strstr(), strncmp(), memcpy() */
+#include <string.h>
+
+/* for errno */
+#include <errno.h>
+
+/**\brief Maximum address length
+ *
+ * The longest listen address we accept, including the port.
+ */
+#define MAX_ADDRESS 256
+
+/**\brief Open the exporter
+ *
+ * Starts listening on the given address, which is written as host:port, e.g.
+ * 127.0.0.1:9101 or [::1]:9101. Leaving out the host, as in :9101, listens on
+ * all addresses. The listening socket is added to the given epoll instance,
+ * and so are its clients, once they're accepted.
+ *
+ * \param[out] exporter The exporter state to initialise.
+ * \param[in]  address  The address to listen on.
+ * \param[in]  epoll    The epoll instance to add the socket and its clients
+ *                      to.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int exporterOpen(struct exporter *exporter, const char *address, int epoll) {
+  struct addrinfo hints, *info, *i;
+  struct epoll_event event;
+  char host[MAX_ADDRESS];
+  char *port;
+  int one = 1;
+  int n;
+
+  exporter->fd = -1;
+  exporter->epoll = epoll;
+  exporter->requests = 0;
+
+  for (n = 0; n < EXPORTER_MAX_CLIENTS; n++) {
+    exporter->client[n].fd = -1;
+    exporter->client[n].response = 0;
+  }
+
+  if (strlen(address) >= sizeof(host)) {
+    return -1;
+  }
+  strcpy(host, address);
+
+  port = strrchr(host, ':');
+  if (port == 0) {
+    return -1;
+  }
+  *port++ = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if (host[0] == '[') {
+    /* strip the brackets around IPv6 addresses. */
+    host[strlen(host) - 1] = 0;
+    if (getaddrinfo(host + 1, port, &hints, &info) != 0) {
+      return -2;
+    }
+  } else if (getaddrinfo(host[0] ? host : 0, port, &hints, &info) != 0) {
+    return -2;
+  }
+
+  for (i = info; i != 0; i = i->ai_next) {
+    exporter->fd = socket(i->ai_family,
+                          i->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                          i->ai_protocol);
+    if (exporter->fd < 0) {
+      continue;
+    }
+
+    (void)setsockopt(exporter->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if ((bind(exporter->fd, i->ai_addr, i->ai_addrlen) == 0) &&
+        (listen(exporter->fd, 16) == 0)) {
+      break;
+    }
+
+    (void)close(exporter->fd);
+    exporter->fd = -1;
+  }
+
+  freeaddrinfo(info);
+
+  if (exporter->fd < 0) {
+    return -3;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = exporter->fd;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, exporter->fd, &event) < 0) {
+    (void)exporterClose(exporter);
+    return -4;
+  }
+
+  return 0;
+}
+
+/**\brief Disconnect a client.
+ *
+ * \param[in,out] exporter The exporter state.
+ * \param[in,out] client   The client to disconnect.
+ */
+static void disconnect(struct exporter *exporter,
+                       struct exporterClient *client) {
+  (void)epoll_ctl(exporter->epoll, EPOLL_CTL_DEL, client->fd, 0);
+  (void)close(client->fd);
+  client->fd = -1;
+  free(client->response);
+  client->response = 0;
+}
+
+/**\brief Accept a client
+ *
+ * Accepts a connection on the listening socket, adds it to the epoll instance
+ * and starts the clock on it. Call this when the listening socket is readable.
+ *
+ * \param[in,out] exporter The exporter state.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int exporterAccept(struct exporter *exporter) {
+  struct exporterClient *client;
+  struct epoll_event event;
+  int fd, i;
+
+  fd = accept4(exporter->fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < EXPORTER_MAX_CLIENTS; i++) {
+    if (exporter->client[i].fd < 0) {
+      break;
+    }
+  }
+
+  if (i == EXPORTER_MAX_CLIENTS) {
+    (void)close(fd);
+    return -2;
+    /* we're full; the ones we have will be done or gone within a second. */
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(exporter->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+    (void)close(fd);
+    return -3;
+  }
+
+  client = &exporter->client[i];
+  client->fd = fd;
+  client->length = 0;
+  client->response = 0;
+  client->size = 0;
+  client->sent = 0;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &client->deadline);
+  client->deadline.tv_sec += EXPORTER_TIMEOUT / 1000000;
+  client->deadline.tv_nsec += (long)(EXPORTER_TIMEOUT % 1000000) * 1000;
+  if (client->deadline.tv_nsec >= 1000000000) {
+    client->deadline.tv_sec++;
+    client->deadline.tv_nsec -= 1000000000;
+  }
+
+  return 0;
+}
+
+/**\brief Prepare a response.
+ *
+ * Answers a complete request: requests for /metrics get the cached metrics,
+ * everything else gets a 404. The response is kept with the client, to be
+ * sent as the client takes it.
+ *
+ * \param[in,out] exporter The exporter state.
+ * \param[in,out] client   The client with the complete request.
+ * \param[in]     metrics  The metrics to serve.
+ * \param[in]     i2c      The I2C state struct, for the bus statistics.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+static int respond(struct exporter *exporter, struct exporterClient *client,
+                   const struct metrics *metrics, const struct i2c *i2c) {
+  static const char notFound[] =
+      "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+      "Content-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+  char header[128];
+  char *body = 0;
+  size_t size = 0, length;
+  int written;
+  FILE *out;
+
+  exporter->requests++;
+
+  if ((strncmp(client->request, "GET /metrics ", 13) != 0) &&
+      (strncmp(client->request, "GET /metrics?", 13) != 0)) {
+    client->response = malloc(sizeof(notFound) - 1);
+    if (client->response == 0) {
+      return -1;
+    }
+    memcpy(client->response, notFound, sizeof(notFound) - 1);
+    client->size = sizeof(notFound) - 1;
+    return 0;
+  }
+
+  out = open_memstream(&body, &size);
+  if (out == 0) {
+    return -1;
+  }
+
+  written = metricsWrite(metrics, i2c, out);
+  written |= fprintf(out,
+                     "# HELP pico_http_requests_total Number of HTTP "
+                     "requests answered by the exporter.\n"
+                     "# TYPE pico_http_requests_total counter\n"
+                     "pico_http_requests_total %lu\n",
+                     exporter->requests) < 0;
+
+  if ((fclose(out) != 0) || (written != 0)) {
+    free(body);
+    return -1;
+  }
+
+  (void)snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                 (unsigned long)size);
+  length = strlen(header);
+
+  client->response = malloc(length + size);
+  if (client->response == 0) {
+    free(body);
+    return -1;
+  }
+  memcpy(client->response, header, length);
+  memcpy(client->response + length, body, size);
+  client->size = length + size;
+  free(body);
+
+  return 0;
+}
+
+/**\brief Handle a client's event
+ *
+ * Reads what the client sent, until the request is complete, and then sends
+ * it the response, as much of it as the socket takes at a time. Once it's all
+ * been sent, or the client goes away, it's disconnected. Call this when a
+ * client socket is readable or writable.
+ *
+ * \param[in,out] exporter The exporter state.
+ * \param[in]     fd       The client socket.
+ * \param[in]     metrics  The metrics to serve.
+ * \param[in]     i2c      The I2C state struct, for the bus statistics.
+ *
+ * \returns 0 on success, -1 if the file descriptor isn't one of our clients,
+ *          other negative values if the client had to be disconnected.
+ */
+int exporterHandle(struct exporter *exporter, int fd,
+                   const struct metrics *metrics, const struct i2c *i2c) {
+  struct exporterClient *client = 0;
+  struct epoll_event event;
+  ssize_t r;
+  int i;
+
+  for (i = 0; i < EXPORTER_MAX_CLIENTS; i++) {
+    if (exporter->client[i].fd == fd) {
+      client = &exporter->client[i];
+      break;
+    }
+  }
+
+  if (client == 0) {
+    return -1;
+  }
+
+  if (client->response == 0) {
+    r = recv(fd, client->request + client->length,
+             sizeof(client->request) - 1 - client->length, 0);
+    if ((r < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+      return 0;
+    }
+    if (r <= 0) {
+      disconnect(exporter, client);
+      return -2;
+      /* the client went away before finishing its request. */
+    }
+    client->length += r;
+    client->request[client->length] = 0;
+
+    if (!strstr(client->request, "\r\n\r\n") &&
+        !strstr(client->request, "\n\n") &&
+        (client->length < sizeof(client->request) - 1)) {
+      return 0;
+    }
+
+    if (respond(exporter, client, metrics, i2c) < 0) {
+      disconnect(exporter, client);
+      return -3;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT;
+    event.data.fd = fd;
+    (void)epoll_ctl(exporter->epoll, EPOLL_CTL_MOD, fd, &event);
+    /* try to send right away; usually the whole response fits. */
+  }
+
+  while (client->sent < client->size) {
+    r = send(fd, client->response + client->sent, client->size - client->sent,
+             MSG_NOSIGNAL);
+    if ((r < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if ((r < 0) && (errno == EAGAIN)) {
+      return 0;
+    }
+    if (r < 0) {
+      disconnect(exporter, client);
+      return -4;
+    }
+    client->sent += r;
+  }
+
+  disconnect(exporter, client);
+
+  return 0;
+}
+
+/**\brief When a client needs looking after.
+ *
+ * Finds the earliest deadline of the connected clients, so that callers can
+ * include that in their waits and call exporterExpire() then.
+ *
+ * \param[in]  exporter The exporter state.
+ * \param[out] due      Set to the earliest deadline.
+ *
+ * \returns 1 if there's such a deadline, 0 if there are no clients.
+ */
+int exporterDue(const struct exporter *exporter, struct timespec *due) {
+  const struct timespec *t;
+  int rv = 0;
+  int i;
+
+  for (i = 0; i < EXPORTER_MAX_CLIENTS; i++) {
+    if (exporter->client[i].fd < 0) {
+      continue;
+    }
+
+    t = &exporter->client[i].deadline;
+    if ((rv == 0) || (t->tv_sec < due->tv_sec) ||
+        ((t->tv_sec == due->tv_sec) && (t->tv_nsec < due->tv_nsec))) {
+      *due = *t;
+    }
+    rv = 1;
+  }
+
+  return rv;
+}
+
+/**\brief Disconnect late clients.
+ *
+ * Disconnects all clients whose deadline has passed, whether or not they're
+ * done.
+ *
+ * \param[in,out] exporter The exporter state.
+ */
+void exporterExpire(struct exporter *exporter) {
+  struct timespec now;
+  const struct timespec *t;
+  int i;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (i = 0; i < EXPORTER_MAX_CLIENTS; i++) {
+    t = &exporter->client[i].deadline;
+    if ((exporter->client[i].fd >= 0) &&
+        ((t->tv_sec < now.tv_sec) ||
+         ((t->tv_sec == now.tv_sec) && (t->tv_nsec <= now.tv_nsec)))) {
+      disconnect(exporter, &exporter->client[i]);
+    }
+  }
+}
+
+/**\brief Close the exporter
+ *
+ * \param[in,out] exporter The exporter state.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int exporterClose(struct exporter *exporter) {
+  int rv = 0;
+  int i;
+
+  if (exporter->fd >= 0) {
+    for (i = 0; i < EXPORTER_MAX_CLIENTS; i++) {
+      if (exporter->client[i].fd >= 0) {
+        disconnect(exporter, &exporter->client[i]);
+      }
+    }
+
+    rv = close(exporter->fd);
+    exporter->fd = -1;
+  }
+
+  return rv;
+}
@@ -0,0 +1,138 @@
+/**\file
+ * \brief Prometheus exporter.
+ *
+ * A minimal HTTP server that answers requests for /metrics with the cached
+ * metrics. It never touches the bus itself: the metrics are refreshed on the
+ * daemon's own schedule, so it doesn't matter how many scrapers there are or
+ * how often they come by.
+ *
+ * Connections are non-blocking and handled on the daemon's event loop, along
+ * with everything else. Each one has a deadline for the whole exchange, so a
+ * slow or stuck client only ever costs a connection slot, never the loop's
+ * time.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_EXPORTER_H)
+#define PICO_EXPORTER_H
+
+/* for struct timespec */
+#include <time.h>
+
+#include "metrics.h"
+
+/**\brief Maximum number of clients
+ *
+ * The most clients that can be connected at the same time; any more are
+ * turned away.
+ */
+#define EXPORTER_MAX_CLIENTS 16
+
+/**\brief Maximum request size
+ *
+ * How much of a request we read; anything past this is ignored.
+ */
+#define EXPORTER_MAX_REQUEST 1024
+
+/**\brief Connection timeout
+ *
+ * Microseconds a client has to send its request and take our response, from
+ * when it was accepted, before it's disconnected.
+ */
+#define EXPORTER_TIMEOUT 1000000
+
+/**\brief Exporter client
+ *
+ * A connected client, and how far along its request and response are.
+ */
+struct exporterClient {
+  /**\brief Client socket
+   *
+   * The client's file descriptor, or -1 if this slot is free.
+   */
+  int fd;
+
+  /**\brief Request buffer
+   *
+   * The part of the request that was received so far.
+   */
+  char request[EXPORTER_MAX_REQUEST];
+
+  /**\brief Request length
+   *
+   * The number of bytes in the request buffer.
+   */
+  size_t length;
+
+  /**\brief Response
+   *
+   * The response, once the request is complete, or NULL until then.
+   */
+  char *response;
+
+  /**\brief Response size
+   *
+   * The number of bytes in the response.
+   */
+  size_t size;
+
+  /**\brief Bytes sent
+   *
+   * The number of bytes of the response that were sent so far.
+   */
+  size_t sent;
+
+  /**\brief Deadline
+   *
+   * The CLOCK_MONOTONIC time the client is disconnected at, done or not.
+   */
+  struct timespec deadline;
+};
+
+/**\brief Exporter state
+ *
+ * The listening socket, its clients, and what it has done so far.
+ */
+struct exporter {
+  /**\brief Listening socket
+   *
+   * The file descriptor of the listening socket, or -1 if the exporter isn't
+   * running.
+   */
+  int fd;
+
+  /**\brief epoll instance
+   *
+   * The epoll file descriptor that the listening socket and the client sockets
+   * are added to.
+   */
+  int epoll;
+
+  /**\brief Clients
+   *
+   * The connected clients.
+   */
+  struct exporterClient client[EXPORTER_MAX_CLIENTS];
+
+  /**\brief Requests
+   *
+   * The number of HTTP requests that were answered so far.
+   */
+  unsigned long requests;
+};
+
+int exporterOpen(struct exporter *exporter, const char *address, int epoll);
+int exporterAccept(struct exporter *exporter);
+int exporterHandle(struct exporter *exporter, int fd,
+                   const struct metrics *metrics, const struct i2c *i2c);
+int exporterDue(const struct exporter *exporter, struct timespec *due);
+void exporterExpire(struct exporter *exporter);
+int exporterClose(struct exporter *exporter);
+
+#endif
@@ -0,0 +1,386 @@
+/**\file
+ * \brief PIco fan control.
+ *
+ * Implements the fan controller declared in fan.h on top of the fan kit's
+ * registers in pico.h's register table.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "fan.h"
+
+/* for open() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* for pread(), close() */
+#include <unistd.h>
+
+/* for strtol() */
+#include <stdlib.h>
+
+/* for memset() */
+#include <string.h>
+
+/**\brief Maximum sysfs read
+ *
+ * Enough for a thermal zone's temperature or the throttling flags, with a
+ * newline.
+ */
+#define MAX_BUFFER 32
+
+/**\brief Seconds between two points in time.
+ *
+ * \param[in] a A point in time.
+ * \param[in] b Another point in time.
+ *
+ * \returns The number of seconds from 'b' to 'a'.
+ */
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+  return (double)(a->tv_sec - b->tv_sec) +
+         (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**\brief Parse a fan curve.
+ *
+ * Parses a curve of the form "40:0,50:30,60:100": comma-separated points of a
+ * temperature in degrees Celsius and a duty cycle in percent. Temperatures
+ * have to increase from one point to the next, and duty cycles must not
+ * decrease.
+ *
+ * \param[out] fan   The fan controller to set the curve of.
+ * \param[in]  curve The curve to parse.
+ *
+ * \returns 0 on success, -1 if the curve is malformed.
+ */
+static int parse(struct fan *fan, const char *curve) {
+  const char *p = curve;
+  char *end;
+  struct fanPoint *point;
+
+  fan->points = 0;
+
+  do {
+    if (fan->points == FAN_POINTS) {
+      return -1;
+    }
+    point = &fan->curve[fan->points];
+
+    point->temperature = strtol(p, &end, 10);
+    if ((end == p) || (*end != ':')) {
+      return -1;
+    }
+    p = end + 1;
+
+    point->duty = strtol(p, &end, 10);
+    if ((end == p) || ((*end != ',') && (*end != 0)) || (point->duty < 0) ||
+        (point->duty > 100)) {
+      return -1;
+    }
+    p = end + 1;
+
+    if ((fan->points > 0) &&
+        ((point->temperature <= point[-1].temperature) ||
+         (point->duty < point[-1].duty))) {
+      return -1;
+    }
+
+    fan->points++;
+  } while (*end == ',');
+
+  return 0;
+}
+
+/**\brief Duty cycle for a temperature.
+ *
+ * Looks up a temperature on the curve, interpolating between the two points
+ * around it.
+ *
+ * \param[in] fan         The fan controller with the curve.
+ * \param[in] temperature The temperature, in degrees Celsius.
+ *
+ * \returns The duty cycle, in percent.
+ */
+static long duty(const struct fan *fan, long temperature) {
+  const struct fanPoint *a, *b;
+  long span;
+  int i;
+
+  if (temperature <= fan->curve[0].temperature) {
+    return fan->curve[0].duty;
+  }
+
+  for (i = 1; i < fan->points; i++) {
+    if (temperature < fan->curve[i].temperature) {
+      a = &fan->curve[i - 1];
+      b = &fan->curve[i];
+      span = b->temperature - a->temperature;
+
+      return a->duty +
+             ((b->duty - a->duty) * (temperature - a->temperature) + span / 2) /
+                 span;
+    }
+  }
+
+  return fan->curve[fan->points - 1].duty;
+}
+
+/**\brief Read a number from sysfs.
+ *
+ * \param[in] fd   The file to read.
+ * \param[in] base The number's base, e.g. 10 or 16.
+ *
+ * \returns The number, or -1 if it couldn't be read.
+ */
+static long readNumber(int fd, int base) {
+  char buf[MAX_BUFFER];
+  char *end;
+  ssize_t n;
+  long value;
+
+  n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n < 1) {
+    return -1;
+  }
+  buf[n] = 0;
+
+  value = strtol(buf, &end, base);
+  if ((end == buf) || (value < 0)) {
+    return -1;
+  }
+
+  return value;
+}
+
+/**\brief Set up a fan controller.
+ *
+ * Parses the curve and opens the SoC files. The throttling flags are optional:
+ * if they can't be opened, the controller runs without them.
+ *
+ * \param[out] fan        The fan controller to set up.
+ * \param[in]  curve      The fan curve; see parse().
+ * \param[in]  hysteresis How far the temperature has to drop, in degrees
+ *                        Celsius, before the duty is lowered again.
+ * \param[in]  zone       The SoC thermal zone's temperature file, e.g.
+ *                        /sys/class/thermal/thermal_zone0/temp, or NULL to
+ *                        only use the PIco's sensors.
+ * \param[in]  throttle   The firmware's throttling flags, or NULL.
+ *
+ * \returns 0 on success, -1 if the curve is malformed and -2 if the thermal
+ *          zone couldn't be opened.
+ */
+int fanOpen(struct fan *fan, const char *curve, long hysteresis,
+            const char *zone, const char *throttle) {
+  memset(fan, 0, sizeof(*fan));
+  fan->zone = -1;
+  fan->throttle = -1;
+  fan->soc = -1;
+  fan->temperature = -1;
+  fan->duty = -1;
+  fan->mode = -1;
+  fan->hysteresis = hysteresis;
+
+  if (parse(fan, curve) < 0) {
+    fan->points = 0;
+    return -1;
+  }
+
+  if (zone != 0) {
+    fan->zone = open(zone, O_RDONLY | O_CLOEXEC);
+    if (fan->zone < 0) {
+      fan->points = 0;
+      return -2;
+    }
+  }
+
+  if (throttle != 0) {
+    fan->throttle = open(throttle, O_RDONLY | O_CLOEXEC);
+    /* not every kernel has these; we just don't count throttling then. */
+  }
+
+  return 0;
+}
+
+/**\brief Tear down a fan controller.
+ *
+ * Closes the SoC files. This leaves the fan running at its last duty.
+ *
+ * \param[out] fan The fan controller to tear down.
+ *
+ * \returns 0 on success, negative numbers on errors.
+ */
+int fanClose(struct fan *fan) {
+  int rv = 0;
+
+  if ((fan->zone >= 0) && (close(fan->zone) < 0)) {
+    rv = -1;
+  }
+  if ((fan->throttle >= 0) && (close(fan->throttle) < 0)) {
+    rv = -1;
+  }
+  fan->zone = -1;
+  fan->throttle = -1;
+  fan->points = 0;
+
+  return rv;
+}
+
+/**\brief Update the fan.
+ *
+ * Picks the duty for the hottest valid temperature - of the PIco's sensors
+ * and, if there is one, the SoC's thermal zone - and sets it, along with the
+ * fan kit's mode, if either differs from what the snapshot says the PIco has,
+ * or from what was last set if the snapshot couldn't read them.
+ * If none of the temperatures are valid, the fan is run at the curve's highest
+ * duty, to be safe.
+ *
+ * A higher duty is set right away. A lower one is only set for a temperature
+ * that's the hysteresis higher than the actual one, so the duty only comes
+ * down once the temperature has dropped that far below where it went up.
+ *
+ * Also samples the throttling flags, and adds the time since the last update
+ * to the time throttled if the SoC was throttled back then.
+ *
+ * \param[in,out] fan    The fan controller.
+ * \param[out]    i2c    The I2C state struct.
+ * \param[in]     status A fresh snapshot of the PIco's status.
+ * \param[in]     now    The CLOCK_MONOTONIC time of the snapshot.
+ *
+ * \returns 0 on success, negative numbers if the PIco couldn't be written to.
+ */
+int fanUpdate(struct fan *fan, struct i2c *i2c, const struct picoStatus *status,
+              const struct timespec *now) {
+  const struct picoRegister *mode = &picoRegisters[picoFanMode];
+  const struct picoRegister *speed = &picoRegisters[picoFanSpeed];
+  long temperature = -1, current, target, relaxed, flags, soc;
+  long running;
+  int rv = 0;
+
+  if (status->value[picoTemperature1] > temperature) {
+    temperature = status->value[picoTemperature1];
+  }
+  if (status->value[picoTemperature2] > temperature) {
+    temperature = status->value[picoTemperature2];
+  }
+  /* invalid and unreadable sensors are negative, so they never win. */
+
+  if (fan->zone >= 0) {
+    soc = readNumber(fan->zone, 10);
+    fan->soc = soc < 0 ? -1 : (soc + 500) / 1000;
+    if (fan->soc > temperature) {
+      temperature = fan->soc;
+    }
+  }
+
+  if (fan->throttle >= 0) {
+    if (fan->throttled) {
+      fan->throttledSeconds += elapsed(now, &fan->updated);
+    }
+    flags = readNumber(fan->throttle, 16);
+    fan->throttled = (flags > 0) && (flags & FAN_THROTTLED_MASK);
+  }
+  fan->updated = *now;
+  fan->temperature = temperature;
+
+  current = status->value[picoFanSpeed] >= 0 ? status->value[picoFanSpeed]
+                                             : fan->duty;
+
+  if (temperature < 0) {
+    target = fan->curve[fan->points - 1].duty;
+  } else {
+    target = duty(fan, temperature);
+    if ((current >= 0) && (target < current)) {
+      relaxed = duty(fan, temperature + fan->hysteresis);
+      target = relaxed < current ? relaxed : current;
+    }
+  }
+
+  if (target != current) {
+    if (setByte(i2c, speed->addr, speed->reg, target) < 0) {
+      rv = -1;
+    } else {
+      fan->writes++;
+      current = target;
+    }
+  }
+  fan->duty = current;
+
+  running = status->value[picoFanMode] >= 0 ? status->value[picoFanMode]
+                                            : fan->mode;
+  if (running != 1) {
+    if (setByte(i2c, mode->addr, mode->reg, 1) < 0) {
+      rv = -2;
+    } else {
+      fan->writes++;
+      running = 1;
+    }
+  }
+  fan->mode = running;
+  /* the speed goes first, so the fan starts up at the right duty. Like the
+     duty, the mode falls back to what we last knew if it couldn't be read. */
+
+  return rv;
+}
+
+/**\brief Write the fan metrics.
+ *
+ * Writes the fan controller's state in the Prometheus text format: the duty
+ * and the temperature it was picked for, the number of writes, and the SoC's
+ * temperature and time throttled, if those are available.
+ *
+ * \param[in]  fan The fan controller to write.
+ * \param[out] out Where to write the metrics to.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+int fanWrite(const struct fan *fan, FILE *out) {
+  if (fprintf(out,
+              "# HELP pico_fan_duty_percent Fan duty set by the controller, "
+              "in percent.\n"
+              "# TYPE pico_fan_duty_percent gauge\n"
+              "pico_fan_duty_percent %ld\n"
+              "# HELP pico_fan_control_temperature_celsius_degrees "
+              "Temperature the fan duty was picked for.\n"
+              "# TYPE pico_fan_control_temperature_celsius_degrees gauge\n"
+              "pico_fan_control_temperature_celsius_degrees %ld\n"
+              "# HELP pico_fan_writes_total Number of fan duty and mode "
+              "writes since the daemon was started.\n"
+              "# TYPE pico_fan_writes_total counter\n"
+              "pico_fan_writes_total %lu\n",
+              fan->duty, fan->temperature, fan->writes) < 0) {
+    return -1;
+  }
+
+  if ((fan->zone >= 0) &&
+      (fprintf(out,
+               "# HELP pico_soc_temperature_celsius_degrees Temperature of "
+               "the SoC's thermal zone.\n"
+               "# TYPE pico_soc_temperature_celsius_degrees gauge\n"
+               "pico_soc_temperature_celsius_degrees %ld\n",
+               fan->soc) < 0)) {
+    return -1;
+  }
+
+  if ((fan->throttle >= 0) &&
+      (fprintf(out,
+               "# HELP pico_soc_throttled 1 if the SoC was throttled at the "
+               "last refresh, 0 otherwise.\n"
+               "# TYPE pico_soc_throttled gauge\n"
+               "pico_soc_throttled %d\n"
+               "# HELP pico_soc_throttled_seconds_total Time the SoC spent "
+               "throttled, as sampled at each refresh.\n"
+               "# TYPE pico_soc_throttled_seconds_total counter\n"
+               "pico_soc_throttled_seconds_total %.10g\n",
+               fan->throttled != 0, fan->throttledSeconds) < 0)) {
+    return -1;
+  }
+
+  return 0;
+}
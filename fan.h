@@ -0,0 +1,179 @@
+/**\file
+ * \brief PIco fan control.
+ *
+ * A closed-loop controller for the PIco's fan kit. Each time the status
+ * snapshot is refreshed, the fan's duty cycle is picked from a curve of
+ * temperatures and duty cycles, using the hottest of the PIco's two sensors
+ * and, optionally, the SoC's thermal zone. The duty goes up as soon as the
+ * temperature does, but only comes back down once the temperature has dropped
+ * by the hysteresis, so the fan doesn't flap around a point on the curve. The
+ * bus is only written to when the duty actually changes.
+ *
+ * The controller also samples the firmware's throttling flags, if they're
+ * available, to count the time the SoC spent throttled.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_FAN_H)
+#define PICO_FAN_H
+
+/* for FILE */
+#include <stdio.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "i2c.h"
+#include "pico.h"
+
+/**\brief Curve points
+ *
+ * The most points a fan curve can have.
+ */
+#define FAN_POINTS 8
+
+/**\brief Default hysteresis
+ *
+ * How far the temperature has to drop, in degrees Celsius, before the duty is
+ * lowered again.
+ */
+#define FAN_HYSTERESIS 3
+
+/**\brief Default throttling flags
+ *
+ * The Raspberry Pi firmware's throttling flags, as a hexadecimal bitmask.
+ */
+#define FAN_THROTTLED "/sys/devices/platform/soc/soc:firmware/get_throttled"
+
+/**\brief Throttling mask
+ *
+ * The flags that count as throttled: the ARM frequency being capped, the SoC
+ * being throttled, and the soft temperature limit being active.
+ */
+#define FAN_THROTTLED_MASK 0xe
+
+/**\brief Curve point
+ *
+ * A temperature, and the duty cycle to run the fan at from there on.
+ */
+struct fanPoint {
+  /**\brief Temperature
+   *
+   * In degrees Celsius.
+   */
+  long temperature;
+
+  /**\brief Duty cycle
+   *
+   * In percent.
+   */
+  long duty;
+};
+
+/**\brief Fan controller
+ *
+ * The fan curve, the optional SoC inputs, and what the controller did so far.
+ */
+struct fan {
+  /**\brief Fan curve
+   *
+   * The curve's points, by increasing temperature. Between two points, the
+   * duty is interpolated; below the first and above the last, the duty of
+   * that point is used.
+   */
+  struct fanPoint curve[FAN_POINTS];
+
+  /**\brief Number of points
+   *
+   * The number of points in the curve, or 0 if fan control is off.
+   */
+  int points;
+
+  /**\brief Hysteresis
+   *
+   * How far the temperature has to drop, in degrees Celsius, before the duty
+   * is lowered again.
+   */
+  long hysteresis;
+
+  /**\brief Thermal zone
+   *
+   * The file descriptor of the SoC thermal zone's temperature, or -1 to only
+   * use the PIco's sensors.
+   */
+  int zone;
+
+  /**\brief Throttling flags
+   *
+   * The file descriptor of the firmware's throttling flags, or -1 if they're
+   * not available.
+   */
+  int throttle;
+
+  /**\brief SoC temperature
+   *
+   * The last reading of the thermal zone, in degrees Celsius, or -1 if it
+   * couldn't be read.
+   */
+  long soc;
+
+  /**\brief Control temperature
+   *
+   * The temperature the duty was last picked for, or -1 if there was no valid
+   * reading and the fan was run at full duty instead.
+   */
+  long temperature;
+
+  /**\brief Duty cycle
+   *
+   * The duty the fan was last set to, in percent, or -1 if it hasn't been set
+   * yet.
+   */
+  long duty;
+
+  /**\brief Fan mode
+   *
+   * The fan kit's mode as last read or written, or -1 if it's not known yet.
+   */
+  long mode;
+
+  /**\brief Writes
+   *
+   * The number of times the duty or mode was written to the PIco.
+   */
+  unsigned long writes;
+
+  /**\brief Throttled
+   *
+   * Nonzero if the SoC was throttled at the last update.
+   */
+  char throttled;
+
+  /**\brief Time throttled
+   *
+   * Seconds the SoC spent throttled, as sampled at each update.
+   */
+  double throttledSeconds;
+
+  /**\brief Update time
+   *
+   * The CLOCK_MONOTONIC time of the last update, or 0 if there hasn't been
+   * one yet.
+   */
+  struct timespec updated;
+};
+
+int fanOpen(struct fan *fan, const char *curve, long hysteresis,
+            const char *zone, const char *throttle);
+int fanClose(struct fan *fan);
+int fanUpdate(struct fan *fan, struct i2c *i2c, const struct picoStatus *status,
+              const struct timespec *now);
+int fanWrite(const struct fan *fan, FILE *out);
+
+#endif
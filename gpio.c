@@ -0,0 +1,700 @@
+/**\file
+ * \brief GPIO pin handles.
+ *
+ * Implements the handle layer declared in gpio.h on top of the sysfs GPIO
+ * interface and the GPIO character device interface. Setting up a pin is
+ * comparatively expensive, but is only done once; after that, every access to
+ * the pin is a single syscall on a file descriptor that stays open, and is
+ * timed in the handle's histogram.
+ *
+ * Right after a pin is exported, its files may still belong to root until udev
+ * gets around to changing that. Rather than sleeping and retrying, setup
+ * watches the pin's directory with inotify, which reports udev's chmod() and
+ * chown() calls, and tries again as soon as something changes. Pins that are
+ * exported already aren't exported again.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "gpio.h"
+
+/* for open() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* for access(), pread(), pwrite(), close() */
+#include <unistd.h>
+
+/* for snprintf() */
+#include <stdio.h>
+
+/* for memset(), strncpy() */
+#include <string.h>
+
+/* for ioctl() */
+#include <sys/ioctl.h>
+
+/* for GPIO character device structures and ioctl()s */
+#include <linux/gpio.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for poll(), POLLPRI, POLLERR, POLLIN */
+#include <poll.h>
+
+/* for inotify_init1(), inotify_add_watch() */
+#include <sys/inotify.h>
+
+/**\brief Maximum length of GPIO file name.
+ *
+ * This is the maximum length of a GPIO file that we're willing to support.
+ */
+#define MAX_GPIO_FN 256
+
+/**\brief Internal buffer size.
+ *
+ * Size of internal buffers used throughout the code.
+ */
+#define MAX_BUFFER 32
+
+/**\brief Recheck interval
+ *
+ * Milliseconds that gpioReady() waits for an inotify event before it checks
+ * the pins again anyway. sysfs doesn't report new files or directories to
+ * inotify, only changes to their permissions, so this catches the rest.
+ */
+#define RECHECK_INTERVAL 20
+
+unsigned long gpioSyscalls = 0;
+
+/**\brief Close a file descriptor.
+ *
+ * Closes the given file descriptor, retrying if interrupted by a signal.
+ *
+ * \param[in] fd The file descriptor to close.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int closeFD(int fd) {
+  int rv;
+
+  do {
+    gpioSyscalls++;
+    rv = close(fd);
+  } while ((rv < 0) && (errno == EINTR));
+
+  return rv;
+}
+
+/**\brief Export GPIO pin
+ *
+ * Linux's sysfs interface for GPIO pins requires setting up the pins that you
+ * intend to use by first "exporting" them, which creates the pin's control
+ * files in sysfs. This function tells the kernel to do so.
+ *
+ * \param[in] root The sysfs GPIO root.
+ * \param[in] gpio The pin to export.
+ *
+ * \returns 0 on success, negative numbers on (partial) failures.
+ */
+static int export(const char *root, int gpio) {
+  int fd;
+  char fn[MAX_GPIO_FN];
+  char bf[MAX_BUFFER];
+  int rv = 0;
+  int blen = 0;
+
+  blen = snprintf(bf, MAX_BUFFER, "%i", gpio);
+  if (blen < 0) {
+    return -1;
+  }
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/export", root) < 0) {
+    return -1;
+  }
+
+  gpioSyscalls++;
+  fd = open(fn, O_WRONLY);
+  if (fd < 0) {
+    return -2;
+  }
+
+  gpioSyscalls++;
+  if (write(fd, bf, blen) < blen) {
+    rv = -3;
+  }
+
+  if (closeFD(fd) < 0) {
+    rv = -4;
+  }
+
+  return rv;
+}
+
+/**\brief Set a GPIO pin's I/O direction.
+ *
+ * Set the I/O direction of a GPIO pin that has previously been exported.
+ *
+ * \param[in] root   The sysfs GPIO root.
+ * \param[in] gpio   The pin to set up.
+ * \param[in] output Nonzero for output, 0 for input.
+ *
+ * \returns 0 on success, negative numbers on (partial) failures.
+ */
+static int direction(const char *root, int gpio, char output) {
+  int fd;
+  char fn[MAX_GPIO_FN];
+  int rv = 0;
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/gpio%i/direction", root, gpio) < 0) {
+    return -1;
+  }
+
+  gpioSyscalls++;
+  fd = open(fn, O_WRONLY);
+  if (fd < 0) {
+    return -2;
+  }
+
+  gpioSyscalls++;
+  if (output) {
+    if (write(fd, "out\n", 4) < 4) {
+      rv = -3;
+    }
+  } else {
+    if (write(fd, "in\n", 3) < 3) {
+      rv = -3;
+    }
+  }
+
+  if (closeFD(fd) < 0) {
+    rv = -4;
+  }
+
+  return rv;
+}
+
+/**\brief Open a GPIO pin's value file.
+ *
+ * Opens the value file of a pin that has previously been exported, for reading
+ * or writing depending on the pin's I/O direction.
+ *
+ * \param[in] root   The sysfs GPIO root.
+ * \param[in] gpio   The pin to open.
+ * \param[in] output Nonzero for output, 0 for input.
+ *
+ * \returns The file descriptor on success, negative numbers on failure.
+ */
+static int value(const char *root, int gpio, char output) {
+  char fn[MAX_GPIO_FN];
+  int fd;
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/gpio%i/value", root, gpio) < 0) {
+    return -1;
+  }
+
+  gpioSyscalls++;
+  fd = open(fn, output ? O_WRONLY : O_RDONLY);
+  if (fd < 0) {
+    return -2;
+  }
+
+  return fd;
+}
+
+/**\brief Request a GPIO line.
+ *
+ * Requests a single line from a GPIO character device. Output lines start out
+ * LOW; input lines have edge detection enabled for both edges, so that the
+ * line request's file descriptor becomes readable when the pin changes.
+ *
+ * \param[in] chip   The GPIO chip device, e.g. GPIO_CHARDEV.
+ * \param[in] gpio   The line offset to request.
+ * \param[in] output Nonzero for output, 0 for input.
+ *
+ * \returns The line request's file descriptor on success, negative numbers on
+ *          failure.
+ */
+static int line(const char *chip, int gpio, char output) {
+  struct gpio_v2_line_request request;
+  int fd;
+  int rv = 0;
+
+  memset(&request, 0, sizeof(request));
+  request.offsets[0] = gpio;
+  request.num_lines = 1;
+  strncpy(request.consumer, "picod", GPIO_MAX_NAME_SIZE - 1);
+
+  if (output) {
+    request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  } else {
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+                           GPIO_V2_LINE_FLAG_EDGE_RISING |
+                           GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  }
+
+  gpioSyscalls++;
+  fd = open(chip, O_RDONLY);
+  if (fd < 0) {
+    return -2;
+  }
+
+  gpioSyscalls++;
+  if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+    rv = -3;
+  }
+
+  /* the line request has its own file descriptor, so the chip is no longer
+   * needed once the request has gone through. */
+  if ((closeFD(fd) < 0) && (rv == 0)) {
+    rv = -4;
+  }
+
+  if (rv < 0) {
+    if (request.fd > 0) {
+      (void)closeFD(request.fd);
+    }
+    return rv;
+  }
+
+  return request.fd;
+}
+
+/**\brief Seconds since a point in time.
+ *
+ * \param[in] then A CLOCK_MONOTONIC time in the past.
+ *
+ * \returns The number of seconds since 'then'.
+ */
+static double since(const struct timespec *then) {
+  struct timespec now;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - then->tv_sec) +
+         (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Check whether a pin is exported.
+ *
+ * \param[in] root The sysfs GPIO root.
+ * \param[in] gpio The pin to check.
+ *
+ * \returns Nonzero if the pin's directory exists.
+ */
+static char exported(const char *root, int gpio) {
+  char fn[MAX_GPIO_FN];
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/gpio%i", root, gpio) < 0) {
+    return 0;
+  }
+
+  gpioSyscalls++;
+  return access(fn, F_OK) == 0;
+}
+
+/**\brief Watch a pin's directory.
+ *
+ * Adds the pin's directory to an inotify instance, for changes to the
+ * attributes of its files. Watching the same directory again is harmless.
+ *
+ * \param[in] fd   The inotify instance.
+ * \param[in] root The sysfs GPIO root.
+ * \param[in] gpio The pin to watch.
+ *
+ * \returns 0 on success, negative numbers on failure, e.g. if the directory
+ *          doesn't exist yet.
+ */
+static int watch(int fd, const char *root, int gpio) {
+  char fn[MAX_GPIO_FN];
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/gpio%i", root, gpio) < 0) {
+    return -1;
+  }
+
+  gpioSyscalls++;
+  return inotify_add_watch(fd, fn, IN_ATTRIB | IN_CREATE) < 0 ? -2 : 0;
+}
+
+/**\brief Request a GPIO pin.
+ *
+ * Starts setting up a pin handle. With the sysfs backend, this exports the pin
+ * unless it's exported already; gpioReady() then finishes the setup. With the
+ * character device backend, the pin is requested as a line on the given GPIO
+ * chip, which is all there is to it.
+ *
+ * \param[out] gpio    The handle to initialise.
+ * \param[in]  backend The kernel interface to use.
+ * \param[in]  root    The sysfs GPIO root, e.g. GPIO_SYSFS_ROOT, or the GPIO
+ *                     chip device, e.g. GPIO_CHARDEV.
+ * \param[in]  pin     The pin to set up.
+ * \param[in]  output  Nonzero for output, 0 for input.
+ *
+ * \returns 0 on success, negative numbers on (partial) failures.
+ */
+int gpioRequest(struct gpio *gpio, enum gpioBackend backend, const char *root,
+                int pin, char output) {
+  int rv;
+
+  gpio->backend = backend;
+  gpio->root = root;
+  gpio->pin = pin;
+  gpio->output = output;
+  gpio->fd = -1;
+  gpio->events = 0;
+  gpio->setup = -1;
+  memset(&gpio->latency, 0, sizeof(gpio->latency));
+  (void)clock_gettime(CLOCK_MONOTONIC, &gpio->requested);
+
+  if (backend == gpioChardev) {
+    rv = line(root, pin, output);
+    if (rv < 0) {
+      return rv;
+    }
+
+    gpio->fd = rv;
+    gpio->setup = since(&gpio->requested);
+
+    return 0;
+  }
+
+  if (exported(root, pin)) {
+    /* exporting it again would fail with EBUSY. */
+    return 0;
+  }
+
+  return export(root, pin);
+}
+
+/**\brief Wait for GPIO pins to be ready.
+ *
+ * Finishes setting up pins that were requested with gpioRequest(): sets their
+ * I/O direction and opens their value files, as soon as their files can be
+ * used. Until then, this waits for the files' attributes to change, for all of
+ * the pins at once, but no longer than GPIO_READY_TIMEOUT. Pins that are ready
+ * already are skipped.
+ *
+ * \param[in,out] gpio  The pin handles.
+ * \param[in]     count The number of pin handles.
+ *
+ * \returns 0 on success, negative numbers if any of the pins could not be set
+ *          up; those have a file descriptor of -1.
+ */
+int gpioReady(struct gpio *const *gpio, int count) {
+  struct pollfd pfd;
+  char buffer[4096];
+  int pending, error = 0, rv, i;
+
+  gpioSyscalls++;
+  pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  pfd.events = POLLIN;
+  /* without inotify, we'll just have to check every RECHECK_INTERVAL. */
+
+  if ((count > 0) && (pfd.fd >= 0)) {
+    gpioSyscalls++;
+    (void)inotify_add_watch(pfd.fd, gpio[0]->root, IN_CREATE | IN_ONLYDIR);
+    /* for pins whose directories don't exist yet; sysfs creates them right
+       away, but a test tree may not. */
+  }
+
+  while (1) {
+    double waited = 0;
+
+    pending = 0;
+
+    for (i = 0; i < count; i++) {
+      struct gpio *pin = gpio[i];
+
+      if (pin->fd >= 0) {
+        continue;
+      }
+
+      if (pfd.fd >= 0) {
+        (void)watch(pfd.fd, pin->root, pin->pin);
+        /* before trying, so that we don't miss a change in between. */
+      }
+
+      rv = direction(pin->root, pin->pin, pin->output);
+      if (rv == 0) {
+        rv = value(pin->root, pin->pin, pin->output);
+      }
+      if (rv >= 0) {
+        pin->fd = rv;
+        pin->setup = since(&pin->requested);
+        continue;
+      }
+
+      if (since(&pin->requested) > waited) {
+        waited = since(&pin->requested);
+      }
+      error = rv;
+      pending++;
+    }
+
+    if ((pending == 0) || (waited >= GPIO_READY_TIMEOUT / 1e6)) {
+      break;
+    }
+
+    gpioSyscalls++;
+    if (pfd.fd >= 0) {
+      if (poll(&pfd, 1, RECHECK_INTERVAL) > 0) {
+        gpioSyscalls++;
+        while (read(pfd.fd, buffer, sizeof(buffer)) > 0) {
+          gpioSyscalls++;
+        }
+        /* what changed doesn't matter, we'll just try again. */
+      }
+    } else {
+      (void)poll(0, 0, RECHECK_INTERVAL);
+    }
+  }
+
+  if (pfd.fd >= 0) {
+    (void)closeFD(pfd.fd);
+  }
+
+  return pending > 0 ? error : 0;
+}
+
+/**\brief Set up a GPIO pin handle.
+ *
+ * Requests a single pin with gpioRequest(), and waits for it with gpioReady().
+ * The handle may then be used with gpioSet() or gpioGet(). To set up several
+ * pins, request all of them first, and then wait for all of them together.
+ *
+ * \param[out] gpio    The handle to initialise.
+ * \param[in]  backend The kernel interface to use.
+ * \param[in]  root    The sysfs GPIO root, e.g. GPIO_SYSFS_ROOT, or the GPIO
+ *                     chip device, e.g. GPIO_CHARDEV.
+ * \param[in]  pin     The pin to set up.
+ * \param[in]  output  Nonzero for output, 0 for input.
+ *
+ * \returns 0 on success, negative numbers on (partial) failures.
+ */
+int gpioSetup(struct gpio *gpio, enum gpioBackend backend, const char *root,
+              int pin, char output) {
+  int rv = gpioRequest(gpio, backend, root, pin, output);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  return gpioReady(&gpio, 1);
+}
+
+/**\brief Set a GPIO pin's state
+ *
+ * Pins can either be LOW or HIGH. This function sets a pin to the given target
+ * state. The pin must previously have been set up as an output pin.
+ *
+ * \param[in] gpio  The pin to set.
+ * \param[in] state The state to set the pin to.
+ *
+ * \returns 0 on success, negative numbers on (partial) failures.
+ */
+int gpioSet(struct gpio *gpio, char state) {
+  struct timespec start;
+  int rv = 0;
+
+  if (gpio->fd < 0) {
+    return -1;
+  }
+
+  latencyStart(&start);
+  gpioSyscalls++;
+  if (gpio->backend == gpioChardev) {
+    struct gpio_v2_line_values values = {state ? 1 : 0, 1};
+
+    if (ioctl(gpio->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+      rv = -2;
+    }
+  } else if (pwrite(gpio->fd, state ? "1\n" : "0\n", 2, 0) < 2) {
+    rv = -2;
+  }
+  latencyRecord(&gpio->latency, &start, rv < 0);
+
+  return rv;
+}
+
+/**\brief Get the value of a GPIO pin.
+ *
+ * Queries a GPIO pin's value. The pin must have been set up to be an input pin
+ * beforehand.
+ *
+ * \param[in] gpio The pin to query.
+ *
+ * \returns 1 if the pin is HIGH, 0 if the pin is LOW, negative numbers on
+ *          (partial) failures.
+ */
+int gpioGet(struct gpio *gpio) {
+  char buf[MAX_BUFFER];
+  struct timespec start;
+  int rv;
+
+  if (gpio->fd < 0) {
+    return -1;
+  }
+
+  latencyStart(&start);
+  gpioSyscalls++;
+  if (gpio->backend == gpioChardev) {
+    struct gpio_v2_line_values values = {0, 1};
+
+    if (ioctl(gpio->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+      rv = -2;
+    } else {
+      rv = (values.bits & 1) ? 1 : 0;
+    }
+  } else if (pread(gpio->fd, buf, MAX_BUFFER, 0) < 1) {
+    rv = -2;
+  } else {
+    rv = (buf[0] == '1');
+  }
+  latencyRecord(&gpio->latency, &start, rv < 0);
+
+  return rv;
+}
+
+/**\brief Arm edge detection on a GPIO pin.
+ *
+ * Makes the pin's file descriptor signal falling edges to poll(), so that
+ * callers can wait for the pin to go LOW instead of sampling it. With the sysfs
+ * backend this writes to the pin's 'edge' file, and edges are signalled with
+ * POLLPRI. Line requests from the character device backend already have edge
+ * detection enabled, and signal edges with POLLIN.
+ *
+ * In both cases, the poll() events to wait for are stored in the handle, and
+ * an edge must be consumed with gpioEvent() before waiting for the next one.
+ *
+ * \param[in,out] gpio The input pin to arm.
+ *
+ * \returns 0 on success, negative numbers on failure. The pin can still be
+ *          sampled with gpioGet() if this fails.
+ */
+int gpioEdge(struct gpio *gpio) {
+  char fn[MAX_GPIO_FN];
+  char buf[MAX_BUFFER];
+  int fd;
+  int rv = 0;
+
+  if ((gpio->fd < 0) || gpio->output) {
+    return -1;
+  }
+
+  if (gpio->backend == gpioChardev) {
+    gpio->events = POLLIN;
+    return 0;
+  }
+
+  if (snprintf(fn, MAX_GPIO_FN, "%s/gpio%i/edge", gpio->root, gpio->pin) < 0) {
+    return -1;
+  }
+
+  gpioSyscalls++;
+  fd = open(fn, O_WRONLY);
+  if (fd < 0) {
+    return -2;
+  }
+
+  gpioSyscalls++;
+  if (write(fd, "falling\n", 8) < 8) {
+    rv = -3;
+  }
+
+  if (closeFD(fd) < 0) {
+    rv = -4;
+  }
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  /* sysfs flags the value file as changed until it's been read once. */
+  gpioSyscalls++;
+  if (pread(gpio->fd, buf, MAX_BUFFER, 0) < 1) {
+    return -5;
+  }
+
+  gpio->events = POLLPRI | POLLERR;
+
+  return 0;
+}
+
+/**\brief Consume an edge on a GPIO pin.
+ *
+ * To be called after poll() has signalled one of the handle's edge events. This
+ * reads the edge, which clears the condition for the next poll(), and reports
+ * the pin's new value.
+ *
+ * The character device backend gets the time of the edge from the kernel. The
+ * sysfs backend has no such thing, so the time this function was called is
+ * used instead.
+ *
+ * \param[in]  gpio The input pin that had an edge.
+ * \param[out] when Set to the CLOCK_MONOTONIC time of the edge, unless NULL.
+ *
+ * \returns 1 if the pin went HIGH, 0 if the pin went LOW, negative numbers on
+ *          failure.
+ */
+int gpioEvent(struct gpio *gpio, struct timespec *when) {
+  if (gpio->events == 0) {
+    return -1;
+  }
+
+  if (gpio->backend == gpioChardev) {
+    struct gpio_v2_line_event event;
+    struct timespec start;
+    char failed;
+
+    latencyStart(&start);
+    gpioSyscalls++;
+    failed = read(gpio->fd, &event, sizeof(event)) < (ssize_t)sizeof(event);
+    latencyRecord(&gpio->latency, &start, failed);
+    if (failed) {
+      return -2;
+    }
+
+    if (when != NULL) {
+      when->tv_sec = event.timestamp_ns / 1000000000;
+      when->tv_nsec = event.timestamp_ns % 1000000000;
+    }
+
+    return (event.id == GPIO_V2_LINE_EVENT_RISING_EDGE) ? 1 : 0;
+  }
+
+  if (when != NULL) {
+    (void)clock_gettime(CLOCK_MONOTONIC, when);
+  }
+
+  return gpioGet(gpio);
+}
+
+/**\brief Release a GPIO pin handle.
+ *
+ * Closes the pin's value file or line request. With the sysfs backend, the pin
+ * itself stays exported; with the character device backend, closing the line
+ * request releases the line.
+ *
+ * \param[in] gpio The pin to release.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int gpioClose(struct gpio *gpio) {
+  int rv = 0;
+
+  if (gpio->fd >= 0) {
+    rv = closeFD(gpio->fd);
+    gpio->fd = -1;
+    gpio->events = 0;
+  }
+
+  return rv;
+}
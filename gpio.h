@@ -0,0 +1,154 @@
+/**\file
+ * \brief GPIO pin handles.
+ *
+ * A small layer on top of Linux's sysfs GPIO interface. Pins are exported and
+ * set up once, and the pin's value file is kept open for the lifetime of the
+ * handle, so that toggling or sampling a pin in a loop only costs a single
+ * pwrite() or pread() instead of a path lookup, open(), write() and close().
+ *
+ * Setting up a pin with the sysfs interface takes two steps: exporting it,
+ * and then waiting for udev to make the pin's files usable. gpioRequest() does
+ * the first and gpioReady() the second, for any number of pins at once, so
+ * that the waits overlap.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_GPIO_H)
+#define PICO_GPIO_H
+
+/* for struct timespec */
+#include <time.h>
+
+/* for struct latency */
+#include "latency.h"
+
+/**\brief Default sysfs GPIO root
+ *
+ * Where the kernel's sysfs GPIO interface lives. This can be pointed elsewhere,
+ * e.g. at a plain directory tree with the same layout for testing.
+ */
+#define GPIO_SYSFS_ROOT "/sys/class/gpio"
+
+/**\brief Setup timeout
+ *
+ * Microseconds that gpioReady() waits for a pin's files to become usable after
+ * it was exported.
+ */
+#define GPIO_READY_TIMEOUT 1000000
+
+/**\brief Default GPIO character device
+ *
+ * The GPIO chip that the Raspberry Pi's header pins are on, for the character
+ * device backend. The pin numbers are used as line offsets on this chip.
+ */
+#define GPIO_CHARDEV "/dev/gpiochip0"
+
+/**\brief GPIO backend
+ *
+ * Selects the kernel interface that a pin handle uses.
+ */
+enum gpioBackend {
+  /**\brief sysfs backend
+   *
+   * Use /sys/class/gpio, or a directory tree with the same layout.
+   */
+  gpioSysfs,
+
+  /**\brief Character device backend
+   *
+   * Use the /dev/gpiochipN line request interface.
+   */
+  gpioChardev
+};
+
+/**\brief GPIO pin handle
+ *
+ * Contains everything we need to remember about a pin that has been set up.
+ */
+struct gpio {
+  /**\brief Backend
+   *
+   * The kernel interface used to access the pin.
+   */
+  enum gpioBackend backend;
+
+  /**\brief sysfs root or GPIO chip
+   *
+   * For the sysfs backend, the directory containing the 'export' file and the
+   * gpioN directories. For the character device backend, the GPIO chip device.
+   */
+  const char *root;
+
+  /**\brief Pin number
+   *
+   * The GPIO pin number, as understood by the kernel.
+   */
+  int pin;
+
+  /**\brief Pin I/O direction
+   *
+   * Nonzero for output pins, 0 for input pins.
+   */
+  char output;
+
+  /**\brief Pin file descriptor
+   *
+   * The open file descriptor of the pin's value file with the sysfs backend, or
+   * of the line request with the character device backend. -1 if the pin has
+   * not been set up yet.
+   */
+  int fd;
+
+  /**\brief Edge poll() events
+   *
+   * The poll() events that signal an edge on the pin's file descriptor, once
+   * edge detection has been armed with gpioEdge(). 0 if it hasn't been.
+   */
+  short events;
+
+  /**\brief Request time
+   *
+   * The CLOCK_MONOTONIC time gpioRequest() was called at.
+   */
+  struct timespec requested;
+
+  /**\brief Setup time
+   *
+   * Seconds from gpioRequest() until the pin was ready to use; -1 if it isn't
+   * yet.
+   */
+  double setup;
+
+  /**\brief Access latency
+   *
+   * How long each gpioSet(), gpioGet() and gpioEvent() on the pin took, and how
+   * often they failed.
+   */
+  struct latency latency;
+};
+
+/**\brief GPIO syscall counter
+ *
+ * The number of syscalls issued by this layer so far. Callers can sample this
+ * before and after a cycle of work to find out what that cycle cost.
+ */
+extern unsigned long gpioSyscalls;
+
+int gpioRequest(struct gpio *gpio, enum gpioBackend backend, const char *root,
+                int pin, char output);
+int gpioReady(struct gpio *const *gpio, int count);
+int gpioSetup(struct gpio *gpio, enum gpioBackend backend, const char *root,
+              int pin, char output);
+int gpioSet(struct gpio *gpio, char state);
+int gpioGet(struct gpio *gpio);
+int gpioEdge(struct gpio *gpio);
+int gpioEvent(struct gpio *gpio, struct timespec *when);
+int gpioClose(struct gpio *gpio);
+
+#endif
@@ -0,0 +1,264 @@
+/**\file
+ * \brief PIco heartbeat and FSSD signal.
+ *
+ * Implements the pulse train and FSSD signal handling declared in heartbeat.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Hardware: http://pimodules.com/_pdf/_pico/UPS_PIco_BL_FSSD_V1.0.pdf
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "heartbeat.h"
+
+/* for qsort() */
+#include <stdlib.h>
+
+/* for memcpy(), memset() */
+#include <string.h>
+
+/**\brief Add microseconds to a point in time.
+ *
+ * \param[in,out] t    The time to advance.
+ * \param[in]     usec The number of microseconds to add.
+ */
+static void advance(struct timespec *t, unsigned int usec) {
+  t->tv_sec += usec / 1000000;
+  t->tv_nsec += (long)(usec % 1000000) * 1000;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+/**\brief Time since a point in time.
+ *
+ * \param[in] then A CLOCK_MONOTONIC time.
+ *
+ * \returns The number of seconds since 'then'; negative if it's in the future.
+ */
+static double since(const struct timespec *then) {
+  struct timespec now;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - then->tv_sec) +
+         (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Record a pulse edge.
+ *
+ * Adds the lateness of an edge that was scheduled for the given deadline, and
+ * which has just been sent, to the jitter statistics.
+ *
+ * \param[in,out] jitter   The jitter statistics to update.
+ * \param[in]     deadline When the edge should have been sent.
+ */
+static void recordEdge(struct jitter *jitter, const struct timespec *deadline) {
+  double late = since(deadline);
+
+  if ((jitter->count == 0) || (late < jitter->min)) {
+    jitter->min = late;
+  }
+  if ((jitter->count == 0) || (late > jitter->max)) {
+    jitter->max = late;
+  }
+  jitter->sum += late;
+  jitter->recent[jitter->count % HEARTBEAT_WINDOW] = late;
+  jitter->count++;
+}
+
+/**\brief Compare two doubles.
+ *
+ * Comparison function for qsort().
+ *
+ * \param[in] a Pointer to the first double.
+ * \param[in] b Pointer to the second double.
+ *
+ * \returns Negative, zero or positive numbers if 'a' is smaller than, equal to
+ *          or larger than 'b'.
+ */
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**\brief Start the heartbeat.
+ *
+ * Resets the heartbeat's statistics, and makes the first period start right
+ * away. The pin must have been set up as an output pin with gpioSetup() or
+ * gpioRequest() and gpioReady().
+ *
+ * \param[in,out] heartbeat The heartbeat to start.
+ */
+void heartbeatStart(struct heartbeat *heartbeat) {
+  heartbeat->high = 0;
+  heartbeat->cycles = 0;
+  heartbeat->syscalls = 0;
+  heartbeat->mark = gpioSyscalls;
+  heartbeat->first = -1;
+  memset(&heartbeat->jitter, 0, sizeof(heartbeat->jitter));
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &heartbeat->next);
+  heartbeat->rise = heartbeat->next;
+}
+
+/**\brief Send the next edge.
+ *
+ * To be called once the heartbeat's next edge is due. If the pin is HIGH, it's
+ * set LOW, which ends the pulse. Otherwise, a new period starts, and the pin is
+ * set HIGH if a pulse is wanted; without one, the pin stays LOW for the whole
+ * period. Either way, the heartbeat's 'next' field is then set to when the
+ * following edge is due.
+ *
+ * Deadlines are absolute, so time spent elsewhere doesn't add up over time. If
+ * we've fallen behind by more than a full period, the pulses we missed are
+ * skipped rather than caught up on with a burst of them; the phase of the pulse
+ * train stays the same.
+ *
+ * \param[in,out] heartbeat The heartbeat.
+ * \param[in]     pulse     Nonzero to send a pulse if a new period starts.
+ *
+ * \returns 1 if a new period was started, 0 if a pulse was ended.
+ */
+int heartbeatEdge(struct heartbeat *heartbeat, char pulse) {
+  if (heartbeat->high) {
+    if (gpioSet(&heartbeat->pin, 0) == 0) {
+      recordEdge(&heartbeat->jitter, &heartbeat->next);
+    }
+    heartbeat->high = 0;
+    heartbeat->next = heartbeat->rise;
+    advance(&heartbeat->next, HEARTBEAT_PERIOD);
+
+    return 0;
+  }
+
+  while (since(&heartbeat->next) > HEARTBEAT_PERIOD / 1e6) {
+    advance(&heartbeat->next, HEARTBEAT_PERIOD);
+  }
+
+  heartbeat->rise = heartbeat->next;
+  heartbeat->cycles++;
+  heartbeat->syscalls = gpioSyscalls - heartbeat->mark;
+  heartbeat->mark = gpioSyscalls;
+
+  if (pulse && (gpioSet(&heartbeat->pin, 1) == 0)) {
+    recordEdge(&heartbeat->jitter, &heartbeat->rise);
+    if (heartbeat->first < 0) {
+      heartbeat->first = since(&heartbeat->pin.requested);
+    }
+    heartbeat->high = 1;
+    advance(&heartbeat->next, HEARTBEAT_DURATION);
+  } else {
+    advance(&heartbeat->next, HEARTBEAT_PERIOD);
+  }
+
+  return 1;
+}
+
+/**\brief Stop the heartbeat.
+ *
+ * Ends the current pulse, if there is one, so the pin isn't left HIGH.
+ *
+ * \param[in,out] heartbeat The heartbeat to stop.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int heartbeatStop(struct heartbeat *heartbeat) {
+  if (!heartbeat->high) {
+    return 0;
+  }
+
+  heartbeat->high = 0;
+
+  return gpioSet(&heartbeat->pin, 0);
+}
+
+/**\brief Write heartbeat statistics.
+ *
+ * Writes the number of periods and GPIO syscalls so far, the syscalls it took
+ * to get through the last period, how long it took from requesting the pin to
+ * the first pulse, and the minimum, mean, 99th percentile and maximum of how
+ * late the pulse train's edges were, in the Prometheus text format. The 99th
+ * percentile is calculated over the most recent edges.
+ *
+ * \param[in] heartbeat The heartbeat.
+ * \param[in] out       Where to write to.
+ * \param[in] prefix    The prefix of the metric names, e.g. "picod".
+ */
+void heartbeatWrite(const struct heartbeat *heartbeat, FILE *out,
+                    const char *prefix) {
+  const struct jitter *jitter = &heartbeat->jitter;
+
+  fprintf(out, "%s_cycles_total %lu\n", prefix, heartbeat->cycles);
+  fprintf(out, "%s_gpio_syscalls_total %lu\n", prefix, gpioSyscalls);
+  fprintf(out, "%s_gpio_syscalls_per_cycle %lu\n", prefix,
+          heartbeat->syscalls);
+  if (heartbeat->first >= 0) {
+    fprintf(out, "%s_first_pulse_seconds %.6f\n", prefix, heartbeat->first);
+  }
+
+  fprintf(out, "%s_pulse_edges_total %lu\n", prefix, jitter->count);
+  if (jitter->count > 0) {
+    static double sorted[HEARTBEAT_WINDOW];
+    size_t n =
+        (jitter->count < HEARTBEAT_WINDOW) ? jitter->count : HEARTBEAT_WINDOW;
+    size_t p99 = (n * 99 + 99) / 100 - 1;
+
+    memcpy(sorted, jitter->recent, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compareDouble);
+
+    fprintf(out, "%s_pulse_edge_lateness_min_seconds %.6f\n", prefix,
+            jitter->min);
+    fprintf(out, "%s_pulse_edge_lateness_mean_seconds %.6f\n", prefix,
+            jitter->sum / jitter->count);
+    fprintf(out, "%s_pulse_edge_lateness_p99_seconds %.6f\n", prefix,
+            sorted[p99]);
+    fprintf(out, "%s_pulse_edge_lateness_max_seconds %.6f\n", prefix,
+            jitter->max);
+  }
+}
+
+/**\brief Process the FSSD signal.
+ *
+ * Called whenever we've learned the value of pin #27, either because we sampled
+ * it or because it had an edge. Says whether it's time to act, i.e. if the pin
+ * went LOW after having been HIGH; acting on it is up to the caller.
+ *
+ * Until the pin has been seen HIGH once, it's assumed that the PIco isn't
+ * installed, and a LOW pin means nothing.
+ *
+ * \param[in,out] fssd   The FSSD monitor state.
+ * \param[in]     signal The pin's value; negative values are ignored.
+ * \param[in]     edge   The time of the falling edge, or NULL if the pin was
+ *                       sampled.
+ *
+ * \returns 1 if the FSSD action should be taken now, 0 otherwise.
+ */
+int fssdUpdate(struct fssd *fssd, int signal, const struct timespec *edge) {
+  if (signal == 1) {
+    fssd->wasHigh = 1;
+  }
+
+  if (!fssd->wasHigh || (signal != 0)) {
+    return 0;
+  }
+
+  fssd->latency = (edge != NULL) ? since(edge) : -1;
+
+  fssd->wasHigh = 0;
+  /* reset the FSSD HIGH sensing; the daemon will keep running, though we
+   * can't cancel the shutdown so something external would have to do that. */
+
+  fssd->triggered = 1;
+  /* the Pi is still up while it's shutting down, so keep the pulse train
+   * going until we're told to terminate. */
+
+  return 1;
+}
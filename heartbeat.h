@@ -0,0 +1,211 @@
+/**\file
+ * \brief PIco heartbeat and FSSD signal.
+ *
+ * The PIco watches a pulse train on pin #22 to tell whether the Raspberry Pi is
+ * still running, and pulls pin #27 LOW - the FSSD signal - when it wants the Pi
+ * to shut down, because the battery is about to run out. The pulse train has a
+ * period of 500ms, with the pin HIGH for the first 250ms of it.
+ *
+ * The heartbeat is driven one edge at a time: the caller waits until the next
+ * edge is due, by whatever means it likes, and then has it sent. How late each
+ * edge was is kept track of, which is the pulse train's jitter.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_HEARTBEAT_H)
+#define PICO_HEARTBEAT_H
+
+/* for FILE */
+#include <stdio.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "gpio.h"
+#include "action.h"
+
+/**\brief Jitter window size
+ *
+ * The number of most recent pulse edges that the 99th percentile of their
+ * lateness is calculated over. At two edges per 500ms, this covers a little
+ * over four minutes.
+ */
+#define HEARTBEAT_WINDOW 1024
+
+/**\brief Pulse period
+ *
+ * Microseconds from one rising edge of the pulse train to the next.
+ */
+#define HEARTBEAT_PERIOD 500000
+
+/**\brief Pulse duration
+ *
+ * Microseconds the pin stays HIGH for in each period.
+ */
+#define HEARTBEAT_DURATION 250000
+
+/**\brief Pulse edge jitter
+ *
+ * Keeps track of how late the pulse train's edges were, compared to when they
+ * were scheduled.
+ */
+struct jitter {
+  /**\brief Number of edges
+   *
+   * The number of edges that have been recorded so far.
+   */
+  unsigned long count;
+
+  /**\brief Smallest lateness
+   *
+   * The lateness of the most punctual edge so far, in seconds.
+   */
+  double min;
+
+  /**\brief Largest lateness
+   *
+   * The lateness of the least punctual edge so far, in seconds.
+   */
+  double max;
+
+  /**\brief Sum of lateness
+   *
+   * The lateness of all edges so far, added up, in seconds.
+   */
+  double sum;
+
+  /**\brief Recent lateness
+   *
+   * The lateness of the most recent edges, in seconds, as a ring buffer indexed
+   * by the edge count.
+   */
+  double recent[HEARTBEAT_WINDOW];
+};
+
+/**\brief Heartbeat state
+ *
+ * The pulse train pin, where in the pulse train we are, and how it went so far.
+ */
+struct heartbeat {
+  /**\brief Pulse train pin
+   *
+   * Pin #22, set up as an output pin.
+   */
+  struct gpio pin;
+
+  /**\brief Pin HIGH
+   *
+   * Nonzero while the pin is HIGH, i.e. when the next edge is a falling one.
+   */
+  char high;
+
+  /**\brief Cycle start
+   *
+   * The CLOCK_MONOTONIC time the current period started at.
+   */
+  struct timespec rise;
+
+  /**\brief Next edge
+   *
+   * The CLOCK_MONOTONIC time the next edge is due at. Without a pulse, this is
+   * the start of the next period.
+   */
+  struct timespec next;
+
+  /**\brief Pulse train cycles
+   *
+   * Number of periods that have been started so far.
+   */
+  unsigned long cycles;
+
+  /**\brief GPIO syscalls in the last cycle
+   *
+   * Number of GPIO syscalls it took to get through the last period.
+   */
+  unsigned long syscalls;
+
+  /**\brief GPIO syscalls at cycle start
+   *
+   * The GPIO syscall counter when the current period started.
+   */
+  unsigned long mark;
+
+  /**\brief Pulse edge jitter
+   *
+   * How late the pulse train's edges were.
+   */
+  struct jitter jitter;
+
+  /**\brief Time to first pulse
+   *
+   * Seconds from when the pin was requested until the first pulse went out; -1
+   * until then.
+   */
+  double first;
+};
+
+/**\brief FSSD monitor state
+ *
+ * Everything we need to keep track of to watch the FSSD signal on pin #27, and
+ * to act on it.
+ */
+struct fssd {
+  /**\brief FSSD pin
+   *
+   * Pin #27, set up as an input pin. Edge detection is armed on it if possible.
+   */
+  struct gpio pin;
+
+  /**\brief FSSD processing enabled
+   *
+   * Nonzero unless disabled, in which case the pin is not set up.
+   */
+  char enabled;
+
+  /**\brief Measurement mode
+   *
+   * Nonzero to report reaction times instead of shutting down.
+   */
+  char measure;
+
+  /**\brief FSSD signal seen HIGH
+   *
+   * Nonzero if the pin has been HIGH since we last acted on it going LOW.
+   */
+  char wasHigh;
+
+  /**\brief FSSD action taken
+   *
+   * Nonzero once we've acted on the pin going LOW.
+   */
+  char triggered;
+
+  /**\brief FSSD reaction time
+   *
+   * Time between the last falling edge of the FSSD signal and the daemon
+   * taking action on it, in seconds. Negative if that hasn't happened yet, or
+   * if the pin was sampled rather than seen to have an edge.
+   */
+  double latency;
+
+  /**\brief FSSD action
+   *
+   * How to shut down once the pin goes LOW.
+   */
+  struct action action;
+};
+
+void heartbeatStart(struct heartbeat *heartbeat);
+int heartbeatEdge(struct heartbeat *heartbeat, char pulse);
+int heartbeatStop(struct heartbeat *heartbeat);
+void heartbeatWrite(const struct heartbeat *heartbeat, FILE *out,
+                    const char *prefix);
+int fssdUpdate(struct fssd *fssd, int signal, const struct timespec *edge);
+
+#endif
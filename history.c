@@ -0,0 +1,330 @@
+/**\file
+ * \brief Telemetry history.
+ *
+ * Implements the ring buffer and rolling aggregates declared in history.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "history.h"
+
+/* for calloc(), free() */
+#include <stdlib.h>
+
+/* for memset() */
+#include <string.h>
+
+/**\brief Window lengths
+ *
+ * The length of each window, in seconds, shortest first.
+ */
+static const unsigned int windowSeconds[HISTORY_WINDOWS] = {60, 900, 3600};
+
+/**\brief Window labels
+ *
+ * The label of each window in the metrics.
+ */
+static const char *windowLabel[HISTORY_WINDOWS] = {"1m", "15m", "1h"};
+
+/**\brief Field names
+ *
+ * The metric name of each sample field.
+ */
+static const char *fieldName[HISTORY_FIELDS] = {
+    "pico_mode", "pico_battery_centivolts", "pico_host_centivolts",
+    "pico_temperature_1_celsius_degrees", "pico_temperature_2_celsius_degrees"};
+
+/**\brief Aggregate names
+ *
+ * The suffix of each aggregate's metric name: minimum, maximum and mean.
+ */
+static const char *aggregateName[3] = {"min", "max", "mean"};
+
+/**\brief Aggregate descriptions
+ *
+ * The start of each aggregate's help text.
+ */
+static const char *aggregateHelp[3] = {"Lowest", "Highest", "Mean"};
+
+/**\brief Sample value.
+ *
+ * \param[in] history The history.
+ * \param[in] slot    The ring buffer slot of the sample.
+ * \param[in] field   The field to look up.
+ *
+ * \returns The field's value in the sample.
+ */
+static long value(const struct history *history, uint32_t slot, int field) {
+  return history->sample[slot].value[field];
+}
+
+/**\brief Add to a monotonic queue.
+ *
+ * Drops all entries from the back of the queue that the new sample supersedes,
+ * then adds the new sample to the back.
+ *
+ * \param[in]  history The history.
+ * \param[out] queue   The queue to add to.
+ * \param[in]  field   The field the queue is for.
+ * \param[in]  slot    The ring buffer slot of the new sample.
+ * \param[in]  sign    1 for a minimum queue, -1 for a maximum queue.
+ */
+static void queuePush(const struct history *history, struct historyQueue *queue,
+                      int field, uint32_t slot, long sign) {
+  const long v = sign * value(history, slot, field);
+
+  while ((queue->back > queue->front) &&
+         (sign * value(history,
+                       queue->slot[(queue->back - 1) % history->capacity],
+                       field) >= v)) {
+    queue->back--;
+  }
+
+  queue->slot[queue->back % history->capacity] = slot;
+  queue->back++;
+}
+
+/**\brief Remove from a monotonic queue.
+ *
+ * Drops the front of the queue if it's the sample that is leaving the window.
+ *
+ * \param[in]  history The history.
+ * \param[out] queue   The queue to remove from.
+ * \param[in]  slot    The ring buffer slot of the sample leaving the window.
+ */
+static void queuePop(const struct history *history, struct historyQueue *queue,
+                     uint32_t slot) {
+  if ((queue->back > queue->front) &&
+      (queue->slot[queue->front % history->capacity] == slot)) {
+    queue->front++;
+  }
+}
+
+/**\brief Drop the oldest sample of a window.
+ *
+ * \param[in]  history The history.
+ * \param[out] window  The window to drop the sample from.
+ */
+static void drop(const struct history *history, struct historyWindow *window) {
+  const uint32_t slot = window->start % history->capacity;
+  int f;
+
+  for (f = 0; f < HISTORY_FIELDS; f++) {
+    if (value(history, slot, f) >= 0) {
+      window->sum[f] -= value(history, slot, f);
+      window->count[f]--;
+      queuePop(history, &window->min[f], slot);
+      queuePop(history, &window->max[f], slot);
+    }
+  }
+
+  window->start++;
+}
+
+/**\brief Set up a history.
+ *
+ * Allocates the ring buffer and the windows' queues. This is the only time
+ * the history allocates memory.
+ *
+ * \param[out] history  The history to set up.
+ * \param[in]  capacity The number of samples to keep.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+int historyCreate(struct history *history, size_t capacity) {
+  int w, f;
+
+  memset(history, 0, sizeof(*history));
+
+  if ((capacity == 0) || (capacity > UINT32_MAX)) {
+    return -1;
+  }
+
+  history->capacity = capacity;
+  history->sample = calloc(capacity, sizeof(struct historySample));
+  if (history->sample == 0) {
+    return -2;
+  }
+
+  for (w = 0; w < HISTORY_WINDOWS; w++) {
+    history->window[w].seconds = windowSeconds[w];
+    for (f = 0; f < HISTORY_FIELDS; f++) {
+      history->window[w].min[f].slot = calloc(capacity, sizeof(uint32_t));
+      history->window[w].max[f].slot = calloc(capacity, sizeof(uint32_t));
+      if ((history->window[w].min[f].slot == 0) ||
+          (history->window[w].max[f].slot == 0)) {
+        historyDestroy(history);
+        return -2;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**\brief Add a sample.
+ *
+ * Adds a snapshot to the history, dropping samples from the windows that are
+ * now too old for them, and from the ring buffer if it's full.
+ *
+ * \param[out] history The history to add to.
+ * \param[in]  status  The snapshot to add.
+ * \param[in]  when    The CLOCK_MONOTONIC time the snapshot was read at.
+ */
+void historyAdd(struct history *history, const struct picoStatus *status,
+                const struct timespec *when) {
+  const uint32_t slot = history->samples % history->capacity;
+  struct historySample *sample;
+  struct historyWindow *window;
+  int w, f;
+
+  for (w = 0; w < HISTORY_WINDOWS; w++) {
+    window = &history->window[w];
+    while ((window->start < history->samples) &&
+           ((history->samples - window->start >= history->capacity) ||
+            (when->tv_sec -
+                 history->sample[window->start % history->capacity]
+                     .when.tv_sec >=
+             (time_t)window->seconds))) {
+      drop(history, window);
+    }
+  }
+  /* samples are dropped before the new one overwrites the oldest slot, as the
+   * windows still need the old values to update their sums. */
+
+  sample = &history->sample[slot];
+  sample->when = *when;
+  sample->value[0] = status->value[picoMode];
+  sample->value[1] = status->value[picoBattery];
+  sample->value[2] = status->value[picoHost];
+  sample->value[3] = status->value[picoTemperature1];
+  sample->value[4] = status->value[picoTemperature2];
+
+  for (w = 0; w < HISTORY_WINDOWS; w++) {
+    window = &history->window[w];
+    for (f = 0; f < HISTORY_FIELDS; f++) {
+      if (sample->value[f] >= 0) {
+        window->sum[f] += sample->value[f];
+        window->count[f]++;
+        queuePush(history, &window->min[f], f, slot, 1);
+        queuePush(history, &window->max[f], f, slot, -1);
+      }
+    }
+  }
+
+  history->samples++;
+}
+
+/**\brief Write an aggregate.
+ *
+ * Writes one aggregate of a field over all windows that have samples of it,
+ * preceded by its HELP and TYPE lines.
+ *
+ * \param[in]  history   The history.
+ * \param[out] out       Where to write the aggregate to.
+ * \param[in]  field     The field to write the aggregate of.
+ * \param[in]  kind      The aggregate: 0 for the minimum, 1 for the maximum
+ *                       and 2 for the mean.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+static int aggregate(const struct history *history, FILE *out, int field,
+                     int kind) {
+  const char *aggregate = aggregateName[kind];
+  const struct historyWindow *window;
+  const struct historyQueue *queue;
+  double v;
+  int w;
+
+  if (fprintf(out, "# HELP %s_%s %s %s over the window.\n"
+                   "# TYPE %s_%s gauge\n",
+              fieldName[field], aggregate, aggregateHelp[kind],
+              fieldName[field], fieldName[field], aggregate) < 0) {
+    return -1;
+  }
+
+  for (w = 0; w < HISTORY_WINDOWS; w++) {
+    window = &history->window[w];
+    if (window->count[field] == 0) {
+      continue;
+    }
+
+    if (kind == 2) {
+      v = window->sum[field] / window->count[field];
+    } else {
+      queue = kind == 0 ? &window->min[field] : &window->max[field];
+      v = value(history, queue->slot[queue->front % history->capacity], field);
+    }
+
+    if (fprintf(out, "%s_%s{window=\"%s\"} %.10g\n", fieldName[field],
+                aggregate, windowLabel[w], v) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**\brief Write the aggregates.
+ *
+ * Writes the minimum, maximum and mean of each field over each window, and the
+ * size of the history, in the Prometheus text format.
+ *
+ * \param[in]  history The history to write.
+ * \param[out] out     Where to write the aggregates to.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+int historyWrite(const struct history *history, FILE *out) {
+  int rv = 0;
+  int f, kind;
+
+  for (f = 0; f < HISTORY_FIELDS; f++) {
+    for (kind = 0; kind < 3; kind++) {
+      rv |= aggregate(history, out, f, kind);
+    }
+  }
+
+  if (fprintf(out,
+              "# HELP pico_history_samples Number of samples in the history.\n"
+              "# TYPE pico_history_samples gauge\n"
+              "pico_history_samples %lu\n"
+              "# HELP pico_history_capacity Number of samples the history "
+              "holds.\n"
+              "# TYPE pico_history_capacity gauge\n"
+              "pico_history_capacity %lu\n",
+              history->samples < history->capacity
+                  ? history->samples
+                  : (unsigned long)history->capacity,
+              (unsigned long)history->capacity) < 0) {
+    rv = -1;
+  }
+
+  return rv;
+}
+
+/**\brief Free a history.
+ *
+ * Frees the memory allocated by historyCreate().
+ *
+ * \param[out] history The history to free.
+ */
+void historyDestroy(struct history *history) {
+  int w, f;
+
+  for (w = 0; w < HISTORY_WINDOWS; w++) {
+    for (f = 0; f < HISTORY_FIELDS; f++) {
+      free(history->window[w].min[f].slot);
+      free(history->window[w].max[f].slot);
+    }
+  }
+  free(history->sample);
+
+  memset(history, 0, sizeof(*history));
+}
@@ -0,0 +1,180 @@
+/**\file
+ * \brief Telemetry history.
+ *
+ * A ring buffer of recent PIco status samples, with rolling minimum, maximum
+ * and mean values of each sample field over a few time windows. All memory is
+ * allocated once, when the history is set up, so its size is fixed from then
+ * on. Adding a sample takes amortised constant time, no matter how large the
+ * history or the windows are: the sums are updated as samples come and go, and
+ * the minimum and maximum are kept in monotonic queues.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_HISTORY_H)
+#define PICO_HISTORY_H
+
+/* for size_t */
+#include <stddef.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+/* for FILE */
+#include <stdio.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "pico.h"
+
+/**\brief Number of sample fields
+ *
+ * Power mode, battery and host voltages, and the two temperatures.
+ */
+#define HISTORY_FIELDS 5
+
+/**\brief Number of windows
+ *
+ * The number of time windows that aggregates are kept for.
+ */
+#define HISTORY_WINDOWS 3
+
+/**\brief Default history size
+ *
+ * The number of samples kept by default; at the default refresh interval of 15
+ * seconds, this is a bit over four hours.
+ */
+#define HISTORY_SAMPLES 1024
+
+/**\brief History sample
+ *
+ * A timestamped snapshot of the fields we keep track of.
+ */
+struct historySample {
+  /**\brief Sample time
+   *
+   * The CLOCK_MONOTONIC time the sample was read at.
+   */
+  struct timespec when;
+
+  /**\brief Sample values
+   *
+   * Power mode, battery and host voltages, and the two temperatures. Negative
+   * values couldn't be read, and are left out of the aggregates.
+   */
+  long value[HISTORY_FIELDS];
+};
+
+/**\brief Monotonic queue
+ *
+ * The ring buffer slots of the samples that could still become the minimum or
+ * maximum of a window, oldest first. Their values are sorted, so the front is
+ * always the current minimum or maximum.
+ */
+struct historyQueue {
+  /**\brief Queue entries
+   *
+   * Ring buffer slots, in a ring of their own with the same capacity as the
+   * history.
+   */
+  uint32_t *slot;
+
+  /**\brief Front
+   *
+   * The number of entries ever taken off the front of the queue.
+   */
+  size_t front;
+
+  /**\brief Back
+   *
+   * The number of entries ever added to the back of the queue.
+   */
+  size_t back;
+};
+
+/**\brief History window
+ *
+ * The aggregates over the samples of the last so many seconds.
+ */
+struct historyWindow {
+  /**\brief Window length
+   *
+   * The length of the window, in seconds.
+   */
+  unsigned int seconds;
+
+  /**\brief Oldest sample
+   *
+   * The sequence number of the oldest sample in the window.
+   */
+  unsigned long start;
+
+  /**\brief Sums
+   *
+   * The sum of each field over the valid samples in the window.
+   */
+  double sum[HISTORY_FIELDS];
+
+  /**\brief Counts
+   *
+   * The number of valid samples of each field in the window.
+   */
+  unsigned long count[HISTORY_FIELDS];
+
+  /**\brief Minimum queues
+   *
+   * A monotonic queue for the minimum of each field.
+   */
+  struct historyQueue min[HISTORY_FIELDS];
+
+  /**\brief Maximum queues
+   *
+   * A monotonic queue for the maximum of each field.
+   */
+  struct historyQueue max[HISTORY_FIELDS];
+};
+
+/**\brief History
+ *
+ * The ring buffer of samples, and the windows over it.
+ */
+struct history {
+  /**\brief Capacity
+   *
+   * The number of samples the ring buffer holds.
+   */
+  size_t capacity;
+
+  /**\brief Samples
+   *
+   * The sample sequence number that the next sample gets; that is, the number
+   * of samples that were ever added.
+   */
+  unsigned long samples;
+
+  /**\brief Ring buffer
+   *
+   * The samples; sample n is in slot n modulo the capacity.
+   */
+  struct historySample *sample;
+
+  /**\brief Windows
+   *
+   * The time windows, shortest first.
+   */
+  struct historyWindow window[HISTORY_WINDOWS];
+};
+
+int historyCreate(struct history *history, size_t capacity);
+void historyAdd(struct history *history, const struct picoStatus *status,
+                const struct timespec *when);
+int historyWrite(const struct history *history, FILE *out);
+void historyDestroy(struct history *history);
+
+#endif
@@ -0,0 +1,669 @@
+/**\file
+ * \brief I2C bus access.
+ *
+ * Implements the I2C layer declared in i2c.h on top of the I2C /dev interface
+ * and the SMBus helpers from libi2c-dev, or on top of pico-emu's socket. Each
+ * public accessor has a single exit through account(), which times it.
+ *
+ * The bus lock is made up of open file description locks on single bytes of the
+ * lock file: byte 0 is the bus itself, and bytes 1 and 2 are held shared by
+ * processes that are waiting for the bus with an urgent or normal priority.
+ * Less urgent processes wait for those bytes to be free before they take the
+ * bus, and let go of it again if someone more urgent turned up in the meantime,
+ * so an urgent transfer never waits for more than the one that's in flight. In
+ * the common case, where nobody else wants the bus, this costs two or three
+ * syscalls per transfer.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+/* for F_OFD_SETLKW */
+#define _GNU_SOURCE
+
+#include "i2c.h"
+
+/* for open(), fcntl() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* for close() */
+#include <unistd.h>
+
+/* for socket(), connect(), send(), recv() */
+#include <sys/socket.h>
+
+/* for struct sockaddr_un */
+#include <sys/un.h>
+
+/* for snprintf() */
+#include <stdio.h>
+
+/* for strlen(), strcpy(), memcpy(), memset() */
+#include <string.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for ioctl() */
+#include <sys/ioctl.h>
+
+/* for I2C /dev interface macros */
+/* note that this requires the version of this file from libi2c-dev */
+#include <linux/i2c-dev.h>
+
+/* for the emulator protocol */
+#include "emulator.h"
+
+/**\brief Connect to the emulator.
+ *
+ * \param[in] path The emulator's socket.
+ *
+ * \returns The connected socket, or negative numbers on failure.
+ */
+static int connectEmulator(const char *path) {
+  struct sockaddr_un address;
+  int fd;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    (void)close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**\brief Transfer registers with the emulator.
+ *
+ * Sends a single request to the emulator and waits for its answer; this counts
+ * as one bus transaction.
+ *
+ * \param[out]    i2c       The I2C state struct.
+ * \param[in]     operation emulatorRead or emulatorWrite.
+ * \param[in]     addr      The I2C address to talk to.
+ * \param[in]     reg       The first register to read or write.
+ * \param[in,out] data      The register contents to write, or to read into.
+ * \param[in]     length    The number of registers; at most 32.
+ *
+ * \returns Negative values on failure; 0 otherwise.
+ */
+static int emulate(struct i2c *i2c, int operation, int addr, int reg,
+                   unsigned char *data, int length) {
+  struct emulatorMessage message;
+
+  if ((length < 1) || (length > EMULATOR_MAX_LENGTH)) {
+    return -4;
+  }
+
+  message.operation = operation;
+  message.addr = addr;
+  message.reg = reg;
+  message.length = length;
+  if (operation == emulatorWrite) {
+    memcpy(message.data, data, length);
+  }
+
+  i2c->transactions++;
+  if ((send(i2c->device, &message, sizeof(message), 0) < 0) ||
+      (recv(i2c->device, &message, sizeof(message), 0) <
+       (ssize_t)sizeof(message)) ||
+      (message.operation != 0)) {
+    i2c->errors++;
+    return -3;
+  }
+
+  if (operation == emulatorRead) {
+    memcpy(data, message.data, length);
+  }
+
+  return 0;
+}
+
+/**\brief Open the bus lock.
+ *
+ * The device file is locked directly, so that the lock is shared with every
+ * process that opens it. The emulator's socket can't be locked that way, as
+ * each client has its own, so a lock file next to it is used instead.
+ *
+ * \param[in,out] i2c     The I2C state struct, with the device open.
+ * \param[in]     adaptor The I2C device file or emulator socket.
+ *
+ * \returns The file to lock, or negative numbers on failure.
+ */
+static int openLock(const struct i2c *i2c, const char *adaptor) {
+  char path[256];
+
+  if (i2c->backend == i2cDevice) {
+    return i2c->device;
+  }
+
+  if (snprintf(path, sizeof(path), "%s.lock", adaptor) >= (int)sizeof(path)) {
+    return -1;
+  }
+
+  return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/**\brief Open an I2C adaptor
+ *
+ * Opens the given I2C device file and asks the kernel what the adapter can
+ * do, which decides whether getBlock() can be used. If the path is a socket,
+ * it's taken to be pico-emu's, which can do block transfers.
+ *
+ * \param[out] i2c       The I2C state struct to initialise.
+ * \param[in]  adaptor   The I2C device file, e.g. /dev/i2c-1, or the emulator
+ *                       socket, e.g. EMULATOR_SOCKET.
+ * \param[in]  arbitrate Nonzero to arbitrate the bus with other processes. If
+ *                       the lock file can't be opened, transfers go ahead
+ *                       without that.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int i2cOpen(struct i2c *i2c, const char *adaptor, char arbitrate) {
+  struct stat st;
+
+  memset(i2c, 0, sizeof(*i2c));
+  i2c->backend = i2cDevice;
+  i2c->priority = i2cNormal;
+  i2c->lock = -1;
+
+  if ((stat(adaptor, &st) == 0) && S_ISSOCK(st.st_mode)) {
+    i2c->backend = i2cEmulator;
+    i2c->functions = I2C_FUNC_I2C;
+    i2c->device = connectEmulator(adaptor);
+  } else {
+    i2c->device = open(adaptor, O_RDWR | O_CLOEXEC);
+    if ((i2c->device >= 0) &&
+        (ioctl(i2c->device, I2C_FUNCS, &i2c->functions) < 0)) {
+      i2c->functions = 0;
+      /* we'll just have to assume that only the basics are supported. */
+    }
+  }
+
+  if (i2c->device < 0) {
+    return -1;
+  }
+
+  if (arbitrate) {
+    i2c->lock = openLock(i2c, adaptor);
+  }
+
+  return 0;
+}
+
+/**\brief Close an I2C adaptor
+ *
+ * \param[in,out] i2c The I2C state struct.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int i2cClose(struct i2c *i2c) {
+  int rv;
+
+  if ((i2c->lock >= 0) && (i2c->lock != i2c->device)) {
+    (void)close(i2c->lock);
+  }
+  i2c->lock = -1;
+
+  do {
+    rv = close(i2c->device);
+  } while ((rv < 0) && (errno == EINTR));
+
+  i2c->device = -1;
+
+  return rv;
+}
+
+/**\brief Check for block transfer support
+ *
+ * \param[in] i2c The I2C state struct.
+ *
+ * \returns Nonzero if getBlock() is supported by the adapter.
+ */
+int i2cBlock(struct i2c *i2c) {
+  return (i2c->functions &
+          (I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK)) != 0;
+}
+
+/**\brief Select I2C address
+ *
+ * Sets the I2C address to read data from. If the current address is the same as
+ * the one that was dialed last, this function does not issue a syscall to
+ * change the address.
+ *
+ * \param[out] i2c  The I2C state struct.
+ * \param[in]  addr The I2C address to select.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+static int selectAddr(struct i2c *i2c, int addr) {
+  if (i2c->addr == addr) {
+    return 0;
+  }
+
+  if (ioctl(i2c->device, I2C_SLAVE, addr) < 0) {
+    return -1;
+  }
+
+  i2c->addr = addr;
+
+  return 0;
+}
+
+/**\brief Lock a byte of the lock file.
+ *
+ * \param[in] fd   The lock file.
+ * \param[in] type F_RDLCK, F_WRLCK or F_UNLCK.
+ * \param[in] byte The byte to lock or unlock.
+ * \param[in] wait Nonzero to wait for the lock, 0 to give up if it's held.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+static int lockByte(int fd, short type, off_t byte, char wait) {
+  struct flock lock;
+  int rv;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+
+  do {
+    rv = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+  } while ((rv < 0) && (errno == EINTR));
+
+  return rv;
+}
+
+/**\brief Check for more urgent waiters.
+ *
+ * \param[in] fd       The lock file.
+ * \param[in] priority Our priority class.
+ *
+ * \returns Nonzero if another process is waiting for the bus with a more
+ *          urgent class, or if that couldn't be checked.
+ */
+static char preempted(int fd, enum i2cPriority priority) {
+  struct flock lock;
+
+  if (priority == i2cUrgent) {
+    return 0;
+  }
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 1;
+  lock.l_len = priority;
+
+  return (fcntl(fd, F_OFD_GETLK, &lock) < 0) || (lock.l_type != F_UNLCK);
+}
+
+/**\brief Take the bus lock.
+ *
+ * Waits until the bus is free and nobody more urgent is waiting for it, then
+ * takes it, and records how long that took. Does nothing if the bus isn't
+ * arbitrated.
+ *
+ * \param[in,out] i2c The I2C state struct.
+ */
+static void acquire(struct i2c *i2c) {
+  enum i2cPriority priority = i2c->priority;
+  struct timespec start;
+  char failed = 0;
+  int i;
+
+  if (i2c->lock < 0) {
+    return;
+  }
+
+  latencyStart(&start);
+
+  if (!preempted(i2c->lock, priority) &&
+      (lockByte(i2c->lock, F_WRLCK, 0, 0) == 0)) {
+    latencyRecord(&i2c->wait[priority], &start, 0);
+    return;
+    /* nobody else wanted the bus; this is the common case. */
+  }
+
+  if (priority != i2cBulk) {
+    failed |= lockByte(i2c->lock, F_RDLCK, 1 + priority, 1) < 0;
+    /* let less urgent processes know we're waiting. */
+  }
+
+  while (1) {
+    for (i = 0; i < priority; i++) {
+      if (lockByte(i2c->lock, F_WRLCK, 1 + i, 1) == 0) {
+        (void)lockByte(i2c->lock, F_UNLCK, 1 + i, 0);
+      } else {
+        failed = 1;
+      }
+      /* wait until nobody of a more urgent class is waiting any more. */
+    }
+
+    if (lockByte(i2c->lock, F_WRLCK, 0, 1) < 0) {
+      failed = 1;
+      break;
+      /* go ahead without the lock, rather than not at all. */
+    }
+
+    if (failed || !preempted(i2c->lock, priority)) {
+      break;
+    }
+
+    (void)lockByte(i2c->lock, F_UNLCK, 0, 0);
+    /* someone more urgent turned up while we were waiting for the bus, so let
+       them go first. */
+  }
+
+  if (priority != i2cBulk) {
+    (void)lockByte(i2c->lock, F_UNLCK, 1 + priority, 0);
+  }
+
+  latencyRecord(&i2c->wait[priority], &start, failed);
+}
+
+/**\brief Release the bus lock.
+ *
+ * \param[in,out] i2c The I2C state struct.
+ */
+static void release(struct i2c *i2c) {
+  if (i2c->lock >= 0) {
+    (void)lockByte(i2c->lock, F_UNLCK, 0, 0);
+  }
+}
+
+/**\brief Account for a transfer.
+ *
+ * Releases the bus lock, and adds a transfer to the histogram for its address,
+ * register and direction, setting one up if this is the first such transfer.
+ *
+ * \param[in,out] i2c   The I2C state struct.
+ * \param[in]     addr  The I2C address of the transfer.
+ * \param[in]     reg   The register of the transfer.
+ * \param[in]     write Nonzero for writes, 0 for reads.
+ * \param[in]     start When the transfer was started; see latencyStart().
+ * \param[in]     rv    What the transfer returned; negative on failure.
+ *
+ * \returns 'rv', so this can be tacked onto a return statement.
+ */
+static long account(struct i2c *i2c, int addr, int reg, char write,
+                    const struct timespec *start, long rv) {
+  struct i2cTransfer *transfer = i2c->transfer;
+  int i;
+
+  release(i2c);
+
+  for (i = 0; i < i2c->transfers; i++) {
+    if ((transfer[i].addr == addr) && (transfer[i].reg == reg) &&
+        (transfer[i].write == write)) {
+      break;
+    }
+  }
+
+  if (i == i2c->transfers) {
+    if (i == I2C_TRANSFERS) {
+      return rv;
+      /* no room; this still shows up in the totals. */
+    }
+    memset(&transfer[i], 0, sizeof(transfer[i]));
+    transfer[i].addr = addr;
+    transfer[i].reg = reg;
+    transfer[i].write = write;
+    i2c->transfers++;
+  }
+
+  latencyRecord(&transfer[i].latency, start, rv < 0);
+
+  return rv;
+}
+
+/**\brief Read word from I2C via SMBUS
+ *
+ * Reads a word from the given I2C address and register via SMBUS.
+ *
+ * \param[out] i2c  The I2C state struct.
+ * \param[in]  addr The I2C address to read from.
+ * \param[in]  reg  The register to read.
+ *
+ * \returns Negative values on failure; the read value otherwise.
+ */
+long getWord(struct i2c *i2c, int addr, int reg) {
+  struct timespec start;
+  long res;
+
+  acquire(i2c);
+  latencyStart(&start);
+
+  if (i2c->backend == i2cEmulator) {
+    unsigned char data[2];
+
+    res = emulate(i2c, emulatorRead, addr, reg, data, 2) < 0
+              ? -3
+              : data[0] | (data[1] << 8);
+  } else if (selectAddr(i2c, addr) < 0) {
+    i2c->errors++;
+    res = -1;
+  } else {
+    i2c->transactions++;
+    res = i2c_smbus_read_word_data(i2c->device, reg);
+    if (res < 0) {
+      i2c->errors++;
+      res = -3;
+    }
+  }
+
+  return account(i2c, addr, reg, 0, &start, res);
+}
+
+/**\brief Read byte from I2C via SMBUS
+ *
+ * Reads a byte from the given I2C address and register via SMBUS.
+ *
+ * \param[out] i2c  The I2C state struct.
+ * \param[in]  addr The I2C address to read from.
+ * \param[in]  reg  The register to read.
+ *
+ * \returns Negative values on failure; the read value otherwise.
+ */
+long getByte(struct i2c *i2c, int addr, int reg) {
+  struct timespec start;
+  long res;
+
+  acquire(i2c);
+  latencyStart(&start);
+
+  if (i2c->backend == i2cEmulator) {
+    unsigned char data;
+
+    res = emulate(i2c, emulatorRead, addr, reg, &data, 1) < 0 ? -3 : data;
+  } else if (selectAddr(i2c, addr) < 0) {
+    i2c->errors++;
+    res = -1;
+  } else {
+    i2c->transactions++;
+    res = i2c_smbus_read_byte_data(i2c->device, reg);
+    if (res < 0) {
+      i2c->errors++;
+      res = -3;
+    }
+  }
+
+  return account(i2c, addr, reg, 0, &start, res);
+}
+
+/**\brief Store byte to I2C via SMBUS
+ *
+ * Stores a byte at the given I2C address and register via SMBUS.
+ *
+ * \param[out] i2c   The I2C state struct.
+ * \param[in]  addr  The I2C address to read from.
+ * \param[in]  reg   The register to read.
+ * \param[in]  value The value to write.
+ *
+ * \returns Negative values on failure; 0 otherwise.
+ */
+long setByte(struct i2c *i2c, int addr, int reg, int value) {
+  struct timespec start;
+  long res;
+
+  acquire(i2c);
+  latencyStart(&start);
+
+  if (i2c->backend == i2cEmulator) {
+    unsigned char data = value;
+
+    res = emulate(i2c, emulatorWrite, addr, reg, &data, 1);
+  } else if (selectAddr(i2c, addr) < 0) {
+    i2c->errors++;
+    res = -1;
+  } else {
+    i2c->transactions++;
+    res = i2c_smbus_write_byte_data(i2c->device, reg, value);
+    if (res < 0) {
+      i2c->errors++;
+      res = -3;
+    }
+  }
+
+  return account(i2c, addr, reg, 1, &start, res);
+}
+
+/**\brief Read a range of registers from I2C
+ *
+ * Reads a number of consecutive registers, starting at the given one, in a
+ * single transaction. This uses a combined write/read I2C_RDWR transfer if the
+ * adapter supports plain I2C, or an SMBus I2C block read otherwise.
+ *
+ * \param[out] i2c    The I2C state struct.
+ * \param[in]  addr   The I2C address to read from.
+ * \param[in]  reg    The first register to read.
+ * \param[out] data   Where to store the register contents.
+ * \param[in]  length The number of registers to read; at most 32.
+ *
+ * \returns Negative values on failure, -2 if the adapter doesn't support block
+ *          reads; 0 otherwise.
+ */
+int getBlock(struct i2c *i2c, int addr, int reg, unsigned char *data,
+             int length) {
+  struct timespec start;
+  int rv = 0;
+
+  acquire(i2c);
+  latencyStart(&start);
+
+  if (i2c->backend == i2cEmulator) {
+    rv = emulate(i2c, emulatorRead, addr, reg, data, length);
+  } else if (i2c->functions & I2C_FUNC_I2C) {
+    unsigned char first = reg;
+    struct i2c_msg msgs[2] = {{addr, 0, 1, &first},
+                              {addr, I2C_M_RD, length, data}};
+    struct i2c_rdwr_ioctl_data transfer = {msgs, 2};
+
+    i2c->transactions++;
+    if (ioctl(i2c->device, I2C_RDWR, &transfer) < 0) {
+      i2c->errors++;
+      rv = -3;
+    }
+  } else if (i2c->functions & I2C_FUNC_SMBUS_READ_I2C_BLOCK) {
+    if (selectAddr(i2c, addr) < 0) {
+      i2c->errors++;
+      rv = -1;
+    } else {
+      i2c->transactions++;
+      if (i2c_smbus_read_i2c_block_data(i2c->device, reg, length, data) <
+          length) {
+        i2c->errors++;
+        rv = -3;
+      }
+    }
+  } else {
+    release(i2c);
+    return -2;
+  }
+
+  return account(i2c, addr, reg, 0, &start, rv);
+}
+
+/**\brief Write a range of registers to I2C
+ *
+ * Writes a number of consecutive registers, starting at the given one, in a
+ * single transaction. This uses an I2C_RDWR transfer if the adapter supports
+ * plain I2C, or an SMBus I2C block write otherwise.
+ *
+ * \param[out] i2c    The I2C state struct.
+ * \param[in]  addr   The I2C address to write to.
+ * \param[in]  reg    The first register to write.
+ * \param[in]  data   The new register contents.
+ * \param[in]  length The number of registers to write; at most 32.
+ *
+ * \returns Negative values on failure, -2 if the adapter doesn't support block
+ *          writes; 0 otherwise.
+ */
+int setBlock(struct i2c *i2c, int addr, int reg, const unsigned char *data,
+             int length) {
+  unsigned char buffer[I2C_SMBUS_BLOCK_MAX + 1];
+  struct timespec start;
+  int i, rv = 0;
+
+  if ((length < 1) || (length > I2C_SMBUS_BLOCK_MAX)) {
+    return -4;
+  }
+
+  acquire(i2c);
+  latencyStart(&start);
+
+  buffer[0] = reg;
+  for (i = 0; i < length; i++) {
+    buffer[i + 1] = data[i];
+  }
+
+  if (i2c->backend == i2cEmulator) {
+    rv = emulate(i2c, emulatorWrite, addr, reg, buffer + 1, length);
+  } else if (i2c->functions & I2C_FUNC_I2C) {
+    struct i2c_msg msg = {addr, 0, length + 1, buffer};
+    struct i2c_rdwr_ioctl_data transfer = {&msg, 1};
+
+    i2c->transactions++;
+    if (ioctl(i2c->device, I2C_RDWR, &transfer) < 0) {
+      i2c->errors++;
+      rv = -3;
+    }
+  } else if (i2c->functions & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) {
+    if (selectAddr(i2c, addr) < 0) {
+      i2c->errors++;
+      rv = -1;
+    } else {
+      i2c->transactions++;
+      if (i2c_smbus_write_i2c_block_data(i2c->device, reg, length,
+                                         buffer + 1) < 0) {
+        i2c->errors++;
+        rv = -3;
+      }
+    }
+  } else {
+    release(i2c);
+    return -2;
+  }
+
+  return account(i2c, addr, reg, 1, &start, rv);
+}
@@ -0,0 +1,212 @@
+/**\file
+ * \brief I2C bus access.
+ *
+ * A thin layer on top of Linux's I2C /dev interface, which remembers which
+ * slave address was dialed last and counts the transactions that went out on
+ * the bus. Besides single SMBus register reads and writes, it can read and
+ * write a range of registers in a single transaction, if the adapter supports
+ * that. Instead of an I2C adapter, it can also talk to the PIco emulator.
+ *
+ * Every transfer is timed, and kept in a histogram per address, register and
+ * direction, so that a flaky bus can be told apart from a slow one.
+ *
+ * The bus is usually shared with other programmes, e.g. RTC tools and other
+ * sensor daemons, so transfers can be arbitrated: each one takes an exclusive
+ * lock on the adapter first, which serialises them across processes that do
+ * the same. Whoever is waiting with a more urgent priority class goes first,
+ * and the time spent waiting for the bus is kept in a histogram per class.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_I2C_H)
+#define PICO_I2C_H
+
+/* for struct latency */
+#include "latency.h"
+
+/**\brief Number of transfer histograms
+ *
+ * The most combinations of address, register and direction that transfers are
+ * timed for. The PIco daemons only ever use a handful; transfers to any others
+ * are still counted in the totals.
+ */
+#define I2C_TRANSFERS 32
+
+/**\brief Number of priority classes
+ *
+ * The number of values in enum i2cPriority.
+ */
+#define I2C_PRIORITIES 3
+
+/**\brief I2C priority class
+ *
+ * How urgent the current transfers are, when arbitrating the bus with other
+ * processes. While a process is waiting for the bus with a more urgent class,
+ * those with less urgent ones hold off.
+ */
+enum i2cPriority {
+  /**\brief Urgent transfers
+   *
+   * Key scans and anything to do with shutting down safely.
+   */
+  i2cUrgent,
+
+  /**\brief Normal transfers
+   *
+   * Anything that a client is waiting for, e.g. queries. This is the default.
+   */
+  i2cNormal,
+
+  /**\brief Bulk transfers
+   *
+   * Telemetry that's refreshed on a schedule, which can afford to wait.
+   */
+  i2cBulk
+};
+
+/**\brief I2C backend
+ *
+ * Selects what the I2C layer talks to.
+ */
+enum i2cBackend {
+  /**\brief I2C device file
+   *
+   * The kernel's I2C /dev interface, e.g. /dev/i2c-1.
+   */
+  i2cDevice,
+
+  /**\brief PIco emulator
+   *
+   * The Unix domain socket of pico-emu; see emulator.h.
+   */
+  i2cEmulator
+};
+
+/**\brief I2C transfer histogram
+ *
+ * How long transfers to one register took, and how often they failed.
+ */
+struct i2cTransfer {
+  /**\brief I2C address
+   *
+   * The address the transfers went to.
+   */
+  unsigned char addr;
+
+  /**\brief Register
+   *
+   * The register the transfers started at.
+   */
+  unsigned char reg;
+
+  /**\brief Direction
+   *
+   * Nonzero for writes, 0 for reads.
+   */
+  char write;
+
+  /**\brief Latency
+   *
+   * The time each transfer took, including selecting the address.
+   */
+  struct latency latency;
+};
+
+/**\brief I2C state
+ *
+ * Contains the current state - as we know it - of the I2C device we have open.
+ */
+struct i2c {
+  /**\brief Backend
+   *
+   * What the device file descriptor is connected to.
+   */
+  enum i2cBackend backend;
+
+  /**\brief Device file descriptor
+   *
+   * The OS file descriptor for the open device file, or the emulator socket.
+   */
+  int device;
+
+  /**\brief Bus lock
+   *
+   * The file that the bus lock is taken on: the device file itself, or a lock
+   * file next to the emulator socket. -1 if transfers aren't arbitrated.
+   */
+  int lock;
+
+  /**\brief Priority class
+   *
+   * The class of the transfers that are being made, when arbitrating the bus.
+   * Set this before making them.
+   */
+  enum i2cPriority priority;
+
+  /**\brief Current I2C address we dialed to
+   *
+   * Different PIco commands are using different I2C addresses as well as
+   * registers. This is to remember the last address we dialed, so we don't need
+   * to re-issue those syscalls to change to a different address.
+   */
+  int addr;
+
+  /**\brief Adapter functionality
+   *
+   * The adapter's I2C_FUNC_* flags, as reported by the kernel; 0 if they have
+   * not been queried yet.
+   */
+  unsigned long functions;
+
+  /**\brief Bus transactions
+   *
+   * The number of transactions that were sent out on the bus so far, whether
+   * they succeeded or not.
+   */
+  unsigned long transactions;
+
+  /**\brief Bus errors
+   *
+   * The number of register reads and writes that failed so far.
+   */
+  unsigned long errors;
+
+  /**\brief Transfer histograms
+   *
+   * One for every address, register and direction that was used so far, in the
+   * order they were first used.
+   */
+  struct i2cTransfer transfer[I2C_TRANSFERS];
+
+  /**\brief Number of transfer histograms
+   *
+   * The number of entries in the transfer array.
+   */
+  int transfers;
+
+  /**\brief Bus waits
+   *
+   * How long each transfer waited for the bus lock, by priority class. Failures
+   * to take the lock are counted as errors; the transfer goes ahead anyway.
+   */
+  struct latency wait[I2C_PRIORITIES];
+};
+
+int i2cOpen(struct i2c *i2c, const char *adaptor, char arbitrate);
+int i2cClose(struct i2c *i2c);
+int i2cBlock(struct i2c *i2c);
+long getWord(struct i2c *i2c, int addr, int reg);
+long getByte(struct i2c *i2c, int addr, int reg);
+long setByte(struct i2c *i2c, int addr, int reg, int value);
+int getBlock(struct i2c *i2c, int addr, int reg, unsigned char *data,
+             int length);
+int setBlock(struct i2c *i2c, int addr, int reg, const unsigned char *data,
+             int length);
+
+#endif
@@ -0,0 +1,369 @@
+/**\file
+ * \brief Telemetry journal.
+ *
+ * Implements the memory-mapped journal declared in journal.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "journal.h"
+
+/* for mmap(), msync(), munmap() */
+#include <sys/mman.h>
+
+/* for fstat() */
+#include <sys/stat.h>
+
+/* for open(), posix_fallocate() */
+#include <fcntl.h>
+
+/* for close() */
+#include <unistd.h>
+
+/**\brief Journal file size.
+ *
+ * \param[in] capacity The number of records.
+ *
+ * \returns The size of a journal file with that many records, in bytes.
+ */
+static size_t journalSize(uint64_t capacity) {
+  return sizeof(struct journalHeader) +
+         (size_t)capacity * sizeof(struct journalRecord);
+}
+
+/**\brief Map a journal.
+ *
+ * \param[out] journal The handle to map the journal into.
+ * \param[in]  fd      The journal's file descriptor.
+ * \param[in]  size    The size of the journal file.
+ * \param[in]  writer  Nonzero to map the journal for writing.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+static int map(struct journal *journal, int fd, size_t size, char writer) {
+  void *header = mmap(0, size, writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+
+  (void)close(fd);
+  /* the mapping stays valid without the file descriptor. */
+
+  if (header == MAP_FAILED) {
+    return -1;
+  }
+
+  journal->header = header;
+  journal->record = (struct journalRecord *)(journal->header + 1);
+  journal->size = size;
+  return 0;
+}
+
+/**\brief Check a journal.
+ *
+ * \param[in] journal The mapped journal.
+ *
+ * \returns Nonzero if the journal is set up, has our layout, and its capacity
+ *          matches the size of the file.
+ */
+static int valid(const struct journal *journal) {
+  const struct journalHeader *header = journal->header;
+
+  return (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == JOURNAL_MAGIC) &&
+         (header->layout == JOURNAL_LAYOUT) &&
+         (header->size == sizeof(struct journalRecord)) &&
+         (header->capacity > 0) &&
+         (journalSize(header->capacity) == journal->size);
+}
+
+/**\brief Count the records.
+ *
+ * Finds the newest record with a binary search for the slot where the sequence
+ * numbers drop: the slots before that one hold the newest records, and the
+ * slots from there on hold older ones, or none at all. This doesn't depend on
+ * the clock, and only reads a few pages of the journal.
+ *
+ * If the first slot has no sequence number, either nothing was ever appended,
+ * or an append that wrapped around to it was cut short; the newest record is
+ * then in the last slot, if there is one.
+ *
+ * \param[in] journal The mapped journal.
+ *
+ * \returns The number of records that were ever appended to the journal.
+ */
+static uint64_t count(const struct journal *journal) {
+  const uint64_t first = journal->record[0].sequence;
+  uint64_t low = 1, high = journal->header->capacity, middle;
+
+  if (first == 0) {
+    return journal->record[journal->header->capacity - 1].sequence;
+  }
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (journal->record[middle].sequence >= first) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return journal->record[low - 1].sequence;
+}
+
+/**\brief Create a journal.
+ *
+ * Creates the journal file with room for the given number of records, or opens
+ * it if it's already there, e.g. from before a reboot, and maps it for
+ * appending. A new file is allocated in full right away, so appending never
+ * needs to allocate blocks. An existing journal keeps its records and its
+ * capacity.
+ *
+ * \param[out] journal  The handle to initialise.
+ * \param[in]  path     The journal file.
+ * \param[in]  capacity The number of records for a new journal.
+ * \param[in]  flush    Seconds between two msync() calls.
+ *
+ * \returns 0 on success, negative values otherwise; -4 if the file isn't a
+ *          journal, or has a different layout.
+ */
+int journalCreate(struct journal *journal, const char *path,
+                  uint64_t capacity, unsigned int flush) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  size_t size;
+
+  journal->header = 0;
+  journal->writer = 1;
+  journal->flush = flush;
+  journal->flushes = 0;
+  (void)clock_gettime(CLOCK_MONOTONIC, &journal->flushed);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    (void)close(fd);
+    return -2;
+  }
+
+  size = st.st_size;
+  if (size == 0) {
+    if (capacity == 0) {
+      (void)close(fd);
+      return -2;
+    }
+    size = journalSize(capacity);
+    if (posix_fallocate(fd, 0, size) != 0) {
+      (void)close(fd);
+      return -2;
+    }
+  }
+
+  if (map(journal, fd, size, 1) < 0) {
+    return -3;
+  }
+
+  if ((st.st_size == 0) && (journal->header->magic == 0)) {
+    journal->header->layout = JOURNAL_LAYOUT;
+    journal->header->capacity = capacity;
+    journal->header->size = sizeof(struct journalRecord);
+    __atomic_store_n(&journal->header->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  if (!valid(journal)) {
+    (void)munmap(journal->header, journal->size);
+    journal->header = 0;
+    return -4;
+  }
+
+  journal->records = count(journal);
+  return 0;
+}
+
+/**\brief Open a journal
+ *
+ * Opens a journal file, which must have been created by pico-i2cd already, and
+ * maps it for reading. The journal may still be appended to while it's open,
+ * but only the records that were there when it was opened are read.
+ *
+ * \param[out] journal The handle to initialise.
+ * \param[in]  path    The journal file.
+ *
+ * \returns 0 on success, negative values otherwise; -4 if the file isn't a
+ *          journal, or has a different layout.
+ */
+int journalOpen(struct journal *journal, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  journal->header = 0;
+  journal->writer = 0;
+  journal->flush = 0;
+  journal->flushes = 0;
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if ((fstat(fd, &st) < 0) ||
+      (st.st_size < (off_t)sizeof(struct journalHeader))) {
+    (void)close(fd);
+    return -4;
+  }
+
+  if (map(journal, fd, st.st_size, 0) < 0) {
+    return -3;
+  }
+
+  if (!valid(journal)) {
+    (void)munmap(journal->header, journal->size);
+    journal->header = 0;
+    return -4;
+  }
+
+  journal->records = count(journal);
+  return 0;
+}
+
+/**\brief Append a snapshot
+ *
+ * Copies a status snapshot into the next record slot, overwriting the oldest
+ * record once the journal is full. If the flush interval has passed, the
+ * journal is flushed to storage as well.
+ *
+ * \param[out] journal The journal to append to.
+ * \param[in]  status  The snapshot to append.
+ * \param[in]  when    The CLOCK_REALTIME time the snapshot was read at.
+ *
+ * \returns The result of journalSync() if the journal was flushed, 0
+ *          otherwise.
+ */
+int journalAppend(struct journal *journal, const struct picoStatus *status,
+                  const struct timespec *when) {
+  struct journalRecord *record =
+      &journal->record[journal->records % journal->header->capacity];
+  struct timespec now;
+
+  __atomic_store_n(&record->sequence, 0, __ATOMIC_RELEASE);
+  record->seconds = when->tv_sec;
+  record->nanoseconds = when->tv_nsec;
+  record->mode = status->value[picoMode];
+  record->battery = status->value[picoBattery];
+  record->host = status->value[picoHost];
+  record->temperature[0] = status->value[picoTemperature1];
+  record->temperature[1] = status->value[picoTemperature2];
+
+  journal->records++;
+  __atomic_store_n(&record->sequence, journal->records, __ATOMIC_RELEASE);
+  /* the sequence number is only set once the record is complete, so if we
+     stop halfway through, the record is simply not there. */
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - journal->flushed.tv_sec >= (time_t)journal->flush) {
+    return journalSync(journal);
+  }
+
+  return 0;
+}
+
+/**\brief Flush a journal
+ *
+ * Writes all changes to the journal since the last flush to storage. Only the
+ * pages that were changed are written, i.e. the pages with the new records.
+ *
+ * \param[out] journal The journal to flush.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int journalSync(struct journal *journal) {
+  (void)clock_gettime(CLOCK_MONOTONIC, &journal->flushed);
+  journal->flushes++;
+
+  return msync(journal->header, journal->size, MS_SYNC) < 0 ? -1 : 0;
+}
+
+/**\brief Oldest record
+ *
+ * \param[in] journal The journal.
+ *
+ * \returns The number of the oldest record that is still in the journal.
+ */
+uint64_t journalOldest(const struct journal *journal) {
+  return journal->records > journal->header->capacity
+             ? journal->records - journal->header->capacity
+             : 0;
+}
+
+/**\brief Find a point in time
+ *
+ * Looks for the first record at or after a given time with a binary search
+ * over the records in the journal. This assumes that the records are in time
+ * order, which only fails to hold if the clock was set back.
+ *
+ * \param[in] journal The journal.
+ * \param[in] seconds The Unix time to look for.
+ *
+ * \returns The number of the first record at or after the given time, or the
+ *          record count if there is no such record.
+ */
+uint64_t journalFind(const struct journal *journal, int64_t seconds) {
+  uint64_t low = journalOldest(journal);
+  uint64_t high = journal->records;
+  uint64_t middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (journalRecord(journal, middle)->seconds < seconds) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+/**\brief Look up a record
+ *
+ * \param[in] journal The journal.
+ * \param[in] n       The record number.
+ *
+ * \returns The slot that record n is in.
+ */
+const struct journalRecord *journalRecord(const struct journal *journal,
+                                          uint64_t n) {
+  return &journal->record[n % journal->header->capacity];
+}
+
+/**\brief Close a journal
+ *
+ * Flushes the journal if it was opened for appending, and unmaps it.
+ *
+ * \param[out] journal The journal to close.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int journalClose(struct journal *journal) {
+  int rv = 0;
+
+  if (journal->header == 0) {
+    return 0;
+  }
+
+  if (journal->writer) {
+    rv = journalSync(journal);
+  }
+
+  if (munmap(journal->header, journal->size) < 0) {
+    rv = -1;
+  }
+  journal->header = 0;
+
+  return rv;
+}
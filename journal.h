@@ -0,0 +1,225 @@
+/**\file
+ * \brief Telemetry journal.
+ *
+ * pico-i2cd can append its status snapshots to a binary journal: a file that
+ * is allocated in full when it's created, and that holds a fixed number of
+ * fixed-size records in a ring. The file is memory-mapped, so appending a
+ * record is a plain memory copy, and the changes are only flushed to storage
+ * with msync() every so often. Compared to a text log that is written and
+ * synced for every sample, this writes each block far less often, which is
+ * what wears out SD cards.
+ *
+ * Once the journal is full, new records overwrite the oldest ones. Records are
+ * appended in time order, so a time range can be found with a binary search,
+ * without reading the whole journal.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_JOURNAL_H)
+#define PICO_JOURNAL_H
+
+/* for size_t */
+#include <stddef.h>
+
+/* for int16_t, uint32_t, int32_t, int64_t, uint64_t */
+#include <stdint.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "pico.h"
+
+/**\brief Default journal file
+ *
+ * Where pico-log looks for the journal, unless told otherwise.
+ */
+#define JOURNAL_PATH "/var/lib/pico-i2cd/pico.journal"
+
+/**\brief Journal magic number
+ *
+ * Identifies a file as a journal; "PIcJ" in ASCII.
+ */
+#define JOURNAL_MAGIC 0x4a634950
+
+/**\brief Journal layout version
+ *
+ * Increased whenever the layout of the header or the records changes.
+ */
+#define JOURNAL_LAYOUT 1
+
+/**\brief Default journal size
+ *
+ * The number of records in a new journal, unless told otherwise. At the
+ * default refresh interval of 15 seconds, this is about six weeks' worth, in an
+ * 8 MiB file.
+ */
+#define JOURNAL_RECORDS 262144
+
+/**\brief Default flush interval
+ *
+ * The number of seconds between two msync() calls, unless told otherwise.
+ */
+#define JOURNAL_FLUSH 300
+
+/**\brief Journal record
+ *
+ * A status snapshot, as stored in the journal. Fields that couldn't be read are
+ * negative, just like in struct picoStatus.
+ */
+struct journalRecord {
+  /**\brief Sequence number
+   *
+   * The number of records appended before this one, plus 1. 0 for records that
+   * were never written.
+   */
+  uint64_t sequence;
+
+  /**\brief Sample time
+   *
+   * The CLOCK_REALTIME time the status registers were read at; seconds.
+   */
+  int64_t seconds;
+
+  /**\brief Sample time, nanoseconds
+   *
+   * The CLOCK_REALTIME time the status registers were read at; nanoseconds.
+   */
+  int32_t nanoseconds;
+
+  /**\brief Power mode
+   *
+   * 1 when plugged in, 2 when on battery; see picoMode.
+   */
+  int16_t mode;
+
+  /**\brief Battery voltage
+   *
+   * In centi-volts; see picoBattery.
+   */
+  int16_t battery;
+
+  /**\brief Host voltage
+   *
+   * In centi-volts; see picoHost.
+   */
+  int16_t host;
+
+  /**\brief Temperatures
+   *
+   * In degrees Celsius, for the built-in and the external sensor; see
+   * picoTemperature1 and picoTemperature2.
+   */
+  int16_t temperature[2];
+};
+
+/**\brief Journal header
+ *
+ * The start of the journal file; the records follow right after it.
+ */
+struct journalHeader {
+  /**\brief Magic number
+   *
+   * JOURNAL_MAGIC once the journal has been set up.
+   */
+  uint32_t magic;
+
+  /**\brief Layout version
+   *
+   * JOURNAL_LAYOUT, for the layout the writer uses.
+   */
+  uint32_t layout;
+
+  /**\brief Capacity
+   *
+   * The number of records the journal holds.
+   */
+  uint64_t capacity;
+
+  /**\brief Record size
+   *
+   * The size of a record, in bytes.
+   */
+  uint32_t size;
+
+  /**\brief Padding
+   *
+   * Makes the header as large as a record, so that no record straddles two
+   * pages; always 0.
+   */
+  uint32_t reserved[3];
+};
+
+/**\brief Journal handle
+ *
+ * A mapping of a journal file, for appending or reading.
+ */
+struct journal {
+  /**\brief Header
+   *
+   * The mapped journal, or NULL if it isn't mapped.
+   */
+  struct journalHeader *header;
+
+  /**\brief Records
+   *
+   * The record slots, right after the header.
+   */
+  struct journalRecord *record;
+
+  /**\brief Mapping size
+   *
+   * The size of the file and the mapping, in bytes.
+   */
+  size_t size;
+
+  /**\brief Record count
+   *
+   * The number of records that were ever appended, when the journal was opened
+   * plus those appended since. Record n is in slot n modulo the capacity.
+   */
+  uint64_t records;
+
+  /**\brief Writer
+   *
+   * Nonzero if the journal was opened for appending, 0 for readers.
+   */
+  char writer;
+
+  /**\brief Flush interval
+   *
+   * Seconds between two msync() calls, for writers.
+   */
+  unsigned int flush;
+
+  /**\brief Last flush
+   *
+   * The CLOCK_MONOTONIC time of the last msync(), for writers.
+   */
+  struct timespec flushed;
+
+  /**\brief Flushes
+   *
+   * The number of msync() calls so far.
+   */
+  unsigned long flushes;
+};
+
+int journalCreate(struct journal *journal, const char *path,
+                  uint64_t capacity, unsigned int flush);
+int journalOpen(struct journal *journal, const char *path);
+int journalAppend(struct journal *journal, const struct picoStatus *status,
+                  const struct timespec *when);
+int journalSync(struct journal *journal);
+uint64_t journalOldest(const struct journal *journal);
+uint64_t journalFind(const struct journal *journal, int64_t seconds);
+const struct journalRecord *journalRecord(const struct journal *journal,
+                                          uint64_t n);
+int journalClose(struct journal *journal);
+
+#endif
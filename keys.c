@@ -0,0 +1,307 @@
+/**\file
+ * \brief PIco key scanning.
+ *
+ * Implements the key scanning declared in keys.h on top of pico.h's key
+ * register accessors and the uinput interface.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "keys.h"
+
+/* for open(), fstat() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* for write(), close() */
+#include <unistd.h>
+
+/* for fprintf() */
+#include <stdio.h>
+
+/* for memset() */
+#include <string.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for ioctl() */
+#include <sys/ioctl.h>
+
+/* for Linux input device macros */
+#include <linux/uinput.h>
+
+/**\brief Key codes
+ *
+ * The input event codes for KEY_A, KEY_B and KEY_F on the PIco.
+ */
+static const int code[PICO_KEYS] = {BTN_A, BTN_B, BTN_C};
+
+/**\brief Advance a point in time.
+ *
+ * \param[in,out] t    The point in time to move forward.
+ * \param[in]     usec Microseconds to move it by.
+ */
+static void advance(struct timespec *t, unsigned int usec) {
+  t->tv_sec += usec / 1000000;
+  t->tv_nsec += (long)(usec % 1000000) * 1000;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+/**\brief Time since a point in time.
+ *
+ * \param[in] then A CLOCK_MONOTONIC time in the past.
+ *
+ * \returns The number of seconds since 'then'.
+ */
+static double since(const struct timespec *then) {
+  struct timespec now;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - then->tv_sec) +
+         (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Create the uinput device.
+ *
+ * Declares the PIco's three keys on a freshly opened uinput file, and creates
+ * the device.
+ *
+ * \param[in] device  The open uinput file.
+ * \param[in] version The version number to give the device.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int create(int device, int version) {
+  struct uinput_user_dev userdev = {
+      "Raspberry Pi PIco UPS", {BUS_I2C, 0x0000, 0x0000, version}, 0};
+  int i;
+
+  if (ioctl(device, UI_SET_EVBIT, EV_KEY) < 0) {
+    fprintf(stderr, "Could not set event bits: ERRNO=%d.\n", errno);
+    return -5;
+  }
+  if (ioctl(device, UI_SET_EVBIT, EV_SYN) < 0) {
+    fprintf(stderr, "Could not set event bits: ERRNO=%d.\n", errno);
+    return -5;
+  }
+
+  for (i = 0; i < PICO_KEYS; i++) {
+    if (ioctl(device, UI_SET_KEYBIT, code[i]) < 0) {
+      fprintf(stderr, "Could not declare key code: ERRNO=%d.\n", errno);
+      return -5;
+    }
+  }
+
+  if (write(device, &userdev, sizeof(userdev)) != sizeof(userdev)) {
+    fprintf(stderr, "Could not write device id: ERRNO=%d.\n", errno);
+    return -5;
+  }
+
+  if (ioctl(device, UI_DEV_CREATE) < 0) {
+    fprintf(stderr, "Could not create input device: ERRNO=%d.\n", errno);
+    return -5;
+  }
+
+  return 0;
+}
+
+/**\brief Set up the virtual input device.
+ *
+ * Creates the uinput device with the PIco's three keys. If the file is a FIFO
+ * instead, e.g. pico-emu's, the events are simply written to it, without
+ * setting up a device.
+ *
+ * \param[out] keys    The key state to initialise.
+ * \param[in]  uinput  The uinput device file, or a FIFO.
+ * \param[in]  version The version number to give the device.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int keysOpen(struct keys *keys, const char *uinput, int version) {
+  struct stat st;
+  int rv;
+
+  memset(keys, 0, sizeof(*keys));
+  keys->device = open(uinput, O_WRONLY | O_NONBLOCK);
+  if (keys->device < 0) {
+    fprintf(stderr, "Could not open uinput: '%s'; ERRNO=%d.\n", uinput, errno);
+    return -2;
+  }
+
+  if ((fstat(keys->device, &st) == 0) && S_ISFIFO(st.st_mode)) {
+    return 0;
+  }
+
+  rv = create(keys->device, version);
+  if (rv < 0) {
+    (void)close(keys->device);
+    keys->device = -1;
+  }
+
+  return rv;
+}
+
+/**\brief Send an input event.
+ *
+ * \param[in,out] keys  The key state, with the input device.
+ * \param[in]     event The event to send.
+ *
+ * \returns Nonzero if the event was sent.
+ */
+static char emit(struct keys *keys, const struct input_event *event) {
+  struct timespec start;
+  char sent;
+
+  latencyStart(&start);
+  sent = write(keys->device, event, sizeof(*event)) == sizeof(*event);
+  latencyRecord(&keys->writes, &start, !sent);
+
+  return sent;
+}
+
+/**\brief Scan the keys.
+ *
+ * Reads the PIco's key registers, sends input events for any changes, and
+ * clears the keys that were seen as pressed.
+ *
+ * \param[in,out] keys     The key state.
+ * \param[out]    i2c      The I2C state struct.
+ * \param[in]     block    Nonzero to use block transfers if possible.
+ * \param[in]     schedule The key scan schedule, for the long press duration.
+ *
+ * \returns Nonzero if any key is held down.
+ */
+char keysScan(struct keys *keys, struct i2c *i2c, char block,
+              const struct schedule *schedule) {
+  struct input_event event = {{0}, EV_KEY, 0};
+  struct input_event syn = {{0}, EV_SYN, SYN_REPORT};
+  unsigned char scan[PICO_KEYS];
+  unsigned char reset[PICO_KEYS] = {0, 0, 0};
+  struct timespec start;
+  char synchronise = 0;
+  int i;
+
+  latencyStart(&start);
+
+  if (picoKeys(i2c, scan, block) < 0) {
+    latencyRecord(&keys->scans, &start, 1);
+    return keys->release[0] || keys->release[1] || keys->release[2];
+    /* try again on the next scan. */
+  }
+
+  for (i = 0; i < PICO_KEYS; i++) {
+    if (keys->release[i] > 0) {
+      if (scan[i] == 0) {
+        event.code = code[i];
+        event.value = 0;
+        if (emit(keys, &event)) {
+          /* event has been sent successfully */
+          keys->release[i] = 0;
+          synchronise = 1;
+        }
+      } else {
+        /* This is what happens when the button is still being pressed, so
+           since we saw that again we'll just reset it to 0 again. */
+        reset[i] = 1;
+
+        if ((keys->release[i] == 1) &&
+            (since(&keys->pressed[i]) >= schedule->longPress / 1e6)) {
+          /* we've detected a long press */
+          event.code = code[i];
+          event.value = 2;
+          if (emit(keys, &event)) {
+            /* event has been sent successfully */
+            keys->release[i] = 2;
+            synchronise = 1;
+          }
+        }
+      }
+    } else {
+      if (scan[i] > 0) {
+        event.code = code[i];
+        event.value = 1;
+        if (emit(keys, &event)) {
+          /* event has been sent successfully */
+          keys->release[i] = 1;
+          (void)clock_gettime(CLOCK_MONOTONIC, &keys->pressed[i]);
+          reset[i] = 1;
+          synchronise = 1;
+        }
+      }
+    }
+  }
+
+  (void)picoResetKeys(i2c, reset, block);
+  /* if this fails, we'll see the keys as still pressed on the next scan and
+     try again. */
+
+  latencyRecord(&keys->scans, &start, 0);
+
+  if (synchronise) {
+    (void)emit(keys, &syn);
+    /* AFAICT the SYN for this should be optional, we're only sending it for
+       completeness' sake. Therefore, if it couldn't be sent right, we ought to
+       be able to ignore it. */
+  }
+
+  return keys->release[0] || keys->release[1] || keys->release[2];
+}
+
+/**\brief Schedule the next key scan.
+ *
+ * Works out when to scan the keys next: soon if any key is held down, and
+ * further out with every scan otherwise.
+ *
+ * \param[in,out] schedule The key scan schedule.
+ * \param[in]     held     Nonzero if any key is held down.
+ */
+void keysReschedule(struct schedule *schedule, char held) {
+  if (held) {
+    schedule->interval = schedule->fast;
+  } else if (schedule->interval < schedule->idle / 2) {
+    schedule->interval *= 2;
+  } else {
+    schedule->interval = schedule->idle;
+  }
+
+  advance(&schedule->next, schedule->interval);
+  if (since(&schedule->next) > 0) {
+    /* we're behind, e.g. because the bus was slow or the system was
+       suspended; there's no point in catching up on missed scans. */
+    (void)clock_gettime(CLOCK_MONOTONIC, &schedule->next);
+  }
+}
+
+/**\brief Remove the virtual input device.
+ *
+ * \param[in,out] keys The key state.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int keysClose(struct keys *keys) {
+  int rv;
+
+  if (keys->device < 0) {
+    return 0;
+  }
+
+  (void)ioctl(keys->device, UI_DEV_DESTROY);
+  /* this fails for FIFOs, which is fine. */
+
+  rv = close(keys->device);
+  keys->device = -1;
+
+  return rv;
+}
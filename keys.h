@@ -0,0 +1,121 @@
+/**\file
+ * \brief PIco key scanning.
+ *
+ * The PIco's three keys latch in a register each when they are pressed, until
+ * the host clears them. They are scanned over I2C and turned into events on a
+ * uinput device: BTN_A, BTN_B and BTN_C, for KEY_A, KEY_B and KEY_F on the
+ * PIco. (There is no BTN_F, and it felt wrong to use keyboard scan codes for
+ * this.)
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_KEYS_H)
+#define PICO_KEYS_H
+
+/* for struct timespec */
+#include <time.h>
+
+#include "i2c.h"
+#include "pico.h"
+
+/* for struct latency */
+#include "latency.h"
+
+/**\brief Default uinput device
+ *
+ * /dev/uinput seems to be used by Debian, even though the canonical location
+ * is /dev/input/uinput.
+ */
+#define KEYS_UINPUT "/dev/uinput"
+
+/**\brief Key state
+ *
+ * The virtual input device, and what we know about the keys.
+ */
+struct keys {
+  /**\brief Input device
+   *
+   * The uinput file descriptor, or -1 if the input loop isn't running.
+   */
+  int device;
+
+  /**\brief Key states
+   *
+   * 0 while a key is up, 1 while it is down, 2 once a long press has been
+   * reported.
+   */
+  char release[PICO_KEYS];
+
+  /**\brief Key press times
+   *
+   * The CLOCK_MONOTONIC time each key was last pressed at.
+   */
+  struct timespec pressed[PICO_KEYS];
+
+  /**\brief Scan latency
+   *
+   * How long each scan took from start to finish, including waiting for the
+   * bus, and how often reading the keys failed.
+   */
+  struct latency scans;
+
+  /**\brief Event latency
+   *
+   * How long each write of an input event took, and how often it failed.
+   */
+  struct latency writes;
+};
+
+/**\brief Key scan schedule
+ *
+ * How often the input loop scans the keys. While a key is held down, it scans
+ * at the fast interval; once all keys have been released, the interval doubles
+ * with every scan until it reaches the idle interval. Key presses are latched
+ * by the PIco, so a slow scan only delays a press, it doesn't lose it.
+ */
+struct schedule {
+  /**\brief Idle interval
+   *
+   * Microseconds between scans when no key has been pressed in a while.
+   */
+  unsigned int idle;
+
+  /**\brief Fast interval
+   *
+   * Microseconds between scans while a key is held down.
+   */
+  unsigned int fast;
+
+  /**\brief Long press duration
+   *
+   * Microseconds a key has to be held down for before it's reported as a long
+   * press.
+   */
+  unsigned int longPress;
+
+  /**\brief Current interval
+   *
+   * Microseconds until the next scan.
+   */
+  unsigned int interval;
+
+  /**\brief Next scan
+   *
+   * The CLOCK_MONOTONIC time of the next scan.
+   */
+  struct timespec next;
+};
+
+int keysOpen(struct keys *keys, const char *uinput, int version);
+char keysScan(struct keys *keys, struct i2c *i2c, char block,
+              const struct schedule *schedule);
+void keysReschedule(struct schedule *schedule, char held);
+int keysClose(struct keys *keys);
+
+#endif
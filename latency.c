@@ -0,0 +1,98 @@
+/**\file
+ * \brief Latency histograms.
+ *
+ * Implements the histograms declared in latency.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "latency.h"
+
+/**\brief Bucket bounds
+ *
+ * The upper bound of each bucket but the last, in seconds. These cover a bus
+ * transfer or a GPIO access going through right away, as well as one that had
+ * to wait for a slow bus or a busy CPU.
+ */
+static const double bound[LATENCY_BUCKETS - 1] = {
+    10e-6, 25e-6, 50e-6, 100e-6, 250e-6, 500e-6,
+    1e-3,  2.5e-3, 5e-3, 10e-3,  25e-3};
+
+/**\brief Start timing an operation.
+ *
+ * \param[out] start Set to the current CLOCK_MONOTONIC time.
+ */
+void latencyStart(struct timespec *start) {
+  (void)clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/**\brief Record an operation.
+ *
+ * Adds the time since the operation was started to its histogram.
+ *
+ * \param[in,out] latency The histogram to add to.
+ * \param[in]     start   The time from latencyStart().
+ * \param[in]     failed  Nonzero if the operation failed.
+ */
+void latencyRecord(struct latency *latency, const struct timespec *start,
+                   char failed) {
+  struct timespec now;
+  double seconds;
+  int i = 0;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = (double)(now.tv_sec - start->tv_sec) +
+            (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+
+  while ((i < LATENCY_BUCKETS - 1) && (seconds > bound[i])) {
+    i++;
+  }
+
+  latency->bucket[i]++;
+  latency->sum += seconds;
+  latency->count++;
+  if (failed) {
+    latency->errors++;
+  }
+}
+
+/**\brief Write a histogram.
+ *
+ * Writes the histogram in the Prometheus text format, as '<name>_seconds', and
+ * the number of failures as '<name>_errors_total'.
+ *
+ * \param[in] latency The histogram to write.
+ * \param[in] out     Where to write it to.
+ * \param[in] name    The metric name, without the suffixes.
+ * \param[in] labels  The labels to add, e.g. 'pin="22"', or "" for none.
+ */
+void latencyWrite(const struct latency *latency, FILE *out, const char *name,
+                  const char *labels) {
+  const char *comma = labels[0] != 0 ? "," : "";
+  unsigned long cumulative = 0;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    cumulative += latency->bucket[i];
+    fprintf(out, "%s_seconds_bucket{%s%sle=\"%g\"} %lu\n", name, labels, comma,
+            bound[i], cumulative);
+  }
+  fprintf(out, "%s_seconds_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, comma,
+          latency->count);
+
+  if (labels[0] != 0) {
+    fprintf(out, "%s_seconds_sum{%s} %g\n", name, labels, latency->sum);
+    fprintf(out, "%s_seconds_count{%s} %lu\n", name, labels, latency->count);
+    fprintf(out, "%s_errors_total{%s} %lu\n", name, labels, latency->errors);
+  } else {
+    fprintf(out, "%s_seconds_sum %g\n", name, latency->sum);
+    fprintf(out, "%s_seconds_count %lu\n", name, latency->count);
+    fprintf(out, "%s_errors_total %lu\n", name, latency->errors);
+  }
+}
@@ -0,0 +1,73 @@
+/**\file
+ * \brief Latency histograms.
+ *
+ * Fixed-bucket histograms of how long an operation took, along with how often
+ * it failed, for the I2C transfers, GPIO accesses, input events and loop
+ * iterations of the daemons. A histogram is a handful of counters in memory
+ * that was set aside up front, and it belongs to a single thread - both daemons
+ * only have the one - so recording a sample takes no locks, no atomics and no
+ * allocations: two clock_gettime() calls, which don't leave userspace, and a
+ * short scan for the bucket. That's cheap enough to leave on all the time.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_LATENCY_H)
+#define PICO_LATENCY_H
+
+/* for FILE */
+#include <stdio.h>
+
+/* for struct timespec */
+#include <time.h>
+
+/**\brief Number of buckets
+ *
+ * The number of histogram buckets, including the last one, which has no upper
+ * bound. The bounds go from 10 microseconds to 25 milliseconds.
+ */
+#define LATENCY_BUCKETS 12
+
+/**\brief Latency histogram
+ *
+ * How long an operation took, each time it was done.
+ */
+struct latency {
+  /**\brief Samples
+   *
+   * The number of times the operation was done.
+   */
+  unsigned long count;
+
+  /**\brief Failures
+   *
+   * The number of times the operation failed.
+   */
+  unsigned long errors;
+
+  /**\brief Total time
+   *
+   * The sum of all samples, in seconds.
+   */
+  double sum;
+
+  /**\brief Buckets
+   *
+   * The number of samples in each bucket; unlike in the output, these aren't
+   * cumulative.
+   */
+  unsigned long bucket[LATENCY_BUCKETS];
+};
+
+void latencyStart(struct timespec *start);
+void latencyRecord(struct latency *latency, const struct timespec *start,
+                   char failed);
+void latencyWrite(const struct latency *latency, FILE *out, const char *name,
+                  const char *labels);
+
+#endif
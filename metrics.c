@@ -0,0 +1,223 @@
+/**\file
+ * \brief PIco metrics.
+ *
+ * Implements the metrics cache declared in metrics.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "metrics.h"
+
+/* for mkstemp() */
+#include <stdlib.h>
+
+/* for fchmod() */
+#include <sys/stat.h>
+
+/* for close(), unlink() */
+#include <unistd.h>
+
+/* for rename() */
+#include <stdio.h>
+
+/* for PATH_MAX */
+#include <limits.h>
+
+/**\brief Seconds between two points in time.
+ *
+ * \param[in] a A point in time.
+ * \param[in] b Another point in time.
+ *
+ * \returns The number of seconds from 'b' to 'a'.
+ */
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+  return (double)(a->tv_sec - b->tv_sec) +
+         (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**\brief Write a metric.
+ *
+ * Writes a single sample, preceded by its HELP and TYPE lines.
+ *
+ * \param[out] out   Where to write the metric to.
+ * \param[in]  name  The metric name.
+ * \param[in]  type  The metric type, e.g. gauge or counter.
+ * \param[in]  help  The metric's help text.
+ * \param[in]  value The sample value.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+static int metric(FILE *out, const char *name, const char *type,
+                  const char *help, double value) {
+  return fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.10g\n", name, help,
+                 name, type, name, value) < 0
+             ? -1
+             : 0;
+}
+
+/**\brief Refresh the metrics.
+ *
+ * Reads a new snapshot of the PIco's status, and times how long that took.
+ * The snapshot is also added to the history, if there is one, and handed to
+ * the fan controller, if there is one; only then does it include the fan kit's
+ * registers.
+ *
+ * \param[out] metrics The metrics to refresh.
+ * \param[out] i2c     The I2C state struct.
+ * \param[in]  block   Nonzero to use block reads if possible.
+ *
+ * \returns The snapshot's result: negative numbers if any registers couldn't
+ *          be read, 0 otherwise.
+ */
+int metricsRefresh(struct metrics *metrics, struct i2c *i2c, char block) {
+  struct timespec start;
+
+  metrics->fields = PICO_ALL | (metrics->fan != 0 ? PICO_FAN : 0);
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  metrics->result = picoRead(i2c, &metrics->status, metrics->fields, block);
+  (void)clock_gettime(CLOCK_MONOTONIC, &metrics->refreshed);
+
+  metrics->duration = elapsed(&metrics->refreshed, &start);
+  metrics->refreshes++;
+
+  if (metrics->history != 0) {
+    historyAdd(metrics->history, &metrics->status, &metrics->refreshed);
+  }
+  if (metrics->fan != 0) {
+    (void)fanUpdate(metrics->fan, i2c, &metrics->status, &metrics->refreshed);
+    /* failed writes show up in the bus errors, and are retried on the next
+       refresh, since the snapshot then still disagrees with the curve. */
+  }
+
+  (void)clock_gettime(CLOCK_REALTIME, &metrics->sampled);
+  if (metrics->result == 0) {
+    metrics->succeeded = metrics->sampled;
+  }
+
+  return metrics->result;
+}
+
+/**\brief Write the metrics.
+ *
+ * Writes the cached snapshot, the history's aggregates, the fan controller's
+ * state and the bus statistics in the Prometheus text format. The snapshot's
+ * metrics come from the register table in pico.c. This doesn't touch the bus.
+ *
+ * \param[in]  metrics The metrics to write.
+ * \param[in]  i2c     The I2C state struct, for the bus statistics.
+ * \param[out] out     Where to write the metrics to.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+int metricsWrite(const struct metrics *metrics, const struct i2c *i2c,
+                 FILE *out) {
+  struct timespec now;
+  int rv = 0, i;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (i = 0; i < PICO_FIELDS; i++) {
+    if (!(metrics->fields & (1UL << i))) {
+      continue;
+    }
+    rv |= metric(out, picoRegisters[i].metric, "gauge", picoRegisters[i].help,
+                 metrics->status.value[i]);
+  }
+  rv |= metric(out, "pico_scrape_duration_seconds", "gauge",
+               "Time it took to read the PIco's registers for this snapshot.",
+               metrics->duration);
+  rv |= metric(out, "pico_scrape_success", "gauge",
+               "1 if all of the PIco's registers could be read, 0 otherwise.",
+               metrics->result == 0);
+  rv |= metric(out, "pico_last_success_timestamp_seconds", "gauge",
+               "Unix time of the last snapshot that could be read in full.",
+               metrics->succeeded.tv_sec + metrics->succeeded.tv_nsec / 1e9);
+  rv |= metric(out, "pico_snapshot_age_seconds", "gauge",
+               "Time since this snapshot was read.",
+               elapsed(&now, &metrics->refreshed));
+  rv |= metric(out, "pico_snapshots_total", "counter",
+               "Number of snapshots read since the daemon was started.",
+               metrics->refreshes);
+  rv |= metric(out, "pico_i2c_transactions_total", "counter",
+               "Number of I2C bus transactions since the daemon was started.",
+               i2c->transactions);
+  rv |= metric(out, "pico_i2c_errors_total", "counter",
+               "Number of failed I2C register reads and writes since the "
+               "daemon was started.",
+               i2c->errors);
+
+  if (metrics->history != 0) {
+    rv |= historyWrite(metrics->history, out);
+  }
+  if (metrics->fan != 0) {
+    rv |= fanWrite(metrics->fan, out);
+  }
+
+  return rv;
+}
+
+/**\brief Save the metrics.
+ *
+ * Writes the metrics to METRICS_TEXTFILE in the given directory, for
+ * node_exporter's textfile collector. The metrics are written to a temporary
+ * file first, which is then renamed into place, so the collector never sees a
+ * half-written file.
+ *
+ * \param[in] metrics   The metrics to write.
+ * \param[in] i2c       The I2C state struct, for the bus statistics.
+ * \param[in] directory The textfile collector directory.
+ *
+ * \returns Negative numbers on failure, 0 otherwise.
+ */
+int metricsSave(const struct metrics *metrics, const struct i2c *i2c,
+                const char *directory) {
+  char temporary[PATH_MAX];
+  char path[PATH_MAX];
+  FILE *out;
+  int fd, rv;
+
+  if ((snprintf(path, sizeof(path), "%s/" METRICS_TEXTFILE, directory) >=
+       (int)sizeof(path)) ||
+      (snprintf(temporary, sizeof(temporary),
+                "%s/." METRICS_TEXTFILE ".XXXXXX",
+                directory) >= (int)sizeof(temporary))) {
+    return -1;
+  }
+  /* the temporary file starts with a dot and doesn't end in .prom, so the
+   * collector ignores it. */
+
+  fd = mkstemp(temporary);
+  if (fd < 0) {
+    return -2;
+  }
+
+  (void)fchmod(fd, 0644);
+  /* mkstemp() only makes the file readable to us, but node_exporter usually
+   * runs as a different user. */
+
+  out = fdopen(fd, "w");
+  if (out == 0) {
+    (void)close(fd);
+    (void)unlink(temporary);
+    return -2;
+  }
+
+  rv = metricsWrite(metrics, i2c, out);
+  if (fclose(out) != 0) {
+    rv = -3;
+  }
+
+  if ((rv < 0) || (rename(temporary, path) < 0)) {
+    (void)unlink(temporary);
+    return -3;
+  }
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/**\file
+ * \brief PIco metrics.
+ *
+ * A cached snapshot of the PIco's status, along with how and when it was read,
+ * and a writer for the Prometheus text format - to a stream, or atomically to a
+ * file for node_exporter's textfile collector. The snapshot is refreshed on the
+ * daemon's own schedule, so no matter how often the metrics are written out,
+ * the bus only ever sees one snapshot's worth of traffic per refresh.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_METRICS_H)
+#define PICO_METRICS_H
+
+/* for FILE */
+#include <stdio.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "fan.h"
+#include "history.h"
+#include "pico.h"
+
+/**\brief Textfile name
+ *
+ * The name of the file that metricsSave() writes in the textfile collector
+ * directory.
+ */
+#define METRICS_TEXTFILE "pico.prom"
+
+/**\brief Cached metrics
+ *
+ * The last snapshot of the PIco's status, and what it took to read it.
+ */
+struct metrics {
+  /**\brief PIco status
+   *
+   * The last snapshot that was read.
+   */
+  struct picoStatus status;
+
+  /**\brief Snapshot fields
+   *
+   * The enum picoField bits of the registers in the last snapshot: PICO_ALL,
+   * and PICO_FAN as well with a fan controller.
+   */
+  unsigned long fields;
+
+  /**\brief Snapshot result
+   *
+   * The return value of picoRead() for the last snapshot.
+   */
+  int result;
+
+  /**\brief Refresh duration
+   *
+   * Seconds it took to read the last snapshot.
+   */
+  double duration;
+
+  /**\brief Refresh time
+   *
+   * The CLOCK_MONOTONIC time the last snapshot was read at.
+   */
+  struct timespec refreshed;
+
+  /**\brief Sample time
+   *
+   * The CLOCK_REALTIME time the last snapshot was read at.
+   */
+  struct timespec sampled;
+
+  /**\brief Last successful refresh
+   *
+   * The CLOCK_REALTIME time of the last snapshot that could be read in full,
+   * or 0 if there hasn't been one yet.
+   */
+  struct timespec succeeded;
+
+  /**\brief Refreshes
+   *
+   * The number of snapshots that were read so far.
+   */
+  unsigned long refreshes;
+
+  /**\brief History
+   *
+   * The history that refreshes are added to, and whose aggregates are written
+   * along with the snapshot, or 0 for none.
+   */
+  struct history *history;
+
+  /**\brief Fan controller
+   *
+   * The fan controller that acts on refreshes, and whose state is written
+   * along with the snapshot, or 0 for none.
+   */
+  struct fan *fan;
+};
+
+int metricsRefresh(struct metrics *metrics, struct i2c *i2c, char block);
+int metricsWrite(const struct metrics *metrics, const struct i2c *i2c,
+                 FILE *out);
+int metricsSave(const struct metrics *metrics, const struct i2c *i2c,
+                const char *directory);
+
+#endif
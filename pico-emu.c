@@ -0,0 +1,767 @@
+/**\file
+ * \brief UPS PIco emulator.
+ *
+ * Emulates a PIco for pico-i2cd and picod, so that both can be run, tested and
+ * benchmarked without the hardware. The register map is served on a Unix
+ * domain socket, which pico-i2cd uses instead of an I2C adapter when it's given
+ * the socket's path with '-a'. The GPIO pins are kept in a directory tree with
+ * the same layout as the sysfs GPIO interface, which picod uses when it's given
+ * the tree with '-g': the emulator watches the pulse train on pin #22, and
+ * drives the FSSD signal on pin #27.
+ *
+ * To measure how long the hosts take to react, the emulator can also stand in
+ * for uinput with a FIFO, which pico-i2cd writes its input events to when it's
+ * given the FIFO's path with '-u', and it takes SIGRTMIN+4 as the shutdown
+ * signal that 'picod -k' sends to init.
+ *
+ * The emulated PIco follows a script of timed commands, such as "1000 press b
+ * 700" to hold key B down for 700 milliseconds, one second in. When the script
+ * says "quit", or the emulator is told to terminate, it prints what the hosts
+ * did: the bus transactions, the key latencies, the pulse train's gaps and how
+ * long it took from the FSSD signal to the shutdown.
+ *
+ * Transfers are answered right away, unless the emulator is given a bus clock,
+ * in which case each one takes as long as it would on a real bus, and keeps
+ * the emulator busy for that long. Since clients are answered one at a time,
+ * they then contend for the bus as they would for a real one.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+/* for accept4() */
+#define _GNU_SOURCE
+
+/* for getopt(), pread(), pwrite(), close(), unlink() */
+#include <unistd.h>
+
+/* for printf(), fopen(), fgets() */
+#include <stdio.h>
+
+/* for strtol(), strtoul() */
+#include <stdlib.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for signal() */
+#include <signal.h>
+
+/* for strlen(), strcpy(), strcmp(), strcspn(), strspn(), memset() */
+#include <string.h>
+
+/* for open() */
+#include <fcntl.h>
+
+/* for mkdir(), mkfifo() */
+#include <sys/stat.h>
+
+/* for socket(), bind(), listen(), accept4(), send(), recv() */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* for struct sockaddr_un */
+#include <sys/un.h>
+
+/* for epoll_create1(), epoll_ctl(), epoll_wait() */
+#include <sys/epoll.h>
+
+/* for PATH_MAX */
+#include <limits.h>
+
+/* for nanosleep() */
+#include <time.h>
+
+/* for struct input_event, BTN_A, BTN_B, BTN_C */
+#include <linux/input.h>
+
+#include "emulator.h"
+
+/**\brief Programme version
+ *
+ * The version number of this programme. Will be increased around release time.
+ */
+static const int version = 2;
+
+/**\brief Maximum number of script commands
+ *
+ * The most commands a script may have.
+ */
+#define MAX_COMMANDS 256
+
+/**\brief Maximum command length
+ *
+ * The longest line in a script.
+ */
+#define MAX_COMMAND 64
+
+/**\brief Maximum number of events
+ *
+ * The most epoll events handled per wakeup.
+ */
+#define MAX_EVENTS 16
+
+/**\brief Model tick
+ *
+ * Milliseconds between two updates of the model and the pins, if nothing else
+ * happens in the meantime.
+ */
+#define TICK 10
+
+/**\brief Termination request flag
+ *
+ * Set by the SIGTERM and SIGINT handlers to ask the main loop to wind down.
+ */
+static volatile sig_atomic_t terminate = 0;
+
+/**\brief SIGTERM and SIGINT handler
+ *
+ * Only sets a flag; the main loop exits at its next wakeup, and prints what
+ * happened on the way out.
+ *
+ * \param[in] sig The signal that was received.
+ */
+static void requestTermination(int sig) { terminate = 1; }
+
+/**\brief Shutdown time
+ *
+ * The CLOCK_MONOTONIC time the first shutdown signal arrived at, or 0 if none
+ * has.
+ */
+static struct timespec shutdownTime;
+
+/**\brief SIGRTMIN+4 handler
+ *
+ * Records the time of the first shutdown request; clock_gettime() is safe to
+ * call in a signal handler.
+ *
+ * \param[in] sig The signal that was received.
+ */
+static void requestShutdown(int sig) {
+  if (shutdownTime.tv_sec == 0) {
+    (void)clock_gettime(CLOCK_MONOTONIC, &shutdownTime);
+  }
+}
+
+/**\brief Key codes
+ *
+ * The input event codes that pico-i2cd sends for KEY_A, KEY_B and KEY_F.
+ */
+static const int code[EMULATOR_KEYS] = {BTN_A, BTN_B, BTN_C};
+
+/**\brief Script command
+ *
+ * A command, and when to run it.
+ */
+struct command {
+  /**\brief Command time
+   *
+   * Milliseconds after the start of the emulation to run the command at.
+   */
+  long at;
+
+  /**\brief Command
+   *
+   * The command, as understood by emulatorCommand(), or "quit".
+   */
+  char text[MAX_COMMAND];
+};
+
+/**\brief Emulated GPIO pins
+ *
+ * The pins in the sysfs-style directory tree, and what happened on them.
+ */
+struct pins {
+  /**\brief Pulse pin
+   *
+   * The open value file of pin #22, or -1 without a tree.
+   */
+  int pulse;
+
+  /**\brief FSSD pin
+   *
+   * The open value file of pin #27, or -1 without a tree.
+   */
+  int fssd;
+
+  /**\brief Pulse state
+   *
+   * The last state of pin #22 that was seen.
+   */
+  char high;
+
+  /**\brief FSSD state
+   *
+   * The state pin #27 was last set to.
+   */
+  char state;
+
+  /**\brief Pulses
+   *
+   * The number of rising edges seen on pin #22.
+   */
+  unsigned long pulses;
+
+  /**\brief Last pulse
+   *
+   * The CLOCK_MONOTONIC time of the last rising edge on pin #22.
+   */
+  struct timespec last;
+
+  /**\brief Longest gap
+   *
+   * The most seconds between two rising edges on pin #22.
+   */
+  double gap;
+
+  /**\brief FSSD time
+   *
+   * Seconds after the start of the emulation that pin #27 last went LOW at,
+   * or -1 if it never did.
+   */
+  double low;
+};
+
+/**\brief Input stand-in
+ *
+ * The FIFO that stands in for uinput, and how long it took for key presses to
+ * show up in it.
+ */
+struct input {
+  /**\brief FIFO
+   *
+   * The FIFO's file descriptor, or -1 without one.
+   */
+  int fd;
+
+  /**\brief Events
+   *
+   * The number of key events read from the FIFO.
+   */
+  unsigned long events;
+
+  /**\brief Presses
+   *
+   * The number of key presses that showed up in the FIFO.
+   */
+  unsigned long presses;
+
+  /**\brief Latency
+   *
+   * The total, lowest and highest number of seconds between a key being
+   * pressed and its key down event showing up.
+   */
+  double latency, latencyMin, latencyMax;
+};
+
+/**\brief Seconds between two points in time.
+ *
+ * \param[in] a A point in time.
+ * \param[in] b Another point in time.
+ *
+ * \returns The number of seconds from 'b' to 'a'.
+ */
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+  return (double)(a->tv_sec - b->tv_sec) +
+         (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**\brief Load a script.
+ *
+ * Reads one command per line, each preceded by the number of milliseconds
+ * after the start to run it at. Empty lines and lines starting with '#' are
+ * skipped. The commands must be in time order.
+ *
+ * \param[in]  path    The script file.
+ * \param[out] command The commands.
+ *
+ * \returns The number of commands, or negative numbers on failure.
+ */
+static int loadScript(const char *path, struct command command[MAX_COMMANDS]) {
+  FILE *script = fopen(path, "r");
+  char line[MAX_COMMAND + 16];
+  char *text;
+  int n = 0;
+
+  if (script == 0) {
+    return -1;
+  }
+
+  while ((n < MAX_COMMANDS) && (fgets(line, sizeof(line), script) != 0)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if ((line[0] == 0) || (line[0] == '#')) {
+      continue;
+    }
+
+    command[n].at = strtol(line, &text, 10);
+    if ((text == line) || (strlen(text) >= MAX_COMMAND) ||
+        ((n > 0) && (command[n].at < command[n - 1].at))) {
+      fprintf(stderr, "Invalid script line: '%s'.\n", line);
+      (void)fclose(script);
+      return -2;
+    }
+    strcpy(command[n].text, text + strspn(text, " \t"));
+    n++;
+  }
+
+  (void)fclose(script);
+  return n;
+}
+
+/**\brief Create a file in the GPIO tree.
+ *
+ * \param[in] root    The tree.
+ * \param[in] name    The file, relative to the tree.
+ * \param[in] content What to put in the file.
+ *
+ * \returns The file, open for reading and writing, or negative numbers on
+ *          failure.
+ */
+static int createFile(const char *root, const char *name,
+                      const char *content) {
+  char path[PATH_MAX];
+  int fd;
+
+  if (snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path)) {
+    return -1;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (write(fd, content, strlen(content)) < (ssize_t)strlen(content)) {
+    (void)close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**\brief Create the GPIO tree.
+ *
+ * Lays out pins #22 and #27 the way the sysfs GPIO interface does, as if they
+ * had been exported already, with pin #27 HIGH.
+ *
+ * \param[in]  root The directory to create the tree in.
+ * \param[out] pins The pins to set up.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int createPins(const char *root, struct pins *pins) {
+  char path[PATH_MAX];
+  int fd;
+
+  (void)mkdir(root, 0755);
+  (void)snprintf(path, sizeof(path), "%s/gpio22", root);
+  (void)mkdir(path, 0755);
+  (void)snprintf(path, sizeof(path), "%s/gpio27", root);
+  (void)mkdir(path, 0755);
+
+  if (((fd = createFile(root, "export", "")) < 0) || (close(fd) < 0) ||
+      ((fd = createFile(root, "gpio22/direction", "in\n")) < 0) ||
+      (close(fd) < 0) ||
+      ((fd = createFile(root, "gpio27/direction", "in\n")) < 0) ||
+      (close(fd) < 0) ||
+      ((fd = createFile(root, "gpio27/edge", "none\n")) < 0) ||
+      (close(fd) < 0)) {
+    return -1;
+  }
+
+  pins->pulse = createFile(root, "gpio22/value", "0\n");
+  pins->fssd = createFile(root, "gpio27/value", "1\n");
+  pins->state = 1;
+
+  return (pins->pulse < 0) || (pins->fssd < 0) ? -1 : 0;
+}
+
+/**\brief Update the pins.
+ *
+ * Looks for a rising edge on pin #22, and sets pin #27 to the model's FSSD
+ * state.
+ *
+ * \param[in]     emulator The emulator.
+ * \param[in,out] pins     The pins.
+ * \param[in]     start    The CLOCK_MONOTONIC time the emulation started at.
+ */
+static void updatePins(const struct emulator *emulator, struct pins *pins,
+                       const struct timespec *start) {
+  char buffer[4];
+  char high, state = emulatorFSSD(emulator);
+
+  if (pins->pulse < 0) {
+    return;
+  }
+
+  if (pread(pins->pulse, buffer, sizeof(buffer), 0) > 0) {
+    high = buffer[0] == '1';
+    if (high && !pins->high) {
+      if ((pins->pulses > 0) &&
+          (elapsed(&emulator->now, &pins->last) > pins->gap)) {
+        pins->gap = elapsed(&emulator->now, &pins->last);
+      }
+      pins->last = emulator->now;
+      pins->pulses++;
+    }
+    pins->high = high;
+  }
+
+  if (state != pins->state) {
+    (void)pwrite(pins->fssd, state ? "1\n" : "0\n", 2, 0);
+    pins->state = state;
+    if (!state) {
+      pins->low = elapsed(&emulator->now, start);
+    }
+  }
+}
+
+/**\brief Open the emulator socket.
+ *
+ * Replaces whatever is at the path with a listening SOCK_SEQPACKET socket.
+ *
+ * \param[in] path  The socket path.
+ * \param[in] epoll The epoll instance to watch the socket with.
+ *
+ * \returns The socket, or negative numbers on failure.
+ */
+static int openSocket(const char *path, int epoll) {
+  struct sockaddr_un address;
+  struct epoll_event event = {EPOLLIN};
+  int fd;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  (void)unlink(path);
+  if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+      (listen(fd, 16) < 0)) {
+    (void)close(fd);
+    return -2;
+  }
+
+  event.data.fd = fd;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+    (void)close(fd);
+    return -3;
+  }
+
+  return fd;
+}
+
+/**\brief Create the input stand-in.
+ *
+ * Replaces whatever is at the path with a FIFO, and opens it.
+ *
+ * \param[in]  path  The FIFO's path.
+ * \param[in]  epoll The epoll instance to watch the FIFO with.
+ * \param[out] input The input stand-in to set up.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int openInput(const char *path, int epoll, struct input *input) {
+  struct epoll_event event = {EPOLLIN};
+
+  (void)unlink(path);
+  if (mkfifo(path, 0600) < 0) {
+    return -1;
+  }
+
+  input->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (input->fd < 0) {
+    return -2;
+  }
+  /* with the FIFO open for writing as well, it never signals a hangup when
+     pico-i2cd goes away, and pico-i2cd can open it without waiting. */
+
+  event.data.fd = input->fd;
+  return epoll_ctl(epoll, EPOLL_CTL_ADD, input->fd, &event) < 0 ? -3 : 0;
+}
+
+/**\brief Read input events.
+ *
+ * Reads the events that are waiting in the FIFO, and matches key down events
+ * with the presses that they report.
+ *
+ * \param[in,out] emulator The emulator.
+ * \param[in,out] input    The input stand-in.
+ */
+static void readInput(struct emulator *emulator, struct input *input) {
+  struct input_event event;
+  struct emulatorKey *key;
+  double latency;
+  int i;
+
+  while (read(input->fd, &event, sizeof(event)) == sizeof(event)) {
+    if ((event.type != EV_KEY) || (event.value != 1)) {
+      continue;
+    }
+    input->events++;
+
+    for (i = 0; (i < EMULATOR_KEYS) && (code[i] != event.code); i++) {
+    }
+    if ((i == EMULATOR_KEYS) || !emulator->key[i].pending) {
+      continue;
+    }
+
+    key = &emulator->key[i];
+    key->pending = 0;
+    latency = elapsed(&emulator->now, &key->pressed);
+    if ((input->presses == 0) || (latency < input->latencyMin)) {
+      input->latencyMin = latency;
+    }
+    if (latency > input->latencyMax) {
+      input->latencyMax = latency;
+    }
+    input->latency += latency;
+    input->presses++;
+  }
+}
+
+/**\brief Answer a client.
+ *
+ * Reads a request from a client and answers it, or hangs up on the client if
+ * it's gone. With a bus clock, the answer is held back for as long as the
+ * transfer would have taken on the bus: nine bits for each byte, i.e. the
+ * address, the register and the data, plus the address again to turn a bus
+ * around for reading.
+ *
+ * \param[in,out] emulator The emulator.
+ * \param[in]     fd       The client's socket.
+ * \param[in]     speed    The bus clock in kHz, or 0 to answer right away.
+ */
+static void answer(struct emulator *emulator, int fd, unsigned int speed) {
+  struct emulatorMessage message;
+  unsigned int bits;
+
+  if (recv(fd, &message, sizeof(message), 0) < (ssize_t)sizeof(message)) {
+    (void)close(fd);
+    /* this also takes the socket out of the epoll instance. */
+    return;
+  }
+
+  bits = (message.length + ((message.operation == emulatorRead) ? 3 : 2)) * 9;
+
+  (void)emulatorTransfer(emulator, &message);
+
+  if (speed > 0) {
+    struct timespec busy = {0, (long)bits * 1000000 / speed};
+
+    (void)nanosleep(&busy, 0);
+  }
+
+  (void)send(fd, &message, sizeof(message), MSG_NOSIGNAL);
+}
+
+/**\brief Print what happened.
+ *
+ * \param[in] emulator The emulator.
+ * \param[in] pins     The pins.
+ * \param[in] input    The input stand-in.
+ * \param[in] start    The CLOCK_MONOTONIC time the emulation started at.
+ */
+static void report(const struct emulator *emulator, const struct pins *pins,
+                   const struct input *input, const struct timespec *start) {
+  printf("pico_emu_duration_seconds %g\n", elapsed(&emulator->now, start));
+  printf("pico_emu_mode %ld\n", emulator->mode);
+  printf("pico_emu_battery_centivolts %g\n", emulator->battery);
+  printf("pico_emu_i2c_reads_total %lu\n", emulator->reads);
+  printf("pico_emu_i2c_writes_total %lu\n", emulator->writes);
+  printf("pico_emu_i2c_naks_total %lu\n", emulator->naks);
+  printf("pico_emu_key_latches_total %lu\n", emulator->latches);
+  printf("pico_emu_key_clears_total %lu\n", emulator->clears);
+  if (emulator->clears > 0) {
+    printf("pico_emu_key_latency_seconds{stat=\"min\"} %g\n",
+           emulator->latencyMin);
+    printf("pico_emu_key_latency_seconds{stat=\"mean\"} %g\n",
+           emulator->latency / emulator->clears);
+    printf("pico_emu_key_latency_seconds{stat=\"max\"} %g\n",
+           emulator->latencyMax);
+  }
+  if (pins->pulse >= 0) {
+    printf("pico_emu_pulses_total %lu\n", pins->pulses);
+    printf("pico_emu_pulse_gap_max_seconds %g\n", pins->gap);
+    printf("pico_emu_fssd_low_seconds %g\n", pins->low);
+  }
+  if ((pins->low >= 0) && (shutdownTime.tv_sec != 0)) {
+    printf("pico_emu_shutdown_latency_seconds %g\n",
+           elapsed(&shutdownTime, start) - pins->low);
+  }
+  if (input->fd >= 0) {
+    printf("pico_emu_input_events_total %lu\n", input->events);
+    printf("pico_emu_input_presses_total %lu\n", input->presses);
+    if (input->presses > 0) {
+      printf("pico_emu_input_latency_seconds{stat=\"min\"} %g\n",
+             input->latencyMin);
+      printf("pico_emu_input_latency_seconds{stat=\"mean\"} %g\n",
+             input->latency / input->presses);
+      printf("pico_emu_input_latency_seconds{stat=\"max\"} %g\n",
+             input->latencyMax);
+    }
+  }
+}
+
+/**\brief PIco emulator main function
+ *
+ * Parses the command line, sets up the socket and the GPIO tree, and then runs
+ * the emulation until the script says "quit", or until told to terminate.
+ *
+ * * -a [path] sets the path of the emulator socket. The default is
+ *   /tmp/pico-emu.sock.
+ * * -g [root] creates a sysfs-style GPIO tree at the given path, for picod's
+ *   '-g'. The default is not to do so.
+ * * -s [kHz] sets the bus clock, e.g. 100 for the Raspberry Pi's default. The
+ *   default is 0, which answers transfers right away.
+ * * -u [path] creates a FIFO at the given path to stand in for uinput, for
+ *   pico-i2cd's '-u'. The default is not to do so.
+ * * -v prints the version of the programme and then exits.
+ * * -x [script] runs the given script.
+ *
+ * \param[in] argc Argument count.
+ * \param[in] argv Argument vector.
+ *
+ * \returns 0 on success, negative numbers on errors.
+ */
+int main(int argc, char **argv) {
+  static struct command command[MAX_COMMANDS];
+  const char *path = EMULATOR_SOCKET;
+  const char *root = 0;
+  const char *script = 0;
+  const char *fifo = 0;
+  struct emulator emulator;
+  struct input input = {-1};
+  struct pins pins = {-1, -1, 0, 1, 0, {0, 0}, 0, -1};
+  struct epoll_event events[MAX_EVENTS];
+  struct timespec start, now;
+  unsigned int speed = 0;
+  int commands = 0, next = 0;
+  int epoll, listener, opt, n, i, fd;
+
+  while ((opt = getopt(argc, argv, "a:g:s:u:vx:")) != -1) {
+    switch (opt) {
+    case 'a':
+      path = optarg;
+      break;
+    case 'g':
+      root = optarg;
+      break;
+    case 's':
+      speed = strtoul(optarg, 0, 10);
+      break;
+    case 'u':
+      fifo = optarg;
+      break;
+    case 'v':
+      printf("pico-emu/%i\n", version);
+      return 0;
+    case 'x':
+      script = optarg;
+      break;
+    default:
+      printf("Usage: %s [-a <path>] [-g <root>] [-s <kHz>] [-u <path>] [-v] "
+             "[-x <script>]\n",
+             argv[0]);
+      return -1;
+    }
+  }
+
+  if (script != 0) {
+    commands = loadScript(script, command);
+    if (commands < 0) {
+      fprintf(stderr, "Could not load script '%s'; ERRNO=%d.\n", script,
+              errno);
+      return -2;
+    }
+  }
+
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) {
+    fprintf(stderr, "Could not create epoll instance; ERRNO=%d.\n", errno);
+    return -3;
+  }
+
+  listener = openSocket(path, epoll);
+  if (listener < 0) {
+    fprintf(stderr, "Could not listen on '%s'; ERRNO=%d.\n", path, errno);
+    return -4;
+  }
+
+  if ((root != 0) && (createPins(root, &pins) < 0)) {
+    fprintf(stderr, "Could not create GPIO tree at '%s'; ERRNO=%d.\n", root,
+            errno);
+    return -5;
+  }
+
+  if ((fifo != 0) && (openInput(fifo, epoll, &input) < 0)) {
+    fprintf(stderr, "Could not create FIFO at '%s'; ERRNO=%d.\n", fifo,
+            errno);
+    return -6;
+  }
+
+  (void)signal(SIGTERM, requestTermination);
+  (void)signal(SIGINT, requestTermination);
+  (void)signal(SIGRTMIN + 4, requestShutdown);
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+  emulatorInit(&emulator, &start);
+
+  while (!terminate) {
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    emulatorAdvance(&emulator, &now);
+
+    while ((next < commands) &&
+           (elapsed(&now, &start) * 1000 >= command[next].at)) {
+      if (strcmp(command[next].text, "quit") == 0) {
+        terminate = 1;
+      } else if (emulatorCommand(&emulator, command[next].text) < 0) {
+        fprintf(stderr, "Invalid command: '%s'.\n", command[next].text);
+      }
+      next++;
+    }
+
+    updatePins(&emulator, &pins, &start);
+
+    n = epoll_wait(epoll, events, MAX_EVENTS, TICK);
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    emulatorAdvance(&emulator, &now);
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == listener) {
+        struct epoll_event event = {EPOLLIN};
+
+        fd = accept4(listener, 0, 0, SOCK_CLOEXEC);
+        event.data.fd = fd;
+        if ((fd >= 0) && (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0)) {
+          (void)close(fd);
+        }
+      } else if (events[i].data.fd == input.fd) {
+        readInput(&emulator, &input);
+      } else {
+        answer(&emulator, events[i].data.fd, speed);
+      }
+    }
+  }
+
+  report(&emulator, &pins, &input, &start);
+
+  (void)unlink(path);
+  if (fifo != 0) {
+    (void)unlink(fifo);
+  }
+
+  return 0;
+}
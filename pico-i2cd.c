@@ -24,290 +24,147 @@
  * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
  */
 
-/* for open() */
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
-/* for usleep(), read(), write(), getopt(), daemon() */
+/* for getopt(), daemon() */
 #include <unistd.h>
 
-/* for snprintf() */
+/* for printf() */
 #include <stdio.h>
 
+/* for atoi() */
+#include <stdlib.h>
+
 /* for errno */
 #include <errno.h>
 
-/* for ioctl() */
-#include <sys/ioctl.h>
-
-/* for I2C /dev interface macros */
-/* note that this requires the version of this file from libi2c-dev */
-#include <linux/i2c-dev.h>
+/* for I2C bus access */
+#include "i2c.h"
 
-/* for Linux input device macros */
-#include <linux/uinput.h>
+/* for the Prometheus exporter */
+#include "exporter.h"
 
-/**\brief Daemon version
- *
- * The version number of this daemon. Will be increased around release time.
- */
-static const int version = 2;
+/* for the telemetry history */
+#include "history.h"
 
-/**\brief I2C state
- *
- * Contains the current state - as we know it - of the I2C device we have open.
- */
-struct i2c {
-  /**\brief Device file descriptor
-   *
-   * The OS file descriptor for the open device file.
-   */
-  int device;
-
-  /**\brief Current I2C address we dialed to
-   *
-   * Different PIco commands are using different I2C addresses as well as
-   * registers. This is to remember the last address we dialed, so we don't need
-   * to re-issue those syscalls to change to a different address.
-   */
-  int addr;
-};
-
-/**\brief Decode BCD word values
- *
- * The PIco exports a lot of data encoded in binary-coded decimal values. For
- * reference, this basically means that every 4-bit nibble is holding a single
- * digit, encoded in regular binary form.
- *
- * High/low byte order is presumably kept, though this is not documented.
- *
- * \param[in] w The word to parse.
- *
- * \returns The decoded value.
- */
-static long getBCD(long w) {
-  return ((w >> 0x0) & 0xf)
-       + ((w >> 0x4) & 0xf) * 10
-       + ((w >> 0x8) & 0xf) * 100
-       + ((w >> 0xc) & 0xf) * 1000;
-}
-
-/**\brief Select I2C address
- *
- * Sets the I2C address to read data from. If the current address is the same as
- * the one that was dialed last, this function does not issue a syscall to
- * change the address.
- *
- * \param[out] i2c  The I2C state struct.
- * \param[in]  addr The I2C address to select.
- *
- * \returns 0 on success, negative values otherwise.
- */
-static int selectAddr(struct i2c *i2c, int addr) {
-  if (i2c->addr == addr) {
-    return 0;
-  }
-
-  if (ioctl(i2c->device, I2C_SLAVE, addr) < 0) {
-    return -1;
-  }
-
-  i2c->addr = addr;
-
-  return 0;
-}
-
-/**\brief Read word from I2C via SMBUS
- *
- * Reads a word from the given I2C address and register via SMBUS.
- *
- * \param[out] i2c  The I2C state struct.
- * \param[in]  addr The I2C address to read from.
- * \param[in]  reg  The register to read.
- *
- * \returns Negative values on failure; the read value otherwise.
- */
-static long getWord(struct i2c *i2c, int addr, int reg) {
-  if (selectAddr(i2c, addr) < 0) {
-    return -1;
-  } else {
-    long res = i2c_smbus_read_word_data(i2c->device, reg);
-    if (res < 0) {
-      return -3;
-    }
-    return res;
-  }
-}
+/* for fan control */
+#include "fan.h"
 
-/**\brief Read byte from I2C via SMBUS
- *
- * Reads a byte from the given I2C address and register via SMBUS.
- *
- * \param[out] i2c  The I2C state struct.
- * \param[in]  addr The I2C address to read from.
- * \param[in]  reg  The register to read.
- *
- * \returns Negative values on failure; the read value otherwise.
- */
-static long getByte(struct i2c *i2c, int addr, int reg) {
-  if (selectAddr(i2c, addr) < 0) {
-    return -1;
-  } else {
-    long res = i2c_smbus_read_byte_data(i2c->device, reg);
-    if (res < 0) {
-      return -3;
-    }
-    return res;
-  }
-}
+/* for the telemetry journal */
+#include "journal.h"
 
-/**\brief Store byte to I2C via SMBUS
- *
- * Stores a byte at the given I2C address and register via SMBUS.
- *
- * \param[out] i2c   The I2C state struct.
- * \param[in]  addr  The I2C address to read from.
- * \param[in]  reg   The register to read.
- * \param[in]  value The value to write.
- *
- * \returns Negative values on failure; 0 otherwise.
- */
-static long setByte(struct i2c *i2c, int addr, int reg, int value) {
-  if (selectAddr(i2c, addr) < 0) {
-    return -1;
-  } else {
-    long res = i2c_smbus_write_byte_data(i2c->device, reg, value);
-    if (res < 0) {
-      return -3;
-    }
-    return res;
-  }
-}
+/* for the shared memory status */
+#include "shm.h"
 
-/**\brief Get PIco battery voltage.
- *
- * Read the voltage of battery connected to the PIco. The battery has a nominal
- * voltage of around 3.7 V, and a useful voltage down to about 3.5 V.
- *
- * \param[out] i2c The I2C state struct.
- *
- * \returns The voltage, in centi-volts. Negative values on error.
- */
-static long getBatteryVoltage(struct i2c *i2c) {
-  return getBCD(getWord(i2c, 0x69, 0x01));
-}
+/* for the query socket */
+#include "query.h"
 
-/**\brief Get Raspberry Pi 5V pin voltage.
- *
- * Read the voltage of the 5V input line, as seen by the PIco.
- *
- * \param[out] i2c The I2C state struct.
- *
- * \returns The voltage, in centi-volts. Negative values on error.
- */
-static long getHostVoltage(struct i2c *i2c) {
-  return getBCD(getWord(i2c, 0x69, 0x03));
-}
+/* for the virtual input device */
+#include "keys.h"
 
-/**\brief Read out PIco firmware version.
- *
- * This functions reads the firmware version register of the PIco. Note that
- * these are typically written out in hexadecimal, so the readout may look
- * different than what you're expecting if you don't adjust for that.
- *
- * \param[out] i2c The I2C state struct.
- *
- * \returns Negative numbers on errors, or the version number otherwise.
- *     Some version numbers have a special meaning. See the PIco manual for more
- *     info on those.
- */
-static long getVersion(struct i2c *i2c) { return getByte(i2c, 0x6b, 0x00); }
+/* for the event loop */
+#include "ups.h"
 
-/**\brief Read out power mode.
- *
- * Reds the power mode register on the PIco, to find out if the device is
- * currently on battery power or not.
- *
- * \param[out] i2c The I2C state struct.
- *
- * \returns 1 if the device is plugged in, 2 if it's on battery power. Any other
- *     code means that something is wrong.
- */
-static long getMode(struct i2c *i2c) { return getByte(i2c, 0x69, 0x00); }
-
-/**\brief Get key status.
- *
- * PIco key presses are sensed via I2C. Once a key is pressed, the corresponding
- * register is set to 1, otherwise it is set to 0.
- *
- * This function is used to read the I2C register for a given key. Possible
- * values are 0 for KEY_A, 1 for KEY_B and 2 for KEY_F.
- *
- * \param[out] i2c The I2C state struct.
- * \param[in]  key The key to read the state of (0, 1 or 2).
- *
- * \returns Negative number on failure, 0 otherwise.
- */
-static long getKey(struct i2c *i2c, int key) {
-  return getByte(i2c, 0x69, 0x09 + key);
-}
-
-/**\brief Set key to 0.
- *
- * PIco key presses are sensed via I2C. Once a key is pressed, the corresponding
- * register is set to 1. It has to manually be set back to 0 after successfully
- * reading it, which is what this function does.
- *
- * \param[out] i2c The I2C state struct.
- * \param[in]  key The key to set to 0 (0, 1 or 2).
- *
- * \returns Negative number on failure, 0 otherwise.
- */
-static long resetKey(struct i2c *i2c, int key) {
-  return setByte(i2c, 0x69, 0x09 + key, 0);
-}
-
-/**\brief Read out temperature sensor.
- *
- * The PIco has up to two temperature sensors, one built in by default and one
- * as part of the fan kit. This function can be used to read either, depending
- * on the value of the 'sensor' parameter: 0 for the built-in sensor and 1 for
- * the external one.
- *
- * \param[out] i2c    The I2C state struct.
- * \param[in]  sensor The sensor to read out (0 or 1).
+/**\brief Daemon version
  *
- * \returns Negative number on failure, or the readout as degrees Celsius.
+ * The version number of this daemon. Will be increased around release time.
  */
-static long getTemperature(struct i2c *i2c, int sensor) {
-  return getBCD(getByte(i2c, 0x69, 0x0c + sensor));
-}
+static const int version = 4;
 
 /**\brief PIco I2C driver main function
  *
  * Parses some command line variables and then opens an I2C connection to the
  * PIco module. If the connection attempt succeeds, the code will then dump the
- * current state of the PIco and/or create a virtual input device for the
- * buttons on the PIco.
+ * current state of the PIco, create a virtual input device for the buttons on
+ * the PIco and/or serve the PIco's state to other programmes.
  *
- * The state is dumped with the '-s' parameter, and the output format is roughly
- * compatible with the text format used by the Prometheus monitoring programme.
+ * The state is dumped with the '-s' parameter, in the text format used by the
+ * Prometheus monitoring programme. The state is read as a snapshot of the
+ * PIco's status registers, in as few bus transactions as the adapter allows;
+ * the number of transactions this took is part of the output.
  *
  * The virtual input device is created using the uinput kernel driver, which
  * allows a user-space programme to act as an input device. For this mode, the
  * programme will most likely need to be run as root, as /dev/uinput is usually
- * only writable by the root user.
+ * only writable by the root user. The keys are scanned with a single block
+ * read, and the pressed ones cleared with a single block write, if the adapter
+ * supports that. The scan rate adapts: it's fast while a key is held down, and
+ * backs off to a slow idle rate otherwise. Sending SIGUSR1 prints how many bus
+ * transactions and wakeups that took so far, and how many per second, along
+ * with latency histograms of every I2C transfer by register, every input event
+ * and every loop iteration. SIGTERM and SIGINT print the same, and then make
+ * the programme exit cleanly, removing the input device.
+ *
+ * Everything runs on the event loop in ups.c, which pico-upsd shares.
+ *
+ * With '-l', the programme also serves the state at /metrics over HTTP, for
+ * Prometheus to scrape. The state is refreshed on its own interval, and all
+ * requests are answered from that snapshot, so scrapes never cause any bus
+ * traffic of their own. With '-o', the state is written to a file on the same
+ * interval instead, or as well. With '-m', the state is published in shared
+ * memory, along with the state of the keys, for pico-status and other local
+ * programmes to read without going anywhere near the bus.
+ *
+ * With '-q', the programme answers queries for fresh readings on a Unix domain
+ * socket. Values younger than the freshness window are answered from a cache,
+ * and concurrent queries are collapsed into a single read per register, so the
+ * number of clients doesn't affect the bus traffic.
+ *
+ * The refreshed snapshots are also kept in a ring buffer, and the minimum,
+ * maximum and mean of each reading over the last minute, 15 minutes and hour
+ * are written along with the snapshot. The ring buffer is allocated once, at
+ * startup, so its memory use never changes afterwards.
+ *
+ * With '-j', the snapshots are appended to a memory-mapped binary journal as
+ * well, which is only flushed to storage every so often, and which overwrites
+ * its oldest records once it's full. Use pico-log to read it.
+ *
+ * With '-f', the programme also controls the fan kit: on every refresh, the
+ * fan's duty is picked from the given curve for the hottest of the PIco's
+ * temperature sensors and, with '-z', the SoC's thermal zone, and written to
+ * the PIco if it changed. See fan.h.
  *
  * * -a [address] selects the I2C device to use. The default is /dev/i2c-1,
  *   which is the typical I2C device file on Raspberry Pi 2 and B+.
+ * * -b Do not arbitrate the bus with other processes. The default is to take
+ *   a lock on the adapter for each transfer; see i2c.h.
  * * -d launches the programme as a daemon. Setup is performed before the
  *   daemon() call, which allows error reporting for that.
+ * * -f [curve] controls the fan along the given curve of temperatures and
+ *   duties, e.g. "40:0,50:30,60:100". The default is not to do so.
+ * * -F [ms] sets the scan interval while a key is held down. The default is 50.
+ * * -H [samples] sets the number of snapshots to keep in the history. The
+ *   default is 1024; 0 turns the history off.
+ * * -I [ms] sets the scan interval when idle. The default is 500.
  * * -i Do not run the input device loop. The default is to run it.
+ * * -J [seconds] sets the interval to flush the journal at. The default is 300.
+ * * -j [path] appends the PIco's state to the journal at the given path,
+ *   creating it if needed. The default is not to do so.
+ * * -L [ms] sets how long a key needs to be held down for a long press. The
+ *   default is 400.
+ * * -l [host:port] serves the PIco's state over HTTP on the given address. The
+ *   default is not to do so.
+ * * -m [name] publishes the PIco's state and the key states in the named shared
+ *   memory segment, e.g. /pico. The default is not to do so.
+ * * -n [records] sets the number of records in a new journal. The default is
+ *   262144.
+ * * -o [directory] writes the PIco's state to pico.prom in the given directory,
+ *   for node_exporter's textfile collector. The default is not to do so.
+ * * -q [path] answers queries on a Unix domain socket at the given path. The
+ *   default is not to do so.
+ * * -r Read the status and keys one register at a time, instead of in blocks.
+ *   This is also what happens if the adapter can't do block transfers.
  * * -s Dump current PIco state. The default is not to do so.
+ * * -t [seconds] sets the interval to refresh the state for '-f', '-j', '-l',
+ *   '-m' and '-o' at. The default is 15.
  * * -u [uinput] selects the uinput device file. /dev/uinput seems to be used by
  *   Debian, even though the canonical location is /dev/input/uinput.
  * * -v prints the version of the daemon and then exits.
+ * * -w [ms] sets the freshness window for '-q'. The default is 1000.
+ * * -y [degrees] sets the fan's hysteresis. The default is 3.
+ * * -Z [path] sets the file with the firmware's throttling flags, for '-f'. The
+ *   default is /sys/devices/platform/soc/soc:firmware/get_throttled.
+ * * -z [path] includes the given thermal zone, e.g.
+ *   /sys/class/thermal/thermal_zone0/temp, in the fan's temperature. The
+ *   default is to only use the PIco's sensors.
  *
  * \param[in] argc Argument count.
  * \param[in] argv Argument vecotr.
@@ -316,179 +173,276 @@ static long getTemperature(struct i2c *i2c, int sensor) {
  */
 int main(int argc, char **argv) {
   char *adaptor = "/dev/i2c-1";
-  char *uinput = "/dev/uinput";
-  struct i2c i2c = {0, 0};
+  char *uinput = KEYS_UINPUT;
+  char *address = 0;
+  char *directory = 0;
+  char *segment = 0;
+  char *file = 0;
+  struct journal journal = {0};
+  unsigned long records = JOURNAL_RECORDS;
+  unsigned int flush = JOURNAL_FLUSH;
+  struct shm shm = {0};
+  struct i2c i2c;
+  char arbitrate = 1;
   char daemonise = 0;
   char status = 0;
+  char block = 1;
   char input_loop = 1;
-  int opt;
-
-  while ((opt = getopt(argc, argv, "a:disu:v")) != -1) {
+  struct schedule schedule = {500000, 50000, 400000};
+  struct keys keys = {-1};
+  struct metrics metrics = {{{0}}};
+  struct history history;
+  size_t samples = HISTORY_SAMPLES;
+  struct exporter exporter = {-1};
+  char exporting = 0;
+  char *curve = 0;
+  long hysteresis = FAN_HYSTERESIS;
+  char *zone = 0;
+  char *throttle = FAN_THROTTLED;
+  struct fan fan;
+  char *path = 0;
+  unsigned int window = 1000000;
+  struct query query = {-1};
+  struct ups ups;
+  unsigned int refresh = 15000000;
+  int opt, rv;
+
+  while ((opt = getopt(argc, argv,
+                       "a:bdf:F:H:I:iJ:j:L:l:m:n:o:q:rst:u:vw:y:Z:z:")) != -1) {
     switch (opt) {
     case 'a':
       adaptor = optarg;
       break;
+    case 'b':
+      arbitrate = 0;
+      break;
     case 'd':
       daemonise = 1;
       break;
+    case 'f':
+      curve = optarg;
+      break;
+    case 'F':
+      schedule.fast = atoi(optarg) * 1000;
+      break;
+    case 'H':
+      samples = strtoul(optarg, 0, 10);
+      break;
+    case 'I':
+      schedule.idle = atoi(optarg) * 1000;
+      break;
     case 'i':
       input_loop = 0;
       break;
+    case 'J':
+      flush = atoi(optarg);
+      break;
+    case 'j':
+      file = optarg;
+      break;
+    case 'L':
+      schedule.longPress = atoi(optarg) * 1000;
+      break;
+    case 'l':
+      address = optarg;
+      break;
+    case 'm':
+      segment = optarg;
+      break;
+    case 'n':
+      records = strtoul(optarg, 0, 10);
+      break;
+    case 'o':
+      directory = optarg;
+      break;
+    case 'q':
+      path = optarg;
+      break;
+    case 'r':
+      block = 0;
+      break;
     case 's':
       status = 1;
       break;
+    case 't':
+      refresh = atof(optarg) * 1e6;
+      break;
     case 'u':
       uinput = optarg;
       break;
     case 'v':
       printf("pico-i2cd/%i\n", version);
       return 0;
+    case 'w':
+      window = atoi(optarg) * 1000;
+      break;
+    case 'y':
+      hysteresis = atoi(optarg);
+      break;
+    case 'Z':
+      throttle = optarg;
+      break;
+    case 'z':
+      zone = optarg;
+      break;
     default:
-      printf("Usage: %s [-a <adaptor>] [-d] [-i] [-s] [-u <uinput>] [-v]\n",
+      printf("Usage: %s [-a <adaptor>] [-b] [-d] [-f <curve>] [-F <ms>] "
+             "[-H <samples>] [-I <ms>] [-i] [-J <seconds>] [-j <path>] "
+             "[-L <ms>] [-l <host:port>] [-m <name>] [-n <records>] "
+             "[-o <directory>] [-q <path>] [-r] [-s] [-t <seconds>] "
+             "[-u <uinput>] [-v] [-w <ms>] [-y <degrees>] [-Z <path>] "
+             "[-z <path>]\n",
              argv[0]);
       return -3;
     }
   }
 
-  i2c.device = open(adaptor, O_RDWR);
-  if (i2c.device < 0) {
+  if (i2cOpen(&i2c, adaptor, arbitrate) < 0) {
     fprintf(stderr, "Could not open adaptor: '%s'; ERRNO=%d.\n", adaptor,
             errno);
     return -1;
   }
 
   if (status) {
-    printf("pico_firmware_version %ld\n", getVersion(&i2c));
-    printf("pico_mode %ld\n", getMode(&i2c));
-    printf("pico_battery_centivolts %ld\n", getBatteryVoltage(&i2c));
-    printf("pico_host_centivolts %ld\n", getHostVoltage(&i2c));
-    printf("pico_temperature_1_celsius_degrees %ld\n", getTemperature(&i2c, 0));
-    printf("pico_temperature_2_celsius_degrees %ld\n", getTemperature(&i2c, 1));
+    (void)metricsRefresh(&metrics, &i2c, block);
+    /* registers that couldn't be read are reported as negative values. */
+
+    (void)metricsWrite(&metrics, &i2c, stdout);
   }
 
-  if (input_loop) {
-    int device = open(uinput, O_WRONLY | O_NONBLOCK), i;
-    struct uinput_user_dev userdev = {
-        "Raspberry Pi PIco UPS", {BUS_I2C, 0x0000, 0x0000, version}, 0};
-    struct input_event event = {{0}, EV_KEY, 0};
-    struct input_event syn = {{0}, EV_SYN, SYN_REPORT};
-    int code[3] = {BTN_A, BTN_B, BTN_C};
-    char release[3] = {0, 0, 0};
-    char synchronise = 0;
-
-    if (device < 0) {
-      fprintf(stderr, "Could not open uinput: '%s'; ERRNO=%d.\n", uinput,
+  if (upsOpen(&ups, "pico") < 0) {
+    fprintf(stderr, "Could not set up the event loop; ERRNO=%d.\n", errno);
+    return -4;
+  }
+
+  if (address != 0) {
+    if (exporterOpen(&exporter, address, ups.epoll) < 0) {
+      fprintf(stderr, "Could not listen on '%s'; ERRNO=%d.\n", address,
               errno);
-      return -2;
+      return -6;
     }
+  }
 
-    if (daemonise == 1) {
-      if (daemon(0, 0) < 0) {
-        printf("Failed to daemonise properly; ERRNO=%d.\n", errno);
-
-        return -3;
-      }
+  if (input_loop) {
+    rv = keysOpen(&keys, uinput, version);
+    if (rv < 0) {
+      return rv;
     }
+  }
 
-    if (ioctl(device, UI_SET_EVBIT, EV_KEY) < 0) {
-      fprintf(stderr, "Could not set event bits: ERRNO=%d.\n", errno);
-      return -5;
-    }
-    if (ioctl(device, UI_SET_EVBIT, EV_SYN) < 0) {
-      fprintf(stderr, "Could not set event bits: ERRNO=%d.\n", errno);
-      return -5;
+  if (segment != 0) {
+    if (shmCreate(&shm, segment) < 0) {
+      fprintf(stderr, "Could not create shared memory segment '%s'; "
+                      "ERRNO=%d.\n",
+              segment, errno);
+      return -7;
     }
+  }
 
-    for (i = 0; i < 3; i++) {
-      if (ioctl(device, UI_SET_KEYBIT, code[i]) < 0) {
-        fprintf(stderr, "Could not declare key code: ERRNO=%d.\n", errno);
-        return -5;
-      }
+  if (path != 0) {
+    if (queryOpen(&query, path, ups.epoll, window) < 0) {
+      fprintf(stderr, "Could not listen on '%s'; ERRNO=%d.\n", path, errno);
+      return -8;
     }
+  }
 
-    if (write(device, &userdev, sizeof(userdev)) != sizeof(userdev)) {
-      fprintf(stderr, "Could not write device id: ERRNO=%d.\n", errno);
-      return -5;
+  if (curve != 0) {
+    rv = fanOpen(&fan, curve, hysteresis, zone, throttle);
+    if (rv == -1) {
+      fprintf(stderr, "Invalid fan curve: '%s'.\n", curve);
+      return -11;
+    } else if (rv < 0) {
+      fprintf(stderr, "Could not open thermal zone '%s'; ERRNO=%d.\n", zone,
+              errno);
+      return -11;
     }
+    metrics.fan = &fan;
+  }
 
-    if (ioctl(device, UI_DEV_CREATE) < 0) {
-      fprintf(stderr, "Could not create input device: ERRNO=%d.\n", errno);
-      return -5;
+  if (file != 0) {
+    if (journalCreate(&journal, file, records, flush) < 0) {
+      fprintf(stderr, "Could not open journal '%s'; ERRNO=%d.\n", file, errno);
+      return -10;
     }
+  }
 
-    while (1) {
-      for (i = 0; i < 3; i++) {
-        int scan = getKey(&i2c, i);
-        if (release[i] > 0) {
-          if (scan == 0) {
-            event.code = code[i];
-            event.value = 0;
-            if (write(device, &event, sizeof(event)) == sizeof(event)) {
-              /* event has been sent successfully */
-              release[i] = 0;
-              synchronise = 1;
-            }
-          } else {
-            /* This is what happens when the button is still being pressed, so
-               since we saw that again we'll just reset it to 0 again. */
-            resetKey(&i2c, i);
-
-            if (release[i] == 4) {
-              /* we've detected a long press (of several scan cycles) */
-              event.code = code[i];
-              event.value = 2;
-              if (write(device, &event, sizeof(event)) == sizeof(event)) {
-                /* event has been sent successfully */
-                synchronise = 1;
-              }
-            }
-
-            /* keep counting up a few times to detect a long press. */
-            if (release[i] < 5) {
-              release[i]++;
-            }
-          }
-        } else {
-          if (scan > 0) {
-            event.code = code[i];
-            event.value = 1;
-            if (write(device, &event, sizeof(event)) == sizeof(event)) {
-              /* event has been sent successfully */
-              release[i] = 1;
-              resetKey(&i2c, i);
-              synchronise = 1;
-            }
-          }
-        }
-      }
-
-      if (synchronise) {
-        (void)write(device, &syn, sizeof(syn));
-        /* AFAICT the SYN for this should be optional, we're only sending it
-           for completeness' sake. Therefore, if it couldn't be sent right, we
-           ought to be able to ignore it. */
-        synchronise = 0;
-      }
-
-      (void)usleep(100000);
-      /* ignore the return status */
+  exporting = (exporter.fd >= 0) || (directory != 0) || (segment != 0) ||
+              (file != 0);
+
+  if (exporting && (samples > 0)) {
+    if (historyCreate(&history, samples) < 0) {
+      fprintf(stderr, "Could not allocate a history of %lu samples.\n",
+              (unsigned long)samples);
+      return -9;
     }
+    metrics.history = &history;
+  }
 
-    /* we should never reach this part of the code. */
+  if (!input_loop && !exporting && (metrics.fan == 0) && (query.fd < 0)) {
+    /* we only ever reach this part of the code IFF we disabled the input loop
+       and aren't exporting, controlling the fan or answering anything. */
 
-    (void)ioctl(device, UI_DEV_DESTROY);
-    /* clean up, but ignore the return status since this should not be
-       reachable. */
+    (void)upsClose(&ups);
+    (void)i2cClose(&i2c);
+    /* ignore these return values, as we're terminating the programme next,
+       which also closes the files. */
 
-    (void)close(device);
-    /* same here. */
+    return 0;
+  }
+
+  if (daemonise == 1) {
+    if (daemon(0, 0) < 0) {
+      printf("Failed to daemonise properly; ERRNO=%d.\n", errno);
+
+      return -3;
+    }
+  }
+
+  ups.i2c = &i2c;
+  ups.block = block;
+  if (input_loop) {
+    ups.keys = &keys;
+    ups.schedule = &schedule;
+  }
+  if (exporting || (metrics.fan != 0)) {
+    ups.metrics = &metrics;
+    ups.refresh = refresh;
+    ups.directory = directory;
+  }
+  if (shm.segment != 0) {
+    ups.shm = &shm;
+  }
+  if (journal.header != 0) {
+    ups.journal = &journal;
+  }
+  if (exporter.fd >= 0) {
+    ups.exporter = &exporter;
+  }
+  if (query.fd >= 0) {
+    ups.query = &query;
   }
 
-  /* we only ever reach this part of the code IFF we disabled the input loop. */
+  rv = upsRun(&ups);
+  if (rv < 0) {
+    fprintf(stderr, "Event loop failed; ERRNO=%d.\n", errno);
+  }
 
-  (void)close(i2c.device);
-  /* ignore this return value, as we're terminating the programme next, which
-     also closes the file. */
+  if (query.fd >= 0) {
+    (void)queryClose(&query);
+  }
+  (void)exporterClose(&exporter);
+  (void)upsClose(&ups);
+  (void)journalClose(&journal);
+  (void)shmClose(&shm);
+  (void)keysClose(&keys);
+  if (metrics.fan != 0) {
+    (void)fanClose(&fan);
+  }
+  if (metrics.history != 0) {
+    historyDestroy(&history);
+  }
+  (void)i2cClose(&i2c);
+  /* clean up, but ignore the return status since we're terminating anyway. */
 
-  return 0;
+  return rv;
 }
@@ -0,0 +1,368 @@
+/**\file
+ * \brief UPS PIco telemetry journal reader.
+ *
+ * Reads the binary journal that pico-i2cd appends its status snapshots to with
+ * '-j', and prints the records in a time range as CSV, or in the Prometheus
+ * text format, with timestamps. The range is found with a binary search, so
+ * printing the last hour of a journal that holds weeks only reads the pages
+ * that hold that hour.
+ *
+ * With '-x', it instead measures how many bytes are written to storage per
+ * sample with the journal, compared to a text log that is synced after the
+ * same number of samples, and to one that is synced after every sample.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+/* for getopt(), fsync(), unlink(), access() */
+#include <unistd.h>
+
+/* for printf(), fopen() */
+#include <stdio.h>
+
+/* for atoi(), strtoll() */
+#include <stdlib.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for time() */
+#include <time.h>
+
+#include "journal.h"
+
+/**\brief Programme version
+ *
+ * The version number of this programme. Will be increased around release time.
+ */
+static const int version = 1;
+
+/**\brief Field names
+ *
+ * The metric names of the record fields, for the Prometheus output.
+ */
+static const char *fieldName[5] = {
+    "pico_mode", "pico_battery_centivolts", "pico_host_centivolts",
+    "pico_temperature_1_celsius_degrees", "pico_temperature_2_celsius_degrees"};
+
+/**\brief Record field.
+ *
+ * \param[in] record The record.
+ * \param[in] field  The field to look up; in the order of fieldName.
+ *
+ * \returns The field's value in the record.
+ */
+static long field(const struct journalRecord *record, int field) {
+  switch (field) {
+  case 0:
+    return record->mode;
+  case 1:
+    return record->battery;
+  case 2:
+    return record->host;
+  default:
+    return record->temperature[field - 3];
+  }
+}
+
+/**\brief Parse a point in time.
+ *
+ * \param[in] text A Unix time, or a negative number of seconds before now.
+ *
+ * \returns The Unix time.
+ */
+static int64_t parseTime(const char *text) {
+  int64_t t = strtoll(text, 0, 10);
+
+  return t < 0 ? (int64_t)time(0) + t : t;
+}
+
+/**\brief Print records as CSV.
+ *
+ * \param[in] journal The journal.
+ * \param[in] first   The first record to print.
+ * \param[in] end     The first record after the range.
+ */
+static void printCSV(const struct journal *journal, uint64_t first,
+                     uint64_t end) {
+  const struct journalRecord *record;
+  uint64_t n;
+
+  printf("time,mode,battery_centivolts,host_centivolts,"
+         "temperature_1_celsius_degrees,temperature_2_celsius_degrees\n");
+
+  for (n = first; n < end; n++) {
+    record = journalRecord(journal, n);
+    printf("%lld.%09ld,%d,%d,%d,%d,%d\n", (long long)record->seconds,
+           (long)record->nanoseconds, record->mode, record->battery,
+           record->host, record->temperature[0], record->temperature[1]);
+  }
+}
+
+/**\brief Print records as Prometheus text.
+ *
+ * Prints all samples of one metric before moving on to the next, as the format
+ * requires, each with its timestamp in milliseconds.
+ *
+ * \param[in] journal The journal.
+ * \param[in] first   The first record to print.
+ * \param[in] end     The first record after the range.
+ */
+static void printPrometheus(const struct journal *journal, uint64_t first,
+                            uint64_t end) {
+  const struct journalRecord *record;
+  uint64_t n;
+  int f;
+
+  for (f = 0; f < 5; f++) {
+    printf("# TYPE %s gauge\n", fieldName[f]);
+    for (n = first; n < end; n++) {
+      record = journalRecord(journal, n);
+      printf("%s %ld %lld\n", fieldName[f], field(record, f),
+             (long long)record->seconds * 1000 + record->nanoseconds / 1000000);
+    }
+  }
+}
+
+/**\brief Bytes written to storage.
+ *
+ * Reads the number of bytes this process caused to be written to storage so
+ * far from /proc/self/io. The kernel counts a page when it's dirtied, so a page
+ * that is written to again after it was flushed counts again.
+ *
+ * \returns The number of bytes, or negative numbers if the kernel doesn't
+ *          keep track of that.
+ */
+static long long writeBytes(void) {
+  FILE *io = fopen("/proc/self/io", "r");
+  char line[128];
+  long long bytes = -1;
+
+  if (io == 0) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), io) != 0) {
+    if (sscanf(line, "write_bytes: %lld", &bytes) == 1) {
+      break;
+    }
+  }
+
+  (void)fclose(io);
+  return bytes;
+}
+
+/**\brief Print a benchmark result.
+ *
+ * \param[in] log     The kind of log, for the label.
+ * \param[in] samples The number of samples written.
+ * \param[in] logical The number of bytes per sample the log holds.
+ * \param[in] written The number of bytes written to storage.
+ */
+static void printResult(const char *log, long samples, double logical,
+                        long long written) {
+  printf("pico_log_bench_sample_bytes{log=\"%s\"} %g\n", log, logical);
+  printf("pico_log_bench_written_bytes_per_sample{log=\"%s\"} %g\n", log,
+         (double)written / samples);
+  printf("pico_log_bench_write_amplification{log=\"%s\"} %g\n", log,
+         written / samples / logical);
+}
+
+/**\brief Write amplification benchmark.
+ *
+ * Appends the given number of samples to a scratch journal, flushing it after
+ * every so many, and writes the same samples to a scratch text log, synced
+ * after the same number of samples, and again after every sample. Prints how
+ * many bytes each of these wrote to storage per sample, and how that compares
+ * to the size of a sample in the log.
+ *
+ * \param[in] path    Where to put the scratch files.
+ * \param[in] samples The number of samples to write.
+ * \param[in] batch   The number of samples between two flushes.
+ *
+ * \returns 0 on success, negative numbers on errors.
+ */
+static int bench(const char *path, long samples, long batch) {
+  char scratch[4096];
+  char text[4096];
+  struct journal journal;
+  struct picoStatus status = {{0x50, 1, 370, 510, 31, 25}};
+  struct timespec now;
+  long long before, after;
+  long length = 0;
+  long i;
+  FILE *log;
+  int sync;
+
+  if ((snprintf(scratch, sizeof(scratch), "%s.bench", path) >=
+       (int)sizeof(scratch)) ||
+      (snprintf(text, sizeof(text), "%s.bench.txt", path) >=
+       (int)sizeof(text))) {
+    return -1;
+  }
+
+  if ((access(scratch, F_OK) == 0) || (access(text, F_OK) == 0)) {
+    fprintf(stderr, "Scratch file '%s' or '%s' is in the way.\n", scratch,
+            text);
+    return -2;
+  }
+  /* journalCreate() would happily append to an existing journal. */
+
+  if (journalCreate(&journal, scratch, samples, (unsigned int)-1) < 0) {
+    fprintf(stderr, "Could not create journal '%s'; ERRNO=%d.\n", scratch,
+            errno);
+    return -2;
+  }
+
+  before = writeBytes();
+  for (i = 0; i < samples; i++) {
+    (void)clock_gettime(CLOCK_REALTIME, &now);
+    status.value[picoBattery] = 370 - i % 50;
+    (void)journalAppend(&journal, &status, &now);
+    if ((i + 1) % batch == 0) {
+      (void)journalSync(&journal);
+    }
+  }
+  (void)journalClose(&journal);
+  after = writeBytes();
+  (void)unlink(scratch);
+
+  if (before < 0) {
+    fprintf(stderr, "The kernel doesn't report the bytes written to storage; "
+                    "is task I/O accounting on?\n");
+    return -3;
+  }
+
+  printf("pico_log_bench_samples %ld\n", samples);
+  printf("pico_log_bench_samples_per_flush %ld\n", batch);
+  printResult("journal", samples, sizeof(struct journalRecord),
+              after - before);
+
+  for (sync = 0; sync < 2; sync++) {
+    log = fopen(text, "w");
+    if (log == 0) {
+      fprintf(stderr, "Could not create '%s'; ERRNO=%d.\n", text, errno);
+      return -2;
+    }
+
+    before = writeBytes();
+    for (i = 0; i < samples; i++) {
+      (void)clock_gettime(CLOCK_REALTIME, &now);
+      status.value[picoBattery] = 370 - i % 50;
+      length += fprintf(log, "%lld.%09ld,%ld,%ld,%ld,%ld,%ld\n",
+                        (long long)now.tv_sec, (long)now.tv_nsec,
+                        status.value[picoMode], status.value[picoBattery],
+                        status.value[picoHost], status.value[picoTemperature1],
+                        status.value[picoTemperature2]);
+      (void)fflush(log);
+      if ((sync == 1) || ((i + 1) % batch == 0)) {
+        (void)fsync(fileno(log));
+      }
+    }
+    (void)fsync(fileno(log));
+    after = writeBytes();
+
+    (void)fclose(log);
+    (void)unlink(text);
+
+    printResult(sync ? "text_sync" : "text", samples, (double)length / samples,
+                after - before);
+    length = 0;
+  }
+
+  return 0;
+}
+
+/**\brief PIco journal reader main function
+ *
+ * Parses the command line, then either prints the records in the given time
+ * range, or runs the write amplification benchmark.
+ *
+ * * -b [time] sets the start of the time range, as a Unix time, or as a
+ *   negative number of seconds before now. The default is the oldest record.
+ * * -e [time] sets the end of the time range, in the same way. The default is
+ *   the newest record.
+ * * -f [path] selects the journal file. The default is
+ *   /var/lib/pico-i2cd/pico.journal.
+ * * -k [samples] sets the number of samples between two flushes for '-x'. The
+ *   default is 20.
+ * * -p prints the records in the Prometheus text format, instead of as CSV.
+ * * -v prints the version of the programme and then exits.
+ * * -x [samples] runs the write amplification benchmark with the given number
+ *   of samples, using scratch files next to the journal file.
+ *
+ * \param[in] argc Argument count.
+ * \param[in] argv Argument vector.
+ *
+ * \returns 0 on success, negative numbers on errors.
+ */
+int main(int argc, char **argv) {
+  const char *path = JOURNAL_PATH;
+  int64_t begin = 0, end = INT64_MAX;
+  char prometheus = 0;
+  long samples = 0;
+  long batch = 20;
+  struct journal journal;
+  uint64_t first, last;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:e:f:k:pvx:")) != -1) {
+    switch (opt) {
+    case 'b':
+      begin = parseTime(optarg);
+      break;
+    case 'e':
+      end = parseTime(optarg);
+      break;
+    case 'f':
+      path = optarg;
+      break;
+    case 'k':
+      batch = atol(optarg);
+      break;
+    case 'p':
+      prometheus = 1;
+      break;
+    case 'v':
+      printf("pico-log/%i\n", version);
+      return 0;
+    case 'x':
+      samples = atol(optarg);
+      break;
+    default:
+      printf("Usage: %s [-b <time>] [-e <time>] [-f <path>] [-k <samples>] "
+             "[-p] [-v] [-x <samples>]\n",
+             argv[0]);
+      return -1;
+    }
+  }
+
+  if (samples > 0) {
+    return bench(path, samples, batch > 0 ? batch : 1);
+  }
+
+  if (journalOpen(&journal, path) < 0) {
+    fprintf(stderr, "Could not open journal '%s'; ERRNO=%d.\n", path, errno);
+    return -2;
+  }
+
+  first = journalFind(&journal, begin);
+  last = journalFind(&journal, end < INT64_MAX ? end + 1 : end);
+  /* the end of the range is inclusive, down to the second. */
+
+  if (prometheus) {
+    printPrometheus(&journal, first, last);
+  } else {
+    printCSV(&journal, first, last);
+  }
+
+  (void)journalClose(&journal);
+
+  return 0;
+}
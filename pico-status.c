@@ -0,0 +1,625 @@
+/**\file
+ * \brief UPS PIco shared memory status reader.
+ *
+ * Reads the PIco status that pico-i2cd publishes in shared memory with '-m',
+ * and prints it in the same format as 'pico-i2cd -s'. Unlike that, this doesn't
+ * touch the bus or need any privileges, and it takes no syscalls to read the
+ * status once the segment is mapped.
+ *
+ * With '-q', it asks pico-i2cd's query socket for a fresh status instead.
+ *
+ * With '-x', it instead stress-tests the shared memory segment's sequence lock:
+ * it creates a private segment, updates it as fast as it can from one thread,
+ * and reads it from many others, checking that every read is consistent. With
+ * '-q' as well, it load-tests the query socket: many clients query the battery
+ * voltage as fast as they can, and it reports how many bus transactions that
+ * took.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+/* for getopt(), getpid(), sleep() */
+#include <unistd.h>
+
+/* for printf() */
+#include <stdio.h>
+
+/* for atoi() */
+#include <stdlib.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for pthread_create(), pthread_join() */
+#include <pthread.h>
+
+/* for clock_gettime() */
+#include <time.h>
+
+/* for socket(), connect(), send(), recv() */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* for struct sockaddr_un */
+#include <sys/un.h>
+
+/* for strlen(), strcpy(), strstr(), memset() */
+#include <string.h>
+
+#include "shm.h"
+
+/**\brief Programme version
+ *
+ * The version number of this programme. Will be increased around release time.
+ */
+static const int version = 1;
+
+/**\brief Maximum number of stress test readers
+ *
+ * The most reader threads that '-x' will start.
+ */
+#define MAX_READERS 256
+
+/**\brief Stress test running flag
+ *
+ * Cleared by the main thread to make the writer and readers stop.
+ */
+static volatile int running = 1;
+
+/**\brief Stress test reader
+ *
+ * What a reader thread has done.
+ */
+struct reader {
+  /**\brief Thread
+   *
+   * The reader's thread.
+   */
+  pthread_t thread;
+
+  /**\brief Segment
+   *
+   * The reader's own mapping of the segment.
+   */
+  struct shm shm;
+
+  /**\brief Reads
+   *
+   * The number of snapshots the reader read.
+   */
+  unsigned long reads;
+
+  /**\brief Retries
+   *
+   * The number of times a read had to be retried because the writer was
+   * updating the segment.
+   */
+  unsigned long retries;
+
+  /**\brief Failed reads
+   *
+   * The number of times shmRead() gave up on the writer.
+   */
+  unsigned long failed;
+
+  /**\brief Torn reads
+   *
+   * The number of snapshots that weren't consistent. Should always be 0.
+   */
+  unsigned long torn;
+};
+
+/**\brief Stress test writer
+ *
+ * Publishes a new status as fast as it can. Every field of every status holds
+ * the same number, so readers can tell if they got parts of two different
+ * ones.
+ *
+ * \param[in] arg The writer's struct shm.
+ *
+ * \returns The number of updates it published, cast to a pointer.
+ */
+static void *writer(void *arg) {
+  struct shm *shm = arg;
+  unsigned long n = 0;
+
+  while (running) {
+    struct shmStatus status;
+    int i;
+
+    n++;
+    status.version = n;
+    status.mode = n;
+    status.battery = n;
+    status.host = n;
+    status.temperature[0] = n;
+    status.temperature[1] = n;
+    for (i = 0; i < SHM_KEYS; i++) {
+      status.keys[i] = n;
+    }
+    status.seconds = (int32_t)n;
+    status.nanoseconds = n;
+
+    shmWrite(shm, &status);
+  }
+
+  return (void *)n;
+}
+
+/**\brief Stress test reader
+ *
+ * Reads the status as fast as it can, and checks that every snapshot is
+ * consistent.
+ *
+ * \param[in,out] arg The reader's struct reader.
+ *
+ * \returns NULL.
+ */
+static void *readStatus(void *arg) {
+  struct reader *reader = arg;
+
+  while (running) {
+    struct shmStatus status;
+    int32_t n;
+    int retries = shmRead(&reader->shm, &status), i;
+
+    if (retries < 0) {
+      reader->failed++;
+      continue;
+    }
+
+    reader->reads++;
+    reader->retries += retries;
+
+    n = status.seconds;
+    if ((status.version != n) || (status.mode != n) ||
+        (status.battery != n) || (status.host != n) ||
+        (status.temperature[0] != n) || (status.temperature[1] != n) ||
+        (status.nanoseconds != n)) {
+      reader->torn++;
+      continue;
+    }
+    for (i = 0; i < SHM_KEYS; i++) {
+      if (status.keys[i] != n) {
+        reader->torn++;
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**\brief Run the stress test.
+ *
+ * Creates a private segment, and hammers it with one writer and the given
+ * number of readers for the given number of seconds. Prints what happened in
+ * the same format as the status.
+ *
+ * \param[in] readers The number of reader threads.
+ * \param[in] seconds How long to run the test for.
+ *
+ * \returns 0 if all reads succeeded and were consistent, negative numbers
+ *          otherwise.
+ */
+static int stress(int readers, int seconds) {
+  static struct reader reader[MAX_READERS];
+  char name[64];
+  struct shm shm;
+  pthread_t thread;
+  struct timespec start, end;
+  unsigned long reads = 0, retries = 0, failed = 0, torn = 0, writes = 0;
+  double duration;
+  void *rv;
+  int i;
+
+  (void)snprintf(name, sizeof(name), "/pico-stress.%d", (int)getpid());
+
+  if (shmCreate(&shm, name) < 0) {
+    fprintf(stderr, "Could not create shared memory segment '%s'; ERRNO=%d.\n",
+            name, errno);
+    return -2;
+  }
+
+  for (i = 0; i < readers; i++) {
+    if (shmOpen(&reader[i].shm, name) < 0) {
+      fprintf(stderr, "Could not open shared memory segment '%s'; ERRNO=%d.\n",
+              name, errno);
+      (void)shmClose(&shm);
+      return -2;
+    }
+  }
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (pthread_create(&thread, 0, writer, &shm) != 0) {
+    fprintf(stderr, "Could not start writer.\n");
+    (void)shmClose(&shm);
+    return -3;
+  }
+
+  for (i = 0; i < readers; i++) {
+    if (pthread_create(&reader[i].thread, 0, readStatus, &reader[i]) != 0) {
+      fprintf(stderr, "Could not start reader %d.\n", i);
+      readers = i;
+      break;
+    }
+  }
+
+  (void)sleep(seconds);
+  running = 0;
+
+  (void)pthread_join(thread, &rv);
+  writes = (unsigned long)rv;
+
+  for (i = 0; i < readers; i++) {
+    (void)pthread_join(reader[i].thread, 0);
+    (void)shmClose(&reader[i].shm);
+    reads += reader[i].reads;
+    retries += reader[i].retries;
+    failed += reader[i].failed;
+    torn += reader[i].torn;
+  }
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &end);
+  (void)shmClose(&shm);
+
+  duration = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("pico_stress_readers %d\n", readers);
+  printf("pico_stress_duration_seconds %g\n", duration);
+  printf("pico_stress_writes_total %lu\n", writes);
+  printf("pico_stress_reads_total %lu\n", reads);
+  printf("pico_stress_reads_per_second %g\n", reads / duration);
+  printf("pico_stress_retries_total %lu\n", retries);
+  printf("pico_stress_failed_reads_total %lu\n", failed);
+  printf("pico_stress_torn_reads_total %lu\n", torn);
+
+  return (torn == 0) && (failed == 0) ? 0 : -4;
+}
+
+/**\brief Load test client
+ *
+ * What a query client thread has done.
+ */
+struct client {
+  /**\brief Thread
+   *
+   * The client's thread.
+   */
+  pthread_t thread;
+
+  /**\brief Socket path
+   *
+   * Where pico-i2cd's query socket is.
+   */
+  const char *path;
+
+  /**\brief Queries
+   *
+   * The number of queries that were answered.
+   */
+  unsigned long queries;
+
+  /**\brief Errors
+   *
+   * The number of times the client lost its connection.
+   */
+  unsigned long errors;
+};
+
+/**\brief Connect to the query socket.
+ *
+ * \param[in] path Where pico-i2cd's query socket is.
+ *
+ * \returns The connected socket, or negative numbers on failure.
+ */
+static int connectQuery(const char *path) {
+  struct sockaddr_un address;
+  int fd;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -2;
+  }
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    (void)close(fd);
+    return -3;
+  }
+
+  return fd;
+}
+
+/**\brief Send a query.
+ *
+ * Sends a query, and waits for the answer, which ends in an empty line.
+ *
+ * \param[in]  fd     The connected query socket.
+ * \param[in]  query  The query, including the line break.
+ * \param[out] answer Where to store the answer.
+ * \param[in]  size   The size of the answer buffer.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int ask(int fd, const char *query, char *answer, size_t size) {
+  size_t length = 0;
+
+  if (send(fd, query, strlen(query), MSG_NOSIGNAL) != (ssize_t)strlen(query)) {
+    return -1;
+  }
+
+  while (length < size - 1) {
+    ssize_t r = recv(fd, answer + length, size - 1 - length, 0);
+    if (r <= 0) {
+      return -2;
+    }
+    length += r;
+    answer[length] = 0;
+    if ((length >= 2) && (strcmp(answer + length - 2, "\n\n") == 0)) {
+      return 0;
+    }
+  }
+
+  return -3;
+}
+
+/**\brief Get the bus transaction count.
+ *
+ * Asks pico-i2cd for its statistics, which doesn't cause any bus traffic.
+ *
+ * \param[in] path Where pico-i2cd's query socket is.
+ *
+ * \returns The number of bus transactions pico-i2cd has made, or negative
+ *          numbers on failure.
+ */
+static long transactions(const char *path) {
+  char answer[1024];
+  const char *line;
+  int fd = connectQuery(path);
+  long rv = -1;
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ask(fd, "statistics\n", answer, sizeof(answer)) == 0) {
+    line = strstr(answer, "pico_i2c_transactions_total ");
+    if (line != 0) {
+      rv = atol(line + strlen("pico_i2c_transactions_total "));
+    }
+  }
+
+  (void)close(fd);
+  return rv;
+}
+
+/**\brief Load test client
+ *
+ * Queries the battery voltage as fast as it can, reconnecting if it loses its
+ * connection.
+ *
+ * \param[in,out] arg The client's struct client.
+ *
+ * \returns NULL.
+ */
+static void *queryBattery(void *arg) {
+  struct client *client = arg;
+  char answer[256];
+  int fd = -1;
+
+  while (running) {
+    if (fd < 0) {
+      fd = connectQuery(client->path);
+      if (fd < 0) {
+        client->errors++;
+        (void)usleep(10000);
+        continue;
+      }
+    }
+
+    if (ask(fd, "battery\n", answer, sizeof(answer)) == 0) {
+      client->queries++;
+    } else {
+      client->errors++;
+      (void)close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd >= 0) {
+    (void)close(fd);
+  }
+
+  return 0;
+}
+
+/**\brief Run the load test.
+ *
+ * Starts the given number of query clients for the given number of seconds,
+ * and prints how many queries they got answered and how many bus transactions
+ * pico-i2cd made in the meantime, in the same format as the status.
+ *
+ * \param[in] path    Where pico-i2cd's query socket is.
+ * \param[in] clients The number of client threads.
+ * \param[in] seconds How long to run the test for.
+ *
+ * \returns 0 if no client lost its connection, negative numbers otherwise.
+ */
+static int load(const char *path, int clients, int seconds) {
+  static struct client client[MAX_READERS];
+  unsigned long queries = 0, errors = 0;
+  struct timespec start, end;
+  long before, after;
+  double duration;
+  int i;
+
+  before = transactions(path);
+  if (before < 0) {
+    fprintf(stderr, "Could not query '%s'; ERRNO=%d.\n", path, errno);
+    return -2;
+  }
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < clients; i++) {
+    client[i].path = path;
+    if (pthread_create(&client[i].thread, 0, queryBattery, &client[i]) != 0) {
+      fprintf(stderr, "Could not start client %d.\n", i);
+      clients = i;
+      break;
+    }
+  }
+
+  (void)sleep(seconds);
+  running = 0;
+
+  for (i = 0; i < clients; i++) {
+    (void)pthread_join(client[i].thread, 0);
+    queries += client[i].queries;
+    errors += client[i].errors;
+  }
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &end);
+  after = transactions(path);
+
+  duration = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("pico_load_clients %d\n", clients);
+  printf("pico_load_duration_seconds %g\n", duration);
+  printf("pico_load_queries_total %lu\n", queries);
+  printf("pico_load_queries_per_second %g\n", queries / duration);
+  printf("pico_load_errors_total %lu\n", errors);
+  printf("pico_load_i2c_transactions_total %ld\n", after - before);
+  printf("pico_load_i2c_transactions_per_second %g\n",
+         (after - before) / duration);
+
+  return errors == 0 ? 0 : -4;
+}
+
+/**\brief PIco status reader main function
+ *
+ * Parses the command line, then either prints the status from the shared
+ * memory segment, or runs the stress test.
+ *
+ * * -c [seconds] sets how long the stress test runs for. The default is 5.
+ * * -m [name] selects the shared memory segment. The default is /pico.
+ * * -q [path] queries pico-i2cd's query socket at the given path, instead of
+ *   reading shared memory.
+ * * -v prints the version of the programme and then exits.
+ * * -x [readers] runs the stress test with the given number of readers,
+ *   instead of printing the status. With '-q', runs the load test with the
+ *   given number of clients.
+ *
+ * \param[in] argc Argument count.
+ * \param[in] argv Argument vector.
+ *
+ * \returns 0 on success, negative numbers on errors.
+ */
+int main(int argc, char **argv) {
+  const char *name = SHM_NAME;
+  const char *path = 0;
+  int readers = 0;
+  int seconds = 5;
+  struct shm shm;
+  struct shmStatus status;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:m:q:vx:")) != -1) {
+    switch (opt) {
+    case 'c':
+      seconds = atoi(optarg);
+      break;
+    case 'm':
+      name = optarg;
+      break;
+    case 'q':
+      path = optarg;
+      break;
+    case 'v':
+      printf("pico-status/%i\n", version);
+      return 0;
+    case 'x':
+      readers = atoi(optarg);
+      if ((readers < 1) || (readers > MAX_READERS)) {
+        fprintf(stderr, "Readers must be between 1 and %d.\n", MAX_READERS);
+        return -1;
+      }
+      break;
+    default:
+      printf("Usage: %s [-c <seconds>] [-m <name>] [-q <path>] [-v] "
+             "[-x <readers>]\n",
+             argv[0]);
+      return -1;
+    }
+  }
+
+  if ((readers > 0) && (path != 0)) {
+    return load(path, readers, seconds);
+  }
+
+  if (readers > 0) {
+    return stress(readers, seconds);
+  }
+
+  if (path != 0) {
+    char answer[1024];
+    int fd = connectQuery(path);
+
+    if ((fd < 0) || (ask(fd, "status\n", answer, sizeof(answer)) < 0)) {
+      fprintf(stderr, "Could not query '%s'; ERRNO=%d.\n", path, errno);
+      return -2;
+    }
+
+    (void)close(fd);
+    answer[strlen(answer) - 1] = 0;
+    /* drop the empty line that ends the answer. */
+    printf("%s", answer);
+    return 0;
+  }
+
+  if (shmOpen(&shm, name) < 0) {
+    fprintf(stderr, "Could not open shared memory segment '%s'; ERRNO=%d.\n",
+            name, errno);
+    return -2;
+  }
+
+  if (shmRead(&shm, &status) < 0) {
+    fprintf(stderr, "Shared memory segment '%s' is being updated by a writer "
+                    "that seems to have died.\n",
+            name);
+    return -3;
+  }
+
+  printf("pico_firmware_version %ld\n", (long)status.version);
+  printf("pico_mode %ld\n", (long)status.mode);
+  printf("pico_battery_centivolts %ld\n", (long)status.battery);
+  printf("pico_host_centivolts %ld\n", (long)status.host);
+  printf("pico_temperature_1_celsius_degrees %ld\n",
+         (long)status.temperature[0]);
+  printf("pico_temperature_2_celsius_degrees %ld\n",
+         (long)status.temperature[1]);
+  printf("pico_key_state{key=\"a\"} %ld\n", (long)status.keys[0]);
+  printf("pico_key_state{key=\"b\"} %ld\n", (long)status.keys[1]);
+  printf("pico_key_state{key=\"f\"} %ld\n", (long)status.keys[2]);
+  printf("pico_sample_timestamp_seconds %ld.%09ld\n", (long)status.seconds,
+         (long)status.nanoseconds);
+  printf("pico_status_updates_total %lu\n", (unsigned long)status.updates);
+
+  (void)shmClose(&shm);
+
+  return 0;
+}
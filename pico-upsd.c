@@ -0,0 +1,374 @@
+/**\file
+ * \brief UPS PIco combined daemon.
+ *
+ * Does what picod and pico-i2cd do, in one process: the pulse train on pin #22
+ * and the FSSD signal on pin #27, the PIco's keys, and the status snapshot with
+ * its exporters, all on one event loop with one I2C handle and one snapshot.
+ *
+ * That's one process instead of two, with the wakeups of both merged into one
+ * schedule, and it means that the FSSD signal and the PIco's status are seen
+ * together: when the FSSD signal goes LOW, the snapshot is refreshed and the
+ * journal flushed right away, so the last readings before the power goes out
+ * make it to storage and to the exporters.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Hardware: http://pimodules.com/_pdf/_pico/UPS_PIco_BL_FSSD_V1.0.pdf
+ * \see Hardware Vendor: http://pimodules.com/
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+/* for getopt(), daemon() */
+#include <unistd.h>
+
+/* for printf() */
+#include <stdio.h>
+
+/* for atoi() */
+#include <stdlib.h>
+
+/* for memset() */
+#include <string.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for GPIO pin handles */
+#include "gpio.h"
+
+/* for FSSD actions */
+#include "action.h"
+
+/* for I2C bus access */
+#include "i2c.h"
+
+/* for the Prometheus exporter */
+#include "exporter.h"
+
+/* for the telemetry history */
+#include "history.h"
+
+/* for the telemetry journal */
+#include "journal.h"
+
+/* for the shared memory status */
+#include "shm.h"
+
+/* for the query socket */
+#include "query.h"
+
+/* for the virtual input device */
+#include "keys.h"
+
+/* for the pulse train and the FSSD signal */
+#include "heartbeat.h"
+
+/* for the event loop */
+#include "ups.h"
+
+/**\brief Daemon version
+ *
+ * The version number of this daemon. Will be increased around release time.
+ */
+static const int version = 1;
+
+/**\brief pico-upsd's main function.
+ *
+ * Parses some command line options, sets up the pins, the I2C bus and whatever
+ * outputs were asked for, and then runs them all on the event loop.
+ *
+ * The options are those of picod and pico-i2cd that make sense together; for
+ * the rest, e.g. real-time mode or the measurement mode, use the separate
+ * daemons.
+ *
+ * * -a [address] selects the I2C device to use. The default is /dev/i2c-1.
+ * * -b Do not arbitrate the bus with other processes.
+ * * -c [chip] uses the GPIO character device interface on the given chip,
+ *   e.g. /dev/gpiochip0, instead of sysfs.
+ * * -d launches the programme as a daemon. Setup is performed before the
+ *   daemon() call, which allows error reporting for that.
+ * * -g [root] selects the sysfs GPIO root. The default is /sys/class/gpio.
+ * * -H [dir] sets a hook directory to run when pin #27 goes LOW.
+ * * -i Do not scan the keys. The default is to scan them.
+ * * -j [path] appends the PIco's state to the journal at the given path,
+ *   creating it if needed. The default is not to do so.
+ * * -k [pid] shuts down by sending SIGRTMIN+4 to the given process instead of
+ *   running a command.
+ * * -l [host:port] serves the PIco's state over HTTP on the given address. The
+ *   default is not to do so.
+ * * -m [name] publishes the PIco's state and the key states in the named shared
+ *   memory segment. The default is not to do so.
+ * * -n disables the FSSD test.
+ * * -o [directory] writes the PIco's state to pico.prom in the given directory.
+ *   The default is not to do so.
+ * * -q [path] answers queries on a Unix domain socket at the given path. The
+ *   default is not to do so.
+ * * -t [seconds] sets the interval to refresh the state at. The default is 15.
+ * * -u [uinput] selects the uinput device file. The default is /dev/uinput.
+ * * -v prints the version of the daemon and then exits.
+ * * -x [command] sets the command to run to shut down; the default is
+ *   "/sbin/shutdown -h now".
+ *
+ * Sending the daemon a SIGUSR1 makes it print the statistics of both picod and
+ * pico-i2cd, with a "pico" prefix; SIGTERM and SIGINT print them and exit.
+ *
+ * \param[in] argc Argument count.
+ * \param[in] argv Argument vecotr.
+ *
+ * \returns 0 on success, negative numbers for programme setup errors.
+ */
+int main(int argc, char **argv) {
+  char *adaptor = "/dev/i2c-1";
+  char *uinput = KEYS_UINPUT;
+  char *address = 0;
+  char *directory = 0;
+  char *segment = 0;
+  char *file = 0;
+  char *path = 0;
+  enum gpioBackend backend = gpioSysfs;
+  const char *root = GPIO_SYSFS_ROOT;
+  char arbitrate = 1;
+  char daemonise = 0;
+  char input_loop = 1;
+  static struct heartbeat heartbeat;
+  static struct fssd fssd;
+  static struct journal journal;
+  static struct shm shm;
+  static struct metrics metrics;
+  static struct history history;
+  struct gpio *pins[2];
+  struct i2c i2c;
+  struct schedule schedule = {500000, 50000, 400000};
+  struct keys keys = {-1};
+  struct exporter exporter = {-1};
+  struct query query = {-1};
+  struct ups ups;
+  unsigned int refresh = 15000000;
+  int opt, rv;
+
+  memset(&fssd, 0, sizeof(fssd));
+  fssd.enabled = 1;
+  fssd.latency = -1;
+  fssd.action.strategy = actionSpawn;
+  (void)actionCommand(&fssd.action, ACTION_COMMAND);
+  fssd.action.hookTimeout = 10;
+  fssd.action.hookDeadline = 30;
+
+  while ((opt = getopt(argc, argv, "a:bc:dg:H:ij:k:l:m:no:q:t:u:vx:")) != -1) {
+    switch (opt) {
+    case 'a':
+      adaptor = optarg;
+      break;
+    case 'b':
+      arbitrate = 0;
+      break;
+    case 'c':
+      backend = gpioChardev;
+      root = optarg;
+      break;
+    case 'd':
+      daemonise = 1;
+      break;
+    case 'g':
+      backend = gpioSysfs;
+      root = optarg;
+      break;
+    case 'H':
+      fssd.action.hooks = optarg;
+      break;
+    case 'i':
+      input_loop = 0;
+      break;
+    case 'j':
+      file = optarg;
+      break;
+    case 'k':
+      fssd.action.strategy = actionSignal;
+      fssd.action.init = atoi(optarg);
+      break;
+    case 'l':
+      address = optarg;
+      break;
+    case 'm':
+      segment = optarg;
+      break;
+    case 'n':
+      fssd.enabled = 0;
+      break;
+    case 'o':
+      directory = optarg;
+      break;
+    case 'q':
+      path = optarg;
+      break;
+    case 't':
+      refresh = atof(optarg) * 1e6;
+      break;
+    case 'u':
+      uinput = optarg;
+      break;
+    case 'v':
+      printf("pico-upsd/%i\n", version);
+      return 0;
+    case 'x':
+      fssd.action.strategy = actionSpawn;
+      if (actionCommand(&fssd.action, optarg) != 0) {
+        fprintf(stderr, "Invalid shutdown command: '%s'.\n", optarg);
+        return -3;
+      }
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-a <adaptor>] [-b] [-c <chip>] [-d] [-g <root>] "
+              "[-H <dir>] [-i] [-j <path>] [-k <pid>] [-l <host:port>] "
+              "[-m <name>] [-n] [-o <directory>] [-q <path>] [-t <seconds>] "
+              "[-u <uinput>] [-v] [-x <command>]\n",
+              argv[0]);
+      return -3;
+    }
+  }
+
+  if (i2cOpen(&i2c, adaptor, arbitrate) < 0) {
+    fprintf(stderr, "Could not open adaptor: '%s'; ERRNO=%d.\n", adaptor,
+            errno);
+    return -1;
+  }
+
+  pins[0] = &heartbeat.pin;
+  pins[1] = &fssd.pin;
+
+  if (gpioRequest(&heartbeat.pin, backend, root, 22, 1) != 0) {
+    fprintf(stderr, "Could not set up pin #22 as an output pin for the pulse "
+                    "train.\n");
+    return -5;
+  }
+
+  if ((fssd.enabled == 1) &&
+      (gpioRequest(&fssd.pin, backend, root, 27, 0) != 0)) {
+    fprintf(stderr, "Could not set up pin #27 as input for the FSSD "
+                    "feature.\n");
+    return -4;
+  }
+
+  if (gpioReady(pins, fssd.enabled == 1 ? 2 : 1) != 0) {
+    if (heartbeat.pin.fd < 0) {
+      fprintf(stderr, "Could not set up pin #22 as an output pin for the "
+                      "pulse train.\n");
+      return -5;
+    }
+    fprintf(stderr, "Could not set up pin #27 as input for the FSSD "
+                    "feature.\n");
+    return -4;
+  }
+  /* both pins are exported first, and then waited for together. */
+
+  if (fssd.enabled == 1) {
+    if (gpioEdge(&fssd.pin) != 0) {
+      fprintf(stderr, "Could not arm edge detection on pin #27; sampling it "
+                      "instead.\n");
+    }
+  }
+
+  if (upsOpen(&ups, "pico") < 0) {
+    fprintf(stderr, "Could not set up the event loop; ERRNO=%d.\n", errno);
+    return -11;
+  }
+
+  if (address != 0) {
+    if (exporterOpen(&exporter, address, ups.epoll) < 0) {
+      fprintf(stderr, "Could not listen on '%s'; ERRNO=%d.\n", address,
+              errno);
+      return -6;
+    }
+    ups.exporter = &exporter;
+  }
+
+  if (input_loop) {
+    rv = keysOpen(&keys, uinput, version);
+    if (rv < 0) {
+      return rv;
+    }
+    ups.keys = &keys;
+    ups.schedule = &schedule;
+  }
+
+  if (segment != 0) {
+    if (shmCreate(&shm, segment) < 0) {
+      fprintf(stderr, "Could not create shared memory segment '%s'; "
+                      "ERRNO=%d.\n",
+              segment, errno);
+      return -7;
+    }
+    ups.shm = &shm;
+  }
+
+  if (path != 0) {
+    if (queryOpen(&query, path, ups.epoll, 1000000) < 0) {
+      fprintf(stderr, "Could not listen on '%s'; ERRNO=%d.\n", path, errno);
+      return -8;
+    }
+    ups.query = &query;
+  }
+
+  if (file != 0) {
+    if (journalCreate(&journal, file, JOURNAL_RECORDS, JOURNAL_FLUSH) < 0) {
+      fprintf(stderr, "Could not open journal '%s'; ERRNO=%d.\n", file, errno);
+      return -10;
+    }
+    ups.journal = &journal;
+  }
+
+  if ((address != 0) || (directory != 0) || (segment != 0) || (file != 0)) {
+    if (historyCreate(&history, HISTORY_SAMPLES) < 0) {
+      fprintf(stderr, "Could not allocate a history of %lu samples.\n",
+              (unsigned long)HISTORY_SAMPLES);
+      return -9;
+    }
+    metrics.history = &history;
+
+    ups.metrics = &metrics;
+    ups.refresh = refresh;
+    ups.directory = directory;
+  }
+
+  if (daemonise == 1) {
+    if (daemon(0, 0) < 0) {
+      fprintf(stderr, "Failed to daemonise properly; ERRNO=%d.\n", errno);
+
+      return -2;
+    }
+  }
+
+  ups.i2c = &i2c;
+  ups.heartbeat = &heartbeat;
+  ups.fssd = &fssd;
+
+  rv = upsRun(&ups);
+  if (rv < 0) {
+    fprintf(stderr, "Event loop failed; ERRNO=%d.\n", errno);
+  }
+
+  if (query.fd >= 0) {
+    (void)queryClose(&query);
+  }
+  (void)exporterClose(&exporter);
+  (void)upsClose(&ups);
+  (void)journalClose(&journal);
+  (void)shmClose(&shm);
+  (void)keysClose(&keys);
+  if (metrics.history != 0) {
+    historyDestroy(&history);
+  }
+  (void)gpioClose(&heartbeat.pin);
+  if (fssd.enabled == 1) {
+    (void)gpioClose(&fssd.pin);
+  }
+  (void)i2cClose(&i2c);
+  /* clean up, but ignore the return status since we're terminating anyway. */
+
+  return rv;
+}
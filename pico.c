@@ -0,0 +1,386 @@
+/**\file
+ * \brief PIco registers.
+ *
+ * Implements the register table and accessors declared in pico.h. The PIco's
+ * status registers are spread over two I2C addresses: 0x69 holds the power
+ * mode, voltages, keys and temperatures in registers 0x00 through 0x0d, and
+ * 0x6b holds the firmware version in register 0x00 and the fan kit's settings
+ * in registers 0x11 and 0x12; the latter are only read for fan control.
+ *
+ * Reads of several registers are planned from the table: the registers are
+ * sorted by address and offset, and with block reads, all of those at the same
+ * address that fit into one block are read together, gaps and all. Every value
+ * is checked against its encoding and valid range before it's passed on, so a
+ * garbled read shows up as an invalid value rather than a wrong one.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Hardware: http://pimodules.com/_pdf/_pico/UPS_PIco_BL_FSSD_V1.0.pdf
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "pico.h"
+
+/**\brief Largest block
+ *
+ * The most registers a single block transfer can cover; this is the SMBus
+ * limit.
+ */
+#define BLOCK_REGISTERS 32
+
+/**\brief Register table
+ *
+ * Where each status register lives, how it's encoded and which values make
+ * sense, by enum picoField. The valid ranges are generous: they're there to
+ * catch garbled reads, not to judge the PIco's health.
+ */
+const struct picoRegister picoRegisters[PICO_FIELDS] = {
+    [picoVersion] = {"version", "pico_firmware_version",
+                     "Firmware version of the PIco.", 0x6b, 0x00, 1,
+                     picoBinary, 0x00, 0xff},
+    [picoMode] = {"mode", "pico_mode",
+                  "Power mode: 1 when plugged in, 2 when on battery.", 0x69,
+                  0x00, 1, picoBinary, 1, 2},
+    [picoBattery] = {"battery", "pico_battery_centivolts",
+                     "Battery voltage, in centi-volts.", 0x69, 0x01, 2,
+                     picoBCD, 0, 600},
+    [picoHost] = {"host", "pico_host_centivolts",
+                  "Raspberry Pi 5V line voltage, in centi-volts.", 0x69, 0x03,
+                  2, picoBCD, 0, 700},
+    [picoTemperature1] = {"temperature1", "pico_temperature_1_celsius_degrees",
+                          "Temperature of the built-in sensor.", 0x69, 0x0c, 1,
+                          picoBCD, 0, 99},
+    [picoTemperature2] = {"temperature2", "pico_temperature_2_celsius_degrees",
+                          "Temperature of the external sensor.", 0x69, 0x0d, 1,
+                          picoBCD, 0, 99},
+    [picoFanMode] = {"fan_mode", "pico_fan_mode",
+                     "Fan kit mode: 0 when off, 1 when on, 2 when automatic.",
+                     0x6b, 0x11, 1, picoBinary, 0, 2},
+    [picoFanSpeed] = {"fan_speed", "pico_fan_speed_percent",
+                      "Fan kit speed, in percent.", 0x6b, 0x12, 1, picoBinary,
+                      0, 100}};
+
+/**\brief Planned transfer
+ *
+ * A single bus transaction that covers one or more status registers.
+ */
+struct transfer {
+  /**\brief I2C address
+   *
+   * The address to read from.
+   */
+  int addr;
+
+  /**\brief First register
+   *
+   * The register the transfer starts at.
+   */
+  int reg;
+
+  /**\brief Length
+   *
+   * The number of registers to read.
+   */
+  int length;
+};
+
+/**\brief Decode a register
+ *
+ * Decodes a register's bytes according to its encoding, and checks that the
+ * result is in its valid range.
+ *
+ * \param[in] reg  The register's descriptor.
+ * \param[in] data The register's bytes, low byte first.
+ *
+ * \returns The decoded value, or -2 if it isn't valid.
+ */
+static long decode(const struct picoRegister *reg, const unsigned char *data) {
+  long raw = 0, value = 0, scale = 1;
+  int i;
+
+  for (i = reg->width - 1; i >= 0; i--) {
+    raw = (raw << 8) | data[i];
+  }
+
+  if (reg->encoding == picoBCD) {
+    for (i = 0; i < reg->width * 2; i++) {
+      long digit = (raw >> (4 * i)) & 0xf;
+      if (digit > 9) {
+        return -2;
+      }
+      value += digit * scale;
+      scale *= 10;
+    }
+  } else {
+    value = raw;
+  }
+
+  if ((value < reg->minimum) || (value > reg->maximum)) {
+    return -2;
+  }
+
+  return value;
+}
+
+/**\brief Plan the transfers for a set of registers.
+ *
+ * Sorts the registers in the mask by address and offset. Without block reads,
+ * each of them is a transfer of its own; with them, registers at the same
+ * address are merged into one transfer as long as it stays within
+ * BLOCK_REGISTERS, since a few extra bytes on the bus are cheaper than another
+ * transaction.
+ *
+ * \param[in]  mask     The enum picoField bits of the registers to read.
+ * \param[in]  block    Nonzero if block reads can be used.
+ * \param[out] transfer The planned transfers.
+ *
+ * \returns The number of transfers.
+ */
+static int plan(unsigned long mask, char block,
+                struct transfer transfer[PICO_FIELDS]) {
+  int order[PICO_FIELDS];
+  int fields = 0, transfers = 0, i, j;
+
+  for (i = 0; i < PICO_FIELDS; i++) {
+    const struct picoRegister *reg = &picoRegisters[i];
+
+    if (!(mask & (1UL << i))) {
+      continue;
+    }
+
+    for (j = fields; j > 0; j--) {
+      const struct picoRegister *other = &picoRegisters[order[j - 1]];
+      if ((other->addr < reg->addr) ||
+          ((other->addr == reg->addr) && (other->reg <= reg->reg))) {
+        break;
+      }
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+    fields++;
+  }
+
+  for (i = 0; i < fields; i++) {
+    const struct picoRegister *reg = &picoRegisters[order[i]];
+
+    if (block && (transfers > 0)) {
+      struct transfer *last = &transfer[transfers - 1];
+      int length = reg->reg + reg->width - last->reg;
+
+      if ((last->addr == reg->addr) && (length <= BLOCK_REGISTERS)) {
+        if (length > last->length) {
+          last->length = length;
+        }
+        continue;
+      }
+    }
+
+    transfer[transfers].addr = reg->addr;
+    transfer[transfers].reg = reg->reg;
+    transfer[transfers].length = reg->width;
+    transfers++;
+  }
+
+  return transfers;
+}
+
+/**\brief Get key status.
+ *
+ * PIco key presses are sensed via I2C. Once a key is pressed, the corresponding
+ * register is set to 1, otherwise it is set to 0.
+ *
+ * This function is used to read the I2C register for a given key. Possible
+ * values are 0 for KEY_A, 1 for KEY_B and 2 for KEY_F.
+ *
+ * \param[out] i2c The I2C state struct.
+ * \param[in]  key The key to read the state of (0, 1 or 2).
+ *
+ * \returns Negative number on failure, 0 otherwise.
+ */
+long getKey(struct i2c *i2c, int key) {
+  return getByte(i2c, 0x69, 0x09 + key);
+}
+
+/**\brief Set key to 0.
+ *
+ * PIco key presses are sensed via I2C. Once a key is pressed, the corresponding
+ * register is set to 1. It has to manually be set back to 0 after successfully
+ * reading it, which is what this function does.
+ *
+ * \param[out] i2c The I2C state struct.
+ * \param[in]  key The key to set to 0 (0, 1 or 2).
+ *
+ * \returns Negative number on failure, 0 otherwise.
+ */
+long resetKey(struct i2c *i2c, int key) {
+  return setByte(i2c, 0x69, 0x09 + key, 0);
+}
+
+/**\brief Get the status of all keys.
+ *
+ * Reads the registers of all three keys. With block reads, this takes a single
+ * bus transaction instead of one per key.
+ *
+ * \param[out] i2c   The I2C state struct.
+ * \param[out] keys  The key registers, for KEY_A, KEY_B and KEY_F.
+ * \param[in]  block Nonzero to use a block read if possible.
+ *
+ * \returns Negative number on failure, 0 otherwise.
+ */
+int picoKeys(struct i2c *i2c, unsigned char keys[PICO_KEYS], char block) {
+  int i;
+
+  if (block && i2cBlock(i2c)) {
+    return getBlock(i2c, 0x69, 0x09, keys, PICO_KEYS);
+  }
+
+  for (i = 0; i < PICO_KEYS; i++) {
+    long key = getKey(i2c, i);
+    if (key < 0) {
+      return key;
+    }
+    keys[i] = key;
+  }
+
+  return 0;
+}
+
+/**\brief Set keys to 0.
+ *
+ * Clears the registers of the keys that are flagged in 'reset'. With block
+ * writes, adjacent flagged keys are cleared in a single bus transaction; if
+ * there's a key in between that isn't flagged, the keys are cleared one by one
+ * instead, so that key's press isn't lost.
+ *
+ * \param[out] i2c   The I2C state struct.
+ * \param[in]  reset Nonzero for the keys to clear: KEY_A, KEY_B and KEY_F.
+ * \param[in]  block Nonzero to use a block write if possible.
+ *
+ * \returns Negative number on failure, 0 otherwise.
+ */
+int picoResetKeys(struct i2c *i2c, const unsigned char reset[PICO_KEYS],
+                  char block) {
+  static const unsigned char zero[PICO_KEYS] = {0, 0, 0};
+  int first = 0, last = PICO_KEYS - 1, i, rv = 0;
+  char adjacent = 1;
+
+  while ((first < PICO_KEYS) && !reset[first]) {
+    first++;
+  }
+  while ((last >= first) && !reset[last]) {
+    last--;
+  }
+
+  if (first > last) {
+    /* nothing to do. */
+    return 0;
+  }
+
+  for (i = first; i <= last; i++) {
+    adjacent = adjacent && reset[i];
+  }
+
+  if (block && adjacent && (first < last)) {
+    rv = setBlock(i2c, 0x69, 0x09 + first, zero, last - first + 1);
+    if (rv != -2) {
+      return rv;
+    }
+    /* otherwise the adapter can't do block writes, so do it key by key. */
+    rv = 0;
+  }
+
+  for (i = first; i <= last; i++) {
+    if (reset[i] && (resetKey(i2c, i) < 0)) {
+      rv = -1;
+    }
+  }
+
+  return rv;
+}
+
+/**\brief Read status registers.
+ *
+ * Reads the registers in the mask, in as few bus transactions as the plan
+ * allows, and decodes them into the status. Fields that aren't in the mask are
+ * left alone.
+ *
+ * \param[out] i2c    The I2C state struct.
+ * \param[out] status The status to fill in.
+ * \param[in]  mask   The enum picoField bits of the registers to read.
+ * \param[in]  block  Nonzero to use block reads if possible.
+ *
+ * \returns 0 on success, -1 if any registers couldn't be read, -2 if any of
+ *          them didn't decode to a valid value. Those are set to -1 and -2 in
+ *          the status.
+ */
+int picoRead(struct i2c *i2c, struct picoStatus *status, unsigned long mask,
+             char block) {
+  struct transfer transfer[PICO_FIELDS];
+  unsigned char data[BLOCK_REGISTERS];
+  int transfers, rv = 0, i, f;
+
+  block = block && i2cBlock(i2c);
+  transfers = plan(mask, block, transfer);
+
+  for (i = 0; i < transfers; i++) {
+    const struct transfer *t = &transfer[i];
+    long w;
+
+    if (block) {
+      w = getBlock(i2c, t->addr, t->reg, data, t->length);
+    } else if (t->length == 2) {
+      w = getWord(i2c, t->addr, t->reg);
+      data[0] = w & 0xff;
+      data[1] = (w >> 8) & 0xff;
+      /* SMBus words are sent low byte first. */
+    } else {
+      w = getByte(i2c, t->addr, t->reg);
+      data[0] = w & 0xff;
+    }
+
+    for (f = 0; f < PICO_FIELDS; f++) {
+      const struct picoRegister *reg = &picoRegisters[f];
+
+      if (!(mask & (1UL << f)) || (reg->addr != t->addr) ||
+          (reg->reg < t->reg) || (reg->reg + reg->width > t->reg + t->length)) {
+        continue;
+      }
+
+      if (w < 0) {
+        status->value[f] = -1;
+        rv = -1;
+      } else {
+        status->value[f] = decode(reg, data + reg->reg - t->reg);
+        if ((status->value[f] < 0) && (rv == 0)) {
+          rv = -2;
+        }
+      }
+    }
+  }
+
+  return rv;
+}
+
+/**\brief Read a snapshot of the PIco's status.
+ *
+ * Reads all the status registers and decodes them into a status struct. If
+ * block reads are enabled and the adapter supports them, this takes only two
+ * bus transactions: one for the register block at 0x69, and one for the
+ * firmware version at 0x6b. Otherwise, every register is read separately,
+ * which takes six. The fan kit's registers aren't part of the snapshot; see
+ * PICO_FAN.
+ *
+ * \param[out] i2c    The I2C state struct.
+ * \param[out] status The status to fill in.
+ * \param[in]  block  Nonzero to use block reads if possible.
+ *
+ * \returns 0 on success, negative numbers if any registers couldn't be read;
+ *          see picoRead().
+ */
+int picoSnapshot(struct i2c *i2c, struct picoStatus *status, char block) {
+  return picoRead(i2c, status, PICO_ALL, block);
+}
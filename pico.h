@@ -0,0 +1,217 @@
+/**\file
+ * \brief PIco registers.
+ *
+ * The PIco's status registers, as a table that says where each of them lives
+ * and how to decode it, and functions that read any set of them in as few bus
+ * transactions as the adapter allows. Keys are handled separately, since they
+ * have to be cleared after reading them.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Hardware: http://pimodules.com/_pdf/_pico/UPS_PIco_BL_FSSD_V1.0.pdf
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_PICO_H)
+#define PICO_PICO_H
+
+#include "i2c.h"
+
+/**\brief Number of keys
+ *
+ * The PIco has three keys - KEY_A, KEY_B and KEY_F - with one register each,
+ * at 0x69/0x09 through 0x69/0x0b.
+ */
+#define PICO_KEYS 3
+
+/**\brief Register encoding
+ *
+ * How a register's raw bytes turn into a value.
+ */
+enum picoEncoding {
+  /**\brief Binary
+   *
+   * The value as it is, low byte first.
+   */
+  picoBinary,
+
+  /**\brief Binary-coded decimal
+   *
+   * Every 4-bit nibble holds a single decimal digit, low byte first. Nibbles
+   * above 9 make the value invalid.
+   */
+  picoBCD
+};
+
+/**\brief Status fields
+ *
+ * The PIco's status registers that we know about, as indices into
+ * picoRegisters and struct picoStatus. To read another register, add it here
+ * and give it a row in picoRegisters; the snapshot, the metrics and the query
+ * socket pick it up from there.
+ */
+enum picoField {
+  /**\brief Firmware version
+   *
+   * These are typically written out in hexadecimal; some have a special
+   * meaning, see the PIco manual.
+   */
+  picoVersion,
+
+  /**\brief Power mode
+   *
+   * 1 when plugged in, 2 when on battery.
+   */
+  picoMode,
+
+  /**\brief Battery voltage
+   *
+   * In centi-volts. The battery has a nominal voltage of around 3.7 V, and a
+   * useful voltage down to about 3.5 V.
+   */
+  picoBattery,
+
+  /**\brief Host voltage
+   *
+   * The Raspberry Pi's 5V line, as seen by the PIco, in centi-volts.
+   */
+  picoHost,
+
+  /**\brief Built-in temperature sensor
+   *
+   * In degrees Celsius.
+   */
+  picoTemperature1,
+
+  /**\brief External temperature sensor
+   *
+   * In degrees Celsius; this one comes with the fan kit.
+   */
+  picoTemperature2,
+
+  /**\brief Fan mode
+   *
+   * The fan kit's mode: 0 when off, 1 when running at the fan speed, and 2 when
+   * the PIco switches it on by itself, above its own temperature threshold.
+   */
+  picoFanMode,
+
+  /**\brief Fan speed
+   *
+   * The fan kit's duty cycle in mode 1, in percent.
+   */
+  picoFanSpeed
+};
+
+/**\brief Number of status fields
+ *
+ * The number of values in enum picoField, and of rows in picoRegisters.
+ */
+#define PICO_FIELDS 8
+
+/**\brief Fan kit fields
+ *
+ * A mask of the fan kit's fields in enum picoField, for picoRead(). A PIco
+ * without the fan kit doesn't have sensible values there, so these are only
+ * read for the fan controller.
+ */
+#define PICO_FAN ((1UL << picoFanMode) | (1UL << picoFanSpeed))
+
+/**\brief All status fields
+ *
+ * A mask of the fields in enum picoField that a snapshot reads by default, for
+ * picoRead(): all of them except the fan kit's.
+ */
+#define PICO_ALL (((1UL << PICO_FIELDS) - 1) & ~PICO_FAN)
+
+/**\brief Register descriptor
+ *
+ * Where a status register lives on the bus, how to decode it, which values
+ * make sense, and what it's called in the metrics and queries.
+ */
+struct picoRegister {
+  /**\brief Query name
+   *
+   * What the register is called on the query socket, e.g. "battery".
+   */
+  const char *name;
+
+  /**\brief Metric name
+   *
+   * What the register is called in the Prometheus text format, with its unit,
+   * e.g. "pico_battery_centivolts".
+   */
+  const char *metric;
+
+  /**\brief Metric help
+   *
+   * The HELP text for the metric.
+   */
+  const char *help;
+
+  /**\brief I2C address
+   *
+   * The address the register is at, e.g. 0x69.
+   */
+  int addr;
+
+  /**\brief Register offset
+   *
+   * The first register at that address that holds the value.
+   */
+  int reg;
+
+  /**\brief Width
+   *
+   * The number of registers that hold the value: 1 or 2.
+   */
+  int width;
+
+  /**\brief Encoding
+   *
+   * How to decode the register's bytes.
+   */
+  enum picoEncoding encoding;
+
+  /**\brief Lowest valid value
+   *
+   * Decoded values below this are treated as bad reads.
+   */
+  long minimum;
+
+  /**\brief Highest valid value
+   *
+   * Decoded values above this are treated as bad reads.
+   */
+  long maximum;
+};
+
+/**\brief PIco status
+ *
+ * A decoded snapshot of the PIco's status registers, by enum picoField. Fields
+ * that could not be read are -1; those that were read but didn't decode to a
+ * valid value are -2.
+ */
+struct picoStatus {
+  /**\brief Values
+   *
+   * The decoded values, in the units of their registers.
+   */
+  long value[PICO_FIELDS];
+};
+
+extern const struct picoRegister picoRegisters[PICO_FIELDS];
+
+long getKey(struct i2c *i2c, int key);
+long resetKey(struct i2c *i2c, int key);
+int picoKeys(struct i2c *i2c, unsigned char keys[PICO_KEYS], char block);
+int picoResetKeys(struct i2c *i2c, const unsigned char reset[PICO_KEYS],
+                  char block);
+int picoRead(struct i2c *i2c, struct picoStatus *status, unsigned long mask,
+             char block);
+int picoSnapshot(struct i2c *i2c, struct picoStatus *status, char block);
+
+#endif
@@ -22,261 +22,115 @@
  * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
  */
 
-/* for open() */
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+/* for CPU_SET() */
+#define _GNU_SOURCE
 
-/* for usleep(), read(), write(), getopt(), daemon() */
+/* for getopt(), daemon() */
 #include <unistd.h>
 
-/* for snprintf() */
+/* for printf() */
 #include <stdio.h>
 
-/* for system() */
+/* for atoi() */
 #include <stdlib.h>
 
+/* for memset() */
+#include <string.h>
+
 /* for errno */
 #include <errno.h>
 
-/**\brief Maximum length of GPIO file name.
- *
- * This is the maximum length of a GPIO file that we're willing to support.
- */
-#define MAX_GPIO_FN 256
-
-/**\brief Internal buffer size.
- *
- * Size of internal buffers used throughout the code.
- */
-#define MAX_BUFFER 32
+/* for sched_setscheduler(), sched_setaffinity() */
+#include <sched.h>
 
-/**\brief Daemon version
- *
- * The version number of this daemon. Will be increased around release time.
- */
-static const int version = 3;
-
-/**\brief Maximum number of retries.
- *
- * Used during GPIO pin setup, to prevent random setup delays from causing
- * initialisation to fail.
- */
-static const int maxRetries = 8;
-
-/**\brief Export GPIO pin
- *
- * Linux's sysfs interface for GPIO pins requires setting up the pins that you
- * intend to use by first "exporting" them, which creates the pin's control
- * files in sysfs. This function tells the kernel to do so.
- *
- * \param[in] gpio The pin to export.
- *
- * \returns 0 on success, negative numbers on (partial) failures.
- */
-static int export(int gpio) {
-  int fd;
-  char bf[MAX_BUFFER];
-  int rv = 0;
-  int blen = 0;
-
-  blen = snprintf(bf, MAX_BUFFER, "%i", gpio);
-  if (blen < 0) {
-    return -1;
-  }
+/* for mlockall() */
+#include <sys/mman.h>
 
-  fd = open("/sys/class/gpio/export", O_WRONLY);
-  if (fd < 0) {
-    return -2;
-  }
+/* for GPIO pin handles */
+#include "gpio.h"
 
-  if (write(fd, bf, blen) < blen) {
-    rv = -3;
-  }
+/* for FSSD actions */
+#include "action.h"
 
-  do {
-    rv = close(fd);
-  } while ((rv < 0) && (errno == EINTR));
+/* for the pulse train and the FSSD signal */
+#include "heartbeat.h"
 
-  return rv;
-}
+/* for the event loop */
+#include "ups.h"
 
-/**\brief Set a GPIO pin's I/O direction.
- *
- * Set the I/O direction of a GPIO pin that has previously been exported.
- *
- * \param[in] gpio   The pin to set up.
- * \param[in] output Nonzero for output, 0 for input.
+/**\brief Daemon version
  *
- * \returns 0 on success, negative numbers on (partial) failures.
+ * The version number of this daemon. Will be increased around release time.
  */
-static int direction(int gpio, char output) {
-  int fd;
-  char fn[MAX_GPIO_FN];
-  int rv = 0;
-
-  if (snprintf(fn, MAX_GPIO_FN, "/sys/class/gpio/gpio%i/direction", gpio) < 0) {
-    return -1;
-  }
-
-  fd = open(fn, O_WRONLY);
-  if (fd < 0) {
-    return -2;
-  }
+static const int version = 4;
 
-  if (output) {
-    if (write(fd, "out\n", 4) < 4) {
-      rv = -3;
-    }
-  } else {
-    if (write(fd, "in\n", 3) < 3) {
-      rv = -3;
-    }
-  }
-
-  do {
-    rv = close(fd);
-  } while ((rv < 0) && (errno == EINTR));
-
-  return rv;
-}
-
-/**\brief Export GPIO pin and set I/O direction.
- *
- * Calls export() and then direction() to set up a GPIO pin.
- *
- * \param[in] gpio   The pin to set up.
- * \param[in] output Nonzero for output, 0 for input.
+/**\brief Pre-faulted stack size
  *
- * \returns 0 on success, negative numbers on (partial) failures.
+ * How much stack to touch before entering the main loop in real-time mode, so
+ * that none of the stack pages the loop needs have to be faulted in later.
  */
-static int setup(int gpio, char output) {
-  int rv = 0;
-  int retries = 0;
+#define PREFAULT_STACK (64 * 1024)
 
-  rv = export(gpio);
-  if (rv < 0) {
-    return rv;
-  }
-
-  do {
-    if (retries > 0) {
-      /* setting the pin IO direction may fail for a few milliseconds after
-       * exporting the pin, so retry this step a few times. Each time we try
-       * this, we wait a bit longer. */
-      usleep(retries * retries * 1000);
-    }
-    rv = direction(gpio, output);
-  } while ((rv < 0) && (retries++ < maxRetries));
-
-  if (rv < 0) {
-    return rv;
-  }
-
-  return 0;
-}
-
-/**\brief Set a GPIO pin's state
+/**\brief Switch to real-time scheduling.
  *
- * Pins can either be LOW or HIGH. This function sets a pin to the given target
- * state. The pin must previously have been set up as an output pin.
+ * Makes the daemon a SCHED_FIFO process at the given priority, so that it
+ * preempts ordinary processes as soon as one of its deadlines comes up, and
+ * optionally pins it to a single CPU.
  *
- * \param[in] gpio  The pin to set.
- * \param[in] state The state to set the pin to.
+ * \param[in] priority The SCHED_FIFO priority to use, 1 to 99.
+ * \param[in] cpu      The CPU to pin the daemon to, or -1 to not do that.
  *
- * \returns 0 on success, negative numbers on (partial) failures.
+ * \returns 0 on success, negative numbers on failure.
  */
-static int set(int gpio, char state) {
-  char fn[MAX_GPIO_FN];
-  int rv = 0;
+static int realtime(int priority, int cpu) {
+  struct sched_param param;
 
-  if (snprintf(fn, MAX_GPIO_FN, "/sys/class/gpio/gpio%i/value", gpio) < 0) {
-    return -1;
-  } else {
-    int fd = open(fn, O_WRONLY);
+  if (cpu >= 0) {
+    cpu_set_t cpus;
 
-    if (fd) {
-      (void)write(fd, state ? "1\n" : "0\n", 2);
-      /* we ignore the return value of that write because we use this in a loop
-         anyway, and it's quite unlikely to fail. */
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
 
-      do {
-        rv = close(fd);
-      } while ((rv < 0) && (errno == EINTR));
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+      return -1;
     }
   }
 
-  return rv;
-}
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
 
-/**\brief Get the value of a GPIO pin.
- *
- * Queries a GPIO pin's value. The pin must have been set up to be an input pin
- * beforehand.
- *
- * \param[in] gpio The pin to query.
- *
- * \returns 1 if the pin is HIGH, 0 if the pin is LOW, negative numbers on
- *          (partial) failures.
- */
-static int get(int gpio) {
-  char fn[MAX_GPIO_FN];
-  int rv = 0;
-
-  if (snprintf(fn, MAX_GPIO_FN, "/sys/class/gpio/gpio%i/value", gpio) < 0) {
-    return -1;
-  } else {
-    int fd = open(fn, O_RDONLY);
-
-    if (fd) {
-      char buf[MAX_BUFFER];
-      int r = read(fd, buf, MAX_BUFFER);
-
-      if (r < 1) {
-        rv = -2;
-      } else {
-        rv = (buf[0] == '1');
-      }
-
-      do {
-        r = close(fd);
-      } while ((r < 0) && (errno == EINTR));
-    }
+  if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+    return -2;
   }
 
-  return rv;
+  return 0;
 }
 
-/**\brief Create a pulse on a GPIO pin.
- *
- * This function creates a pulse on a GPIO pin that has previously been set up
- * to be an output pin. The pin will be set to HIGH for the given duration, then
- * set to LOW for the remainder of the period.
+/**\brief Lock the daemon into memory.
  *
- * \note The duration must be smaller than the period.
+ * Locks all of the daemon's current and future pages into RAM, and touches a
+ * good chunk of stack so those pages are there before the main loop needs
+ * them. This way, the pulse train can't be held up by page faults, even if the
+ * system is under memory pressure.
  *
- * \param[in] gpio     The pin to send the pulse to.
- * \param[in] period   The amount of time for the full pulse; in usec.
- * \param[in] duration The amount of time to set the pin to HIGH; in usec.
+ * \note Memory locks are not inherited by child processes, so this needs to be
+ *       done again after daemon().
  *
- * \returns 0 on success, negative numbers on (partial) failures.
+ * \returns 0 on success, negative numbers on failure.
  */
-static int pulse(int gpio, unsigned int period, unsigned int duration) {
-  if (set(gpio, 1) != 0) {
+static int lockMemory(void) {
+  char stack[PREFAULT_STACK];
+  volatile char *page = stack;
+  size_t i;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
     return -1;
   }
 
-  (void)usleep(duration);
-  /* we ignore usleep()'s return value, because the only error would be to be
-   * interrupted by a signal, which is OK as the PIco does not seem to be that
-   * particular about the exact shape of the pulse train. */
-
-  if (set(gpio, 0) != 0) {
-    return -2;
+  for (i = 0; i < PREFAULT_STACK; i += 256) {
+    page[i] = 0;
   }
 
-  (void)usleep(period - duration);
-
   return 0;
 }
 
@@ -286,19 +140,66 @@ static int pulse(int gpio, unsigned int period, unsigned int duration) {
  * which is what the PIco UPS requires for it to figure out that the Raspberry
  * Pi it's connected to is running.
  *
- * The only exit condition for the daemon is if pin #27 is set to LOW, which
- * will trigger what the hardware vendor dubbed a "File Safe Shut Down." I.e. a
- * good old "shutdown -h now."
+ * If pin #27 is set to LOW, this will trigger what the hardware vendor dubbed a
+ * "File Safe Shut Down." I.e. a good old "shutdown -h now", although that
+ * command is run directly rather than through a shell, and it can be replaced
+ * with signalling init. The shutdown is started in the background, and the
+ * pulse train is kept up while it does its thing, since the Pi is still running
+ * until the daemon is told to terminate.
  *
  * Because of this, and the whole thing about the GPIO pins, this daemon needs
  * to be run as root and can't drop privileges. If you were to set things up
  * such that the GPIO pin #22 is available to ordinary users, and you used -n to
  * disable the FSSD function, you could run it as non-root.
  *
- * * -n disables the FSSD test, if you don't care about this feature.
+ * * -c [chip] uses the GPIO character device interface on the given chip,
+ *   e.g. /dev/gpiochip0, instead of sysfs. Pin #22 is then requested once as
+ *   an output line, and pin #27 as an input line with edge detection.
+ * * -D [seconds] sets the deadline for all hooks together; any that are still
+ *   running that long after pin #27 went LOW are killed. The default is 30.
  * * -d launches the programme as a daemon. Pin setup is performed before the
  *   daemon() call, which allows error reporting for that.
+ * * -g [root] selects the sysfs GPIO root. The default is /sys/class/gpio;
+ *   any directory tree with the same layout will do, which is handy for
+ *   testing.
+ * * -H [dir] sets a hook directory. When pin #27 goes LOW, all executable
+ *   files in this directory are started at the same time, and the shutdown
+ *   only starts once they have all finished or been killed.
+ * * -k [pid] shuts down by sending SIGRTMIN+4 to the given process instead of
+ *   running a command. With systemd as PID 1, "-k 1" powers off the system.
+ * * -m enables the measurement mode: instead of shutting down, the daemon
+ *   prints how long it took to react to the FSSD signal's falling edge.
+ * * -n disables the FSSD test, if you don't care about this feature.
+ * * -p [cpu] pins the daemon to the given CPU in real-time mode.
+ * * -r [priority] enables the real-time mode: the daemon runs with the
+ *   SCHED_FIFO scheduling policy at the given priority, and is locked into
+ *   memory, so that its pulse train holds up under CPU and memory pressure.
+ * * -T [seconds] sets the timeout for each hook; hooks that run for longer
+ *   than this are killed. The default is 10.
+ * * -t [seconds] sets a deadline for the shutdown: if the daemon is still
+ *   running that long after the FSSD action was started, it syncs the file
+ *   systems and powers off the system with reboot(). The default is to not
+ *   do that.
  * * -v prints the version of the daemon and then exits.
+ * * -x [command] sets the command to run to shut down; the default is
+ *   "/sbin/shutdown -h now". The command is split into words at whitespace
+ *   and run without a shell, so the programme needs to be given with its
+ *   full path.
+ *
+ * Edge detection is armed on pin #27 if possible, so that a falling edge wakes
+ * the daemon up immediately, even in the middle of a pulse. The pin is also
+ * sampled once per pulse cycle, in case edges can't be detected or one was
+ * missed.
+ *
+ * Sending the daemon a SIGUSR1 makes it print its statistics to stdout, which
+ * includes the number of GPIO syscalls it needed for the last pulse cycle, and
+ * histograms of how long each GPIO access took and how long the daemon stayed
+ * awake each time it woke up. It prints them on SIGTERM and SIGINT as well,
+ * before exiting.
+ *
+ * The pulse train runs on the event loop in ups.c, which pico-upsd shares; with
+ * edge detection, the loop only wakes up for the pulse train's edges and the
+ * FSSD signal.
  *
  * \param[in] argc Argument count.
  * \param[in] argv Argument vecotr.
@@ -307,39 +208,131 @@ static int pulse(int gpio, unsigned int period, unsigned int duration) {
  */
 int main(int argc, char **argv) {
   char daemonise = 0;
-  char fssd = 1;
-  char initialPulse = 1;
-  char fssdWasHigh = 0;
-  int opt;
-
-  while ((opt = getopt(argc, argv, "dnv")) != -1) {
+  enum gpioBackend backend = gpioSysfs;
+  const char *root = GPIO_SYSFS_ROOT;
+  static struct heartbeat heartbeat;
+  static struct fssd fssd;
+  struct gpio *pins[2];
+  struct ups ups;
+  int priority = 0;
+  int cpu = -1;
+  int opt, rv;
+
+  memset(&fssd, 0, sizeof(fssd));
+  fssd.enabled = 1;
+  fssd.latency = -1;
+  fssd.action.strategy = actionSpawn;
+  (void)actionCommand(&fssd.action, ACTION_COMMAND);
+  fssd.action.hookTimeout = 10;
+  fssd.action.hookDeadline = 30;
+
+  while ((opt = getopt(argc, argv, "c:D:dg:H:k:mnp:r:T:t:vx:")) != -1) {
     switch (opt) {
+    case 'c':
+      backend = gpioChardev;
+      root = optarg;
+      break;
+    case 'D':
+      fssd.action.hookDeadline = atof(optarg);
+      break;
     case 'd':
       daemonise = 1;
       break;
+    case 'g':
+      backend = gpioSysfs;
+      root = optarg;
+      break;
+    case 'H':
+      fssd.action.hooks = optarg;
+      break;
+    case 'k':
+      fssd.action.strategy = actionSignal;
+      fssd.action.init = atoi(optarg);
+      break;
+    case 'm':
+      fssd.measure = 1;
+      break;
     case 'n':
-      fssd = 0;
+      fssd.enabled = 0;
+      break;
+    case 'p':
+      cpu = atoi(optarg);
+      break;
+    case 'r':
+      priority = atoi(optarg);
+      break;
+    case 'T':
+      fssd.action.hookTimeout = atof(optarg);
+      break;
+    case 't':
+      fssd.action.deadline = atof(optarg);
       break;
     case 'v':
       printf("picod/%i\n", version);
       return 0;
+    case 'x':
+      fssd.action.strategy = actionSpawn;
+      if (actionCommand(&fssd.action, optarg) != 0) {
+        printf("Invalid shutdown command: '%s'.\n", optarg);
+        return -3;
+      }
+      break;
     default:
-      printf("Usage: %s [-d] [-n] [-v]\n", argv[0]);
+      printf("Usage: %s [-c <chip>] [-D <seconds>] [-d] [-g <root>] [-H <dir>] "
+             "[-k <pid>] [-m] [-n] [-p <cpu>] [-r <priority>] [-T <seconds>] "
+             "[-t <seconds>] [-v] [-x <command>]\n",
+             argv[0]);
       return -3;
     }
   }
 
-  if (setup(22, 1) != 0) {
+  pins[0] = &heartbeat.pin;
+  pins[1] = &fssd.pin;
+
+  if (gpioRequest(&heartbeat.pin, backend, root, 22, 1) != 0) {
     printf("Could not set up pin #22 as an output pin for the pulse train.\n");
 
     return -1;
   }
 
-  if (fssd == 1) {
-    if (setup(27, 0) != 0) {
-      printf("Could not set up pin #27 as input for the FSSD feature.\n");
+  if ((fssd.enabled == 1) &&
+      (gpioRequest(&fssd.pin, backend, root, 27, 0) != 0)) {
+    printf("Could not set up pin #27 as input for the FSSD feature.\n");
 
-      return -4;
+    return -4;
+  }
+
+  if (gpioReady(pins, fssd.enabled == 1 ? 2 : 1) != 0) {
+    if (heartbeat.pin.fd < 0) {
+      printf("Could not set up pin #22 as an output pin for the pulse "
+             "train.\n");
+
+      return -1;
+    }
+
+    printf("Could not set up pin #27 as input for the FSSD feature.\n");
+
+    return -4;
+  }
+  /* both pins are exported first, and then waited for together. */
+
+  if (fssd.enabled == 1) {
+    if (gpioEdge(&fssd.pin) != 0) {
+      printf("Could not arm edge detection on pin #27; sampling it instead.\n");
+    }
+  }
+
+  if (priority > 0) {
+    if (realtime(priority, cpu) != 0) {
+      printf("Could not switch to real-time scheduling; ERRNO=%d.\n", errno);
+
+      return -5;
+    }
+
+    if (lockMemory() != 0) {
+      printf("Could not lock the daemon into memory; ERRNO=%d.\n", errno);
+
+      return -6;
     }
   }
 
@@ -349,48 +342,34 @@ int main(int argc, char **argv) {
 
       return -2;
     }
-  }
 
-  /* create a pulse train with the same modulation as the PIco's FSSD script. */
-  while (1) {
-    int fssdSignal = (fssd == 1) ? get(27) : 1;
-    /* if processing the FSSD signal is disabled, assume it's HIGH so as not to
-     * trigger a shutdown, ever. */
-
-    fssdWasHigh = (fssdSignal == 1) ? 1 : fssdWasHigh;
-    /* keep track of whether we've ever seen the FSSD signal in a HIGH state; if
-     * we haven't, then we assume the PIco has not been installed. */
-
-    if ((initialPulse == 1) || (fssdWasHigh == 1)) {
-      /* only send the pulse train if the FSSD signal scanned HIGH recently;
-       * this means that the pulse train is not sent if shutdown has been
-       * initiated due to a low battery state, or if the PIco has not been
-       * installed. */
-
-      (void)pulse(22, 500000, 250000);
-      /* note how we don't use the return value here, because we'd really just
-       * send another pulse. */
-
-      initialPulse = 0;
-      /* we send one initial pulse at boot up, just in case the PIco firmware
-       * would only set pin #27 to HIGH upon receiving the initial pulse; not
-       * sure if this is needed, but it shouldn't hurt, either. */
+    if (priority > 0) {
+      (void)lockMemory();
+      /* the scheduling policy and CPU affinity carry over to the daemon
+       * process, but its memory locks don't. This worked before the fork, so
+       * it should work again now. */
     }
+  }
+
+  if (upsOpen(&ups, "picod") < 0) {
+    printf("Could not set up the event loop; ERRNO=%d.\n", errno);
 
-    if ((fssdWasHigh == 1) && (fssdSignal == 0)) {
-      /* we ignore the error condition on the get() because the only thing to do
-       * in that case is to re-issue that, and we'll do that in 500ms. */
+    return -7;
+  }
 
-      (void)system("shutdown -h now");
-      /* there's nothing else to do here - regardless of whether the call fails.
-       * so we bail after this. */
+  ups.heartbeat = &heartbeat;
+  ups.fssd = &fssd;
 
-      fssdWasHigh = 0;
-      /* reset the FSSD HIGH sensing; the daemon will keep running and reinstate
-       * the pulse train if power is restored, though we can't cancel the
-       * shutdown so something external would have to do that. */
-    }
+  rv = upsRun(&ups);
+  if (rv < 0) {
+    printf("Event loop failed; ERRNO=%d.\n", errno);
   }
 
-  return 0;
+  (void)upsClose(&ups);
+  (void)gpioClose(&heartbeat.pin);
+  if (fssd.enabled == 1) {
+    (void)gpioClose(&fssd.pin);
+  }
+
+  return rv;
 }
@@ -0,0 +1,483 @@
+/**\file
+ * \brief Query socket.
+ *
+ * Implements the query socket declared in query.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#define _GNU_SOURCE
+
+#include "query.h"
+
+/* for socket(), bind(), listen(), accept4(), send(), recv() */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* for struct sockaddr_un */
+#include <sys/un.h>
+
+/* for chmod() */
+#include <sys/stat.h>
+
+/* for epoll_ctl() */
+#include <sys/epoll.h>
+
+/* for close(), unlink() */
+#include <unistd.h>
+
+/* for vsnprintf() */
+#include <stdio.h>
+
+/* for va_list */
+#include <stdarg.h>
+
+/* for strcmp(), strlen(), strcpy() */
+#include <string.h>
+
+/* for errno */
+#include <errno.h>
+
+/**\brief Open the query socket
+ *
+ * Creates a Unix domain socket at the given path, replacing whatever was there
+ * before, and adds it to the given epoll instance. Anyone can connect to the
+ * socket, as it only ever hands out the PIco's status.
+ *
+ * \param[out] query  The query state to initialise.
+ * \param[in]  path   Where to create the socket.
+ * \param[in]  epoll  The epoll instance to add the socket and its clients to.
+ * \param[in]  window The freshness window, in microseconds.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int queryOpen(struct query *query, const char *path, int epoll,
+              unsigned int window) {
+  struct sockaddr_un address;
+  struct epoll_event event;
+  int i;
+
+  query->fd = -1;
+  query->epoll = epoll;
+  query->path = path;
+  query->window = window;
+  query->queries = 0;
+  query->reads = 0;
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    query->client[i].fd = -1;
+  }
+  for (i = 0; i < QUERY_FIELDS; i++) {
+    query->value[i] = -1;
+    query->read[i].tv_sec = 0;
+    query->read[i].tv_nsec = 0;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  query->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (query->fd < 0) {
+    return -2;
+  }
+
+  (void)unlink(path);
+  /* clear out the socket of a previous run, if there is one. */
+
+  if ((bind(query->fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+      (chmod(path, 0666) < 0) || (listen(query->fd, 64) < 0)) {
+    (void)close(query->fd);
+    query->fd = -1;
+    return -3;
+  }
+
+  event.events = EPOLLIN;
+  event.data.fd = query->fd;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, query->fd, &event) < 0) {
+    (void)queryClose(query);
+    return -4;
+  }
+
+  return 0;
+}
+
+/**\brief Disconnect a client.
+ *
+ * \param[in,out] query  The query state.
+ * \param[in,out] client The client to disconnect.
+ */
+static void disconnect(struct query *query, struct queryClient *client) {
+  (void)epoll_ctl(query->epoll, EPOLL_CTL_DEL, client->fd, 0);
+  (void)close(client->fd);
+  client->fd = -1;
+}
+
+/**\brief Accept a client
+ *
+ * Accepts a connection on the listening socket, and adds it to the epoll
+ * instance. Call this when the listening socket is readable.
+ *
+ * \param[in,out] query The query state.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int queryAccept(struct query *query) {
+  struct epoll_event event;
+  int fd, i;
+
+  fd = accept4(query->fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    if (query->client[i].fd < 0) {
+      break;
+    }
+  }
+
+  if (i == QUERY_MAX_CLIENTS) {
+    (void)close(fd);
+    return -2;
+    /* we're full. */
+  }
+
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(query->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+    (void)close(fd);
+    return -3;
+  }
+
+  query->client[i].fd = fd;
+  query->client[i].length = 0;
+  query->client[i].queries = 0;
+
+  return 0;
+}
+
+/**\brief Parse a query.
+ *
+ * \param[in] line A query line, without the line break.
+ *
+ * \returns The enum queryField mask for the query; 0 if it isn't valid.
+ */
+static int parse(const char *line) {
+  int i;
+
+  if (strcmp(line, "status") == 0) {
+    return queryStatus;
+  }
+  if (strcmp(line, "statistics") == 0) {
+    return queryStatistics;
+  }
+
+  for (i = 0; i < QUERY_FIELDS; i++) {
+    if (strcmp(line, picoRegisters[i].name) == 0) {
+      return 1 << i;
+    }
+  }
+
+  return 0;
+}
+
+/**\brief Receive queries
+ *
+ * Reads whatever a client has sent, and queues up any complete queries for
+ * the next queryAnswer(). Call this when a client socket is readable.
+ *
+ * \param[in,out] query The query state.
+ * \param[in]     fd    The readable client socket.
+ *
+ * \returns 0 on success, -1 if the file descriptor isn't one of our clients,
+ *          other negative values if the client had to be disconnected.
+ */
+int queryReceive(struct query *query, int fd) {
+  struct queryClient *client = 0;
+  char buffer[256];
+  ssize_t length;
+  int i;
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    if (query->client[i].fd == fd) {
+      client = &query->client[i];
+      break;
+    }
+  }
+
+  if (client == 0) {
+    return -1;
+  }
+
+  if (client->queries == QUERY_MAX_PENDING) {
+    return 0;
+    /* leave the rest in the socket until we've caught up. */
+  }
+
+  length = recv(fd, buffer, sizeof(buffer), 0);
+  if ((length < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+    return 0;
+  }
+  if (length <= 0) {
+    disconnect(query, client);
+    return -2;
+  }
+
+  for (i = 0; i < length; i++) {
+    if ((buffer[i] == '\n') || (buffer[i] == '\r')) {
+      if (client->length == 0) {
+        continue;
+        /* empty line, or the second half of a CRLF. */
+      }
+
+      client->line[client->length] = 0;
+      client->length = 0;
+
+      if (client->queries < QUERY_MAX_PENDING) {
+        client->pending[client->queries++] = parse(client->line);
+      }
+    } else if (client->length < QUERY_MAX_LINE - 1) {
+      client->line[client->length++] = buffer[i];
+    } else {
+      disconnect(query, client);
+      return -3;
+      /* nobody needs queries this long. */
+    }
+  }
+
+  return 0;
+}
+
+/**\brief Seconds since a point in time.
+ *
+ * \param[in] now  The current CLOCK_MONOTONIC time.
+ * \param[in] then A CLOCK_MONOTONIC time in the past.
+ *
+ * \returns The number of seconds from 'then' to 'now'.
+ */
+static double elapsed(const struct timespec *now, const struct timespec *then) {
+  return (double)(now->tv_sec - then->tv_sec) +
+         (double)(now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Refresh stale values.
+ *
+ * Reads the registers in the given mask that are older than the freshness
+ * window, all together, in as few bus transactions as picoRead() can plan for
+ * them.
+ *
+ * \param[in,out] query The query state.
+ * \param[out]    i2c   The I2C state struct.
+ * \param[in]     block Nonzero to use block reads if possible.
+ * \param[in]     mask  The registers that have been asked for.
+ */
+static void refresh(struct query *query, struct i2c *i2c, char block,
+                    int mask) {
+  struct picoStatus status;
+  struct timespec now;
+  int stale = 0, i;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (i = 0; i < QUERY_FIELDS; i++) {
+    if ((mask & (1 << i)) &&
+        ((query->read[i].tv_sec == 0) ||
+         (elapsed(&now, &query->read[i]) >= query->window / 1e6))) {
+      stale |= 1 << i;
+    }
+  }
+
+  if (stale == 0) {
+    return;
+  }
+
+  (void)picoRead(i2c, &status, stale, block);
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  query->reads++;
+
+  for (i = 0; i < QUERY_FIELDS; i++) {
+    if (stale & (1 << i)) {
+      query->value[i] = status.value[i];
+      if (status.value[i] >= 0) {
+        query->read[i] = now;
+      }
+      /* failed reads aren't cached, so the next query tries again. */
+    }
+  }
+}
+
+/**\brief Append to a response.
+ *
+ * Formats text onto the end of a response buffer. If it doesn't fit, the
+ * length ends up past the end of the buffer, which the caller has to check
+ * for.
+ *
+ * \param[out]    response The response buffer.
+ * \param[in]     size     The size of the response buffer.
+ * \param[in,out] length   The length of the response so far.
+ * \param[in]     format   A printf() format string, and its arguments.
+ */
+static void append(char *response, size_t size, size_t *length,
+                   const char *format, ...) {
+  va_list ap;
+  int n;
+
+  if (*length >= size) {
+    return;
+  }
+
+  va_start(ap, format);
+  n = vsnprintf(response + *length, size - *length, format, ap);
+  va_end(ap);
+
+  *length += n < 0 ? size : n;
+}
+
+/**\brief Answer queries
+ *
+ * Reads all the registers that the clients' pending queries need and that are
+ * older than the freshness window - each of them at most once - and then
+ * answers all the pending queries. Call this after all readable client sockets
+ * have been handed to queryReceive().
+ *
+ * \param[in,out] query The query state.
+ * \param[out]    i2c   The I2C state struct.
+ * \param[in]     block Nonzero to use block reads if possible.
+ *
+ * \returns The number of queries that were answered.
+ */
+int queryAnswer(struct query *query, struct i2c *i2c, char block) {
+  int mask = 0, answered = 0, i, j, k;
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    if (query->client[i].fd >= 0) {
+      for (j = 0; j < query->client[i].queries; j++) {
+        mask |= query->client[i].pending[j];
+      }
+    }
+  }
+
+  if (mask == 0) {
+    return 0;
+  }
+
+  refresh(query, i2c, block, mask & ((1 << QUERY_FIELDS) - 1));
+  /* every register that was asked for, including those that 'status' leaves
+     out, but none of the bits that don't need reads. */
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    struct queryClient *client = &query->client[i];
+    char response[4096];
+    size_t length = 0;
+
+    if ((client->fd < 0) || (client->queries == 0)) {
+      continue;
+    }
+
+    for (j = 0; j < client->queries; j++) {
+      int pending = client->pending[j];
+
+      query->queries++;
+      answered++;
+
+      if (pending == 0) {
+        append(response, sizeof(response), &length, "# unknown query\n");
+      }
+      for (k = 0; k < QUERY_FIELDS; k++) {
+        if (pending & (1 << k)) {
+          append(response, sizeof(response), &length, "%s %ld\n",
+                 picoRegisters[k].metric, query->value[k]);
+        }
+      }
+      if (pending & queryStatistics) {
+        int clients = 0;
+        for (k = 0; k < QUERY_MAX_CLIENTS; k++) {
+          clients += query->client[k].fd >= 0;
+        }
+        append(response, sizeof(response), &length,
+               "pico_i2c_transactions_total %lu\n"
+               "pico_i2c_errors_total %lu\n"
+               "pico_query_requests_total %lu\n"
+               "pico_query_reads_total %lu\n"
+               "pico_query_clients %d\n",
+               i2c->transactions, i2c->errors, query->queries, query->reads,
+               clients);
+      }
+      append(response, sizeof(response), &length, "\n");
+    }
+
+    client->queries = 0;
+
+    if ((length >= sizeof(response)) ||
+        (send(client->fd, response, length, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+         (ssize_t)length)) {
+      disconnect(query, client);
+      /* the client isn't keeping up with its answers. */
+    }
+  }
+
+  return answered;
+}
+
+/**\brief Update cached values
+ *
+ * Replaces the cached values with those of a snapshot, e.g. one that was read
+ * for the metrics. Registers that couldn't be read are stored, so they're
+ * reported as errors, but not marked as fresh, so the next query tries again.
+ *
+ * \param[in,out] query  The query state.
+ * \param[in]     status The snapshot.
+ * \param[in]     fields The enum picoField bits of the registers in the
+ *                       snapshot; the others are left alone.
+ * \param[in]     when   The CLOCK_MONOTONIC time the snapshot was read at.
+ */
+void queryUpdate(struct query *query, const struct picoStatus *status,
+                 unsigned long fields, const struct timespec *when) {
+  int i;
+
+  for (i = 0; i < QUERY_FIELDS; i++) {
+    if (!(fields & (1UL << i))) {
+      continue;
+    }
+    query->value[i] = status->value[i];
+    if (status->value[i] >= 0) {
+      query->read[i] = *when;
+    }
+  }
+}
+
+/**\brief Close the query socket
+ *
+ * Disconnects all clients, and removes the socket.
+ *
+ * \param[in,out] query The query state.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int queryClose(struct query *query) {
+  int i;
+
+  for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+    if (query->client[i].fd >= 0) {
+      disconnect(query, &query->client[i]);
+    }
+  }
+
+  if (query->fd >= 0) {
+    (void)close(query->fd);
+    query->fd = -1;
+    return unlink(query->path);
+  }
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+/**\file
+ * \brief Query socket.
+ *
+ * A Unix domain socket that local programmes can ask for a fresh reading of
+ * the PIco's status, e.g. the battery voltage right before doing something
+ * risky. Queries are line based: a client sends the name of a register, or
+ * 'status' for all of them, and gets back the values in the same format as
+ * 'pico-i2cd -s', followed by an empty line.
+ *
+ * Every value is cached, along with when it was read. Queries for values that
+ * were read within the freshness window are answered from the cache, and all
+ * the queries that arrive together are collected before reading anything, so
+ * that each register is read at most once for all of them. However many
+ * clients there are, the bus never sees more than one read per register per
+ * freshness window.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_QUERY_H)
+#define PICO_QUERY_H
+
+/* for size_t */
+#include <stddef.h>
+
+/* for struct timespec */
+#include <time.h>
+
+#include "pico.h"
+
+/**\brief Maximum number of clients
+ *
+ * The most clients that can be connected at the same time; any more are
+ * turned away.
+ */
+#define QUERY_MAX_CLIENTS 256
+
+/**\brief Maximum query length
+ *
+ * The longest query line we accept.
+ */
+#define QUERY_MAX_LINE 64
+
+/**\brief Maximum pending queries
+ *
+ * The most queries a client can have outstanding; we stop reading from it
+ * until they've been answered.
+ */
+#define QUERY_MAX_PENDING 16
+
+/**\brief Queryable values
+ *
+ * The values that can be queried, as bits in a mask. The first QUERY_FIELDS
+ * bits are registers, one per enum picoField, in the same order as the cached
+ * values; they're queried by their names in picoRegisters.
+ */
+enum queryField {
+  /**\brief All registers
+   *
+   * The same as 'pico-i2cd -s', without any statistics. The fan kit's
+   * registers aren't included; query them by name.
+   */
+  queryStatus = PICO_ALL,
+
+  /**\brief Statistics
+   *
+   * Bus and query statistics, which don't need any reads.
+   */
+  queryStatistics = 1 << PICO_FIELDS
+};
+
+/**\brief Number of queryable registers
+ *
+ * The number of register values in enum queryField.
+ */
+#define QUERY_FIELDS PICO_FIELDS
+
+/**\brief Query client
+ *
+ * A connected client, and what it has asked for so far.
+ */
+struct queryClient {
+  /**\brief Client socket
+   *
+   * The client's file descriptor, or -1 if this slot is free.
+   */
+  int fd;
+
+  /**\brief Input buffer
+   *
+   * The start of a query line that hasn't been completed yet.
+   */
+  char line[QUERY_MAX_LINE];
+
+  /**\brief Input length
+   *
+   * The number of bytes in the input buffer.
+   */
+  size_t length;
+
+  /**\brief Pending queries
+   *
+   * The queries the client has sent that haven't been answered yet, in the
+   * order they came in.
+   */
+  int pending[QUERY_MAX_PENDING];
+
+  /**\brief Number of pending queries
+   *
+   * The number of entries in the pending array.
+   */
+  int queries;
+};
+
+/**\brief Query socket state
+ *
+ * The listening socket, its clients, and the cached values.
+ */
+struct query {
+  /**\brief Listening socket
+   *
+   * The file descriptor of the listening socket, or -1 if it isn't open.
+   */
+  int fd;
+
+  /**\brief epoll instance
+   *
+   * The epoll file descriptor that client sockets are added to, so they can be
+   * waited on along with everything else.
+   */
+  int epoll;
+
+  /**\brief Socket path
+   *
+   * Where the socket lives in the file system.
+   */
+  const char *path;
+
+  /**\brief Freshness window
+   *
+   * Microseconds that a cached value is good for.
+   */
+  unsigned int window;
+
+  /**\brief Clients
+   *
+   * The connected clients.
+   */
+  struct queryClient client[QUERY_MAX_CLIENTS];
+
+  /**\brief Cached values
+   *
+   * The last values read for each field, in the order of enum queryField.
+   */
+  long value[QUERY_FIELDS];
+
+  /**\brief Read times
+   *
+   * The CLOCK_MONOTONIC time each value was read at; 0 if it hasn't been.
+   */
+  struct timespec read[QUERY_FIELDS];
+
+  /**\brief Queries
+   *
+   * The number of queries answered so far.
+   */
+  unsigned long queries;
+
+  /**\brief Register reads
+   *
+   * The number of times stale values had to be read from the bus; values that
+   * were read together count once.
+   */
+  unsigned long reads;
+};
+
+int queryOpen(struct query *query, const char *path, int epoll,
+              unsigned int window);
+int queryAccept(struct query *query);
+int queryReceive(struct query *query, int fd);
+int queryAnswer(struct query *query, struct i2c *i2c, char block);
+void queryUpdate(struct query *query, const struct picoStatus *status,
+                 unsigned long fields, const struct timespec *when);
+int queryClose(struct query *query);
+
+#endif
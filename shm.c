@@ -0,0 +1,240 @@
+/**\file
+ * \brief Shared memory status.
+ *
+ * Implements the shared memory segment declared in shm.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "shm.h"
+
+/* for shm_open(), shm_unlink(), mmap(), munmap() */
+#include <sys/mman.h>
+
+/* for fstat() */
+#include <sys/stat.h>
+
+/* for O_* constants */
+#include <fcntl.h>
+
+/* for ftruncate(), close() */
+#include <unistd.h>
+
+/* for sched_yield() */
+#include <sched.h>
+
+/**\brief Maximum read attempts
+ *
+ * How often shmRead() retries before giving up. The writer only ever holds the
+ * sequence odd for a few stores, so running out of attempts means it died in
+ * the middle of an update.
+ */
+#define MAX_ATTEMPTS 100000
+
+/**\brief Spins before yielding
+ *
+ * How often shmRead() retries right away before it starts yielding the CPU
+ * between attempts. The writer may have been preempted in the middle of an
+ * update, and on a single CPU it can't finish while we're spinning.
+ */
+#define SPINS 64
+
+/**\brief Map a segment.
+ *
+ * \param[out] shm    The handle to map the segment into.
+ * \param[in]  fd     The segment's file descriptor.
+ * \param[in]  writer Nonzero to map the segment for writing.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+static int map(struct shm *shm, int fd, char writer) {
+  void *segment = mmap(0, sizeof(struct shmSegment),
+                       writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                       fd, 0);
+
+  (void)close(fd);
+  /* the mapping stays valid without the file descriptor. */
+
+  if (segment == MAP_FAILED) {
+    return -1;
+  }
+
+  shm->segment = segment;
+  return 0;
+}
+
+/**\brief Create a segment
+ *
+ * Creates the named segment, or opens it if it's already there, e.g. from a
+ * previous run, and maps it for writing. Everyone can read the segment, but
+ * only its owner can write to it.
+ *
+ * \param[out] shm  The handle to initialise.
+ * \param[in]  name The segment name, e.g. SHM_NAME.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int shmCreate(struct shm *shm, const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  shm->segment = 0;
+  shm->name = name;
+  shm->writer = 1;
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(struct shmSegment)) < 0) {
+    (void)close(fd);
+    return -2;
+  }
+
+  if (map(shm, fd, 1) < 0) {
+    return -3;
+  }
+
+  if (shm->segment->sequence & 1) {
+    shm->segment->sequence++;
+    /* a previous writer died in the middle of an update; we're the only
+       writer now, so the segment isn't being updated anymore. */
+  }
+
+  shm->segment->layout = SHM_LAYOUT;
+  __atomic_store_n(&shm->segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/**\brief Open a segment
+ *
+ * Opens the named segment, which must have been created by pico-i2cd already,
+ * and maps it for reading.
+ *
+ * \param[out] shm  The handle to initialise.
+ * \param[in]  name The segment name, e.g. SHM_NAME.
+ *
+ * \returns 0 on success, negative values otherwise; -4 if the segment isn't
+ *          set up or has a different layout.
+ */
+int shmOpen(struct shm *shm, const char *name) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  struct stat st;
+
+  shm->segment = 0;
+  shm->name = name;
+  shm->writer = 0;
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(struct shmSegment))) {
+    (void)close(fd);
+    return -2;
+  }
+
+  if (map(shm, fd, 0) < 0) {
+    return -3;
+  }
+
+  if ((__atomic_load_n(&shm->segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) ||
+      (shm->segment->layout != SHM_LAYOUT)) {
+    (void)shmClose(shm);
+    return -4;
+  }
+
+  return 0;
+}
+
+/**\brief Publish a status
+ *
+ * Updates the status in the segment. This never blocks, no matter how many
+ * readers there are.
+ *
+ * \param[in,out] shm    The writer's handle.
+ * \param[in]     status The status to publish.
+ */
+void shmWrite(struct shm *shm, const struct shmStatus *status) {
+  struct shmSegment *segment = shm->segment;
+  uint32_t sequence = segment->sequence;
+  uint32_t updates = segment->status.updates;
+
+  __atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  /* readers have to see the odd sequence number before any of the new status,
+   * so they know to retry. */
+
+  segment->status = *status;
+  segment->status.updates = updates + 1;
+
+  __atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**\brief Read the status
+ *
+ * Copies a consistent snapshot of the status out of the segment, retrying if
+ * the writer was updating it at the same time. This doesn't take any syscalls,
+ * unless the writer takes a while to finish its update.
+ *
+ * \param[in]  shm    A reader's or the writer's handle.
+ * \param[out] status Where to copy the status to.
+ *
+ * \returns The number of retries it took, or negative values if the writer
+ *          seems to have died while updating the status.
+ */
+int shmRead(const struct shm *shm, struct shmStatus *status) {
+  const struct shmSegment *segment = shm->segment;
+  int attempt;
+
+  for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    uint32_t before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+
+    if ((before & 1) == 0) {
+      *status = segment->status;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      /* all of the status has to be read before checking the sequence number
+       * again. */
+
+      if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == before) {
+        return attempt;
+      }
+    }
+
+    if (attempt >= SPINS) {
+      (void)sched_yield();
+    }
+  }
+
+  return -1;
+}
+
+/**\brief Close a segment
+ *
+ * Unmaps the segment. If this is the writer's handle, the segment is removed as
+ * well; readers that still have it mapped keep the last status.
+ *
+ * \param[in,out] shm The handle to close.
+ *
+ * \returns 0 on success, negative values otherwise.
+ */
+int shmClose(struct shm *shm) {
+  int rv = 0;
+
+  if (shm->segment != 0) {
+    rv = munmap(shm->segment, sizeof(struct shmSegment));
+    shm->segment = 0;
+
+    if (shm->writer && (shm_unlink(shm->name) < 0)) {
+      rv = -1;
+    }
+  }
+
+  return rv;
+}
@@ -0,0 +1,177 @@
+/**\file
+ * \brief Shared memory status.
+ *
+ * pico-i2cd can publish the PIco's decoded status in a small shared memory
+ * segment with a fixed layout, so that any number of local programmes can read
+ * it without talking to the bus, or to pico-i2cd, at all.
+ *
+ * The segment is protected by a sequence lock: the writer makes the sequence
+ * number odd while it updates the status, and even again when it's done.
+ * Readers copy the status and retry if the sequence number was odd or changed
+ * in the meantime. That way readers never block the writer, and once the
+ * segment is mapped, reading it takes no syscalls.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_SHM_H)
+#define PICO_SHM_H
+
+/* for int32_t, uint32_t, int64_t */
+#include <stdint.h>
+
+/**\brief Default segment name
+ *
+ * The name of the shared memory segment, as passed to shm_open(). On Linux,
+ * this shows up as /dev/shm/pico.
+ */
+#define SHM_NAME "/pico"
+
+/**\brief Segment magic number
+ *
+ * Identifies a segment as ours; "PIco" in ASCII.
+ */
+#define SHM_MAGIC 0x6f434950
+
+/**\brief Segment layout version
+ *
+ * Increased whenever the layout of struct shmSegment changes.
+ */
+#define SHM_LAYOUT 1
+
+/**\brief Number of keys
+ *
+ * The number of key states in the segment; the same as PICO_KEYS.
+ */
+#define SHM_KEYS 3
+
+/**\brief Shared status
+ *
+ * The PIco's status, as published in the segment. Fields that couldn't be read
+ * are negative, just like in struct picoStatus.
+ */
+struct shmStatus {
+  /**\brief Firmware version
+   *
+   * See picoVersion.
+   */
+  int32_t version;
+
+  /**\brief Power mode
+   *
+   * 1 when plugged in, 2 when on battery; see picoMode.
+   */
+  int32_t mode;
+
+  /**\brief Battery voltage
+   *
+   * In centi-volts; see picoBattery.
+   */
+  int32_t battery;
+
+  /**\brief Host voltage
+   *
+   * In centi-volts; see picoHost.
+   */
+  int32_t host;
+
+  /**\brief Temperatures
+   *
+   * In degrees Celsius, for the built-in and the external sensor; see
+   * picoTemperature1 and picoTemperature2.
+   */
+  int32_t temperature[2];
+
+  /**\brief Key states
+   *
+   * 0 while a key is up, 1 while it is down, 2 once it has been held down for a
+   * long press; for KEY_A, KEY_B and KEY_F.
+   */
+  int32_t keys[SHM_KEYS];
+
+  /**\brief Sample time
+   *
+   * The CLOCK_REALTIME time the status registers were read at; seconds.
+   */
+  int64_t seconds;
+
+  /**\brief Sample time, nanoseconds
+   *
+   * The CLOCK_REALTIME time the status registers were read at; nanoseconds.
+   */
+  int32_t nanoseconds;
+
+  /**\brief Updates
+   *
+   * The number of times the status was published since the segment was
+   * created.
+   */
+  uint32_t updates;
+};
+
+/**\brief Shared segment
+ *
+ * The layout of the shared memory segment.
+ */
+struct shmSegment {
+  /**\brief Magic number
+   *
+   * SHM_MAGIC once the segment has been set up.
+   */
+  uint32_t magic;
+
+  /**\brief Layout version
+   *
+   * SHM_LAYOUT, for the layout the writer uses.
+   */
+  uint32_t layout;
+
+  /**\brief Sequence number
+   *
+   * Odd while the writer is updating the status, even otherwise.
+   */
+  volatile uint32_t sequence;
+
+  /**\brief Status
+   *
+   * The last status that was published.
+   */
+  struct shmStatus status;
+};
+
+/**\brief Shared memory handle
+ *
+ * A mapping of the segment, for reading or writing.
+ */
+struct shm {
+  /**\brief Segment
+   *
+   * The mapped segment, or NULL if it isn't mapped.
+   */
+  struct shmSegment *segment;
+
+  /**\brief Segment name
+   *
+   * The name the segment was opened with, so the writer can remove it again.
+   */
+  const char *name;
+
+  /**\brief Writer
+   *
+   * Nonzero if this is the writer's mapping, 0 for readers.
+   */
+  char writer;
+};
+
+int shmCreate(struct shm *shm, const char *name);
+int shmOpen(struct shm *shm, const char *name);
+void shmWrite(struct shm *shm, const struct shmStatus *status);
+int shmRead(const struct shm *shm, struct shmStatus *status);
+int shmClose(struct shm *shm);
+
+#endif
@@ -0,0 +1,650 @@
+/**\file
+ * \brief PIco event loop.
+ *
+ * Implements the event loop declared in ups.h.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Documentation: https://ef.gy/documentation/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#include "ups.h"
+
+/* for read(), close() */
+#include <unistd.h>
+
+/* for printf() */
+#include <stdio.h>
+
+/* for errno */
+#include <errno.h>
+
+/* for memcmp(), memcpy(), memset() */
+#include <string.h>
+
+/* for uint64_t */
+#include <stdint.h>
+
+/* for sigprocmask() */
+#include <signal.h>
+
+/* for POLLPRI */
+#include <poll.h>
+
+/* for epoll_create1(), epoll_ctl(), epoll_wait() */
+#include <sys/epoll.h>
+
+/* for signalfd() */
+#include <sys/signalfd.h>
+
+/* for timerfd_create(), timerfd_settime() */
+#include <sys/timerfd.h>
+
+/**\brief Add microseconds to a point in time.
+ *
+ * \param[in,out] t    The time to advance.
+ * \param[in]     usec The number of microseconds to add.
+ */
+static void advance(struct timespec *t, unsigned int usec) {
+  t->tv_sec += usec / 1000000;
+  t->tv_nsec += (long)(usec % 1000000) * 1000;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+/**\brief Time since a point in time.
+ *
+ * \param[in] then A CLOCK_MONOTONIC time.
+ *
+ * \returns The number of seconds since 'then'; negative if it's in the future.
+ */
+static double since(const struct timespec *then) {
+  struct timespec now;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - then->tv_sec) +
+         (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**\brief Check whether scheduled work is due.
+ *
+ * \param[in] deadline When the work is due.
+ * \param[in] interval The work's interval, in microseconds.
+ *
+ * \returns Nonzero if the deadline is at most half the interval away.
+ */
+static char due(const struct timespec *deadline, unsigned int interval) {
+  return since(deadline) >= -(interval / 2e6);
+}
+
+/**\brief Keep the earlier of two deadlines.
+ *
+ * \param[in,out] earliest The earliest deadline so far; zero if there's none.
+ * \param[in]     deadline Another deadline.
+ */
+static void earlier(struct timespec *earliest,
+                    const struct timespec *deadline) {
+  if (((earliest->tv_sec == 0) && (earliest->tv_nsec == 0)) ||
+      (deadline->tv_sec < earliest->tv_sec) ||
+      ((deadline->tv_sec == earliest->tv_sec) &&
+       (deadline->tv_nsec < earliest->tv_nsec))) {
+    *earliest = *deadline;
+  }
+}
+
+/**\brief Publish the status in shared memory.
+ *
+ * Copies the cached status and the key states into the shared memory segment.
+ *
+ * \param[in,out] ups The event loop state.
+ */
+static void publish(struct ups *ups) {
+  const struct metrics *metrics = ups->metrics;
+  struct shmStatus status;
+  int i;
+
+  memset(&status, 0, sizeof(status));
+  if (metrics != 0) {
+    status.version = metrics->status.value[picoVersion];
+    status.mode = metrics->status.value[picoMode];
+    status.battery = metrics->status.value[picoBattery];
+    status.host = metrics->status.value[picoHost];
+    status.temperature[0] = metrics->status.value[picoTemperature1];
+    status.temperature[1] = metrics->status.value[picoTemperature2];
+    status.seconds = metrics->sampled.tv_sec;
+    status.nanoseconds = metrics->sampled.tv_nsec;
+  }
+  if (ups->keys != 0) {
+    for (i = 0; i < SHM_KEYS; i++) {
+      status.keys[i] = ups->keys->release[i];
+    }
+  }
+
+  shmWrite(ups->shm, &status);
+}
+
+/**\brief Refresh the snapshot.
+ *
+ * Reads the PIco's status, and passes it on to all the outputs.
+ *
+ * \param[in,out] ups      The event loop state.
+ * \param[in]     priority The priority class to read the status with.
+ */
+static void refresh(struct ups *ups, enum i2cPriority priority) {
+  ups->i2c->priority = priority;
+  (void)metricsRefresh(ups->metrics, ups->i2c, ups->block);
+
+  if (ups->directory != 0) {
+    (void)metricsSave(ups->metrics, ups->i2c, ups->directory);
+    /* if this fails, we'll try again on the next refresh; the file's
+       timestamp metric will show that it went stale. */
+  }
+  if (ups->shm != 0) {
+    publish(ups);
+  }
+  if (ups->journal != 0) {
+    (void)journalAppend(ups->journal, &ups->metrics->status,
+                        &ups->metrics->sampled);
+    /* if the flush fails, the changes stay in the page cache, and the next
+       flush writes them along with the newer ones. */
+  }
+  if (ups->query != 0) {
+    queryUpdate(ups->query, &ups->metrics->status, ups->metrics->fields,
+                &ups->metrics->refreshed);
+  }
+}
+
+/**\brief Process the FSSD signal.
+ *
+ * Passes the value of pin #27 on to the FSSD monitor, and acts on it if it says
+ * so: by starting the FSSD action - without waiting for it, so the heartbeat
+ * isn't held up - or, in measurement mode, by printing the reaction time.
+ *
+ * With a snapshot in the same process, the snapshot is then refreshed and the
+ * journal flushed right away, so the readings from just before the power goes
+ * out make it everywhere.
+ *
+ * \param[in,out] ups    The event loop state.
+ * \param[in]     signal The pin's value; negative values are ignored.
+ * \param[in]     edge   The time of the falling edge, or NULL if the pin was
+ *                       sampled.
+ */
+static void monitor(struct ups *ups, int signal, const struct timespec *edge) {
+  struct fssd *fssd = ups->fssd;
+
+  if (!fssdUpdate(fssd, signal, edge)) {
+    return;
+  }
+
+  if (fssd->measure == 1) {
+    if (fssd->latency >= 0) {
+      printf("%s_fssd_edge_to_action_seconds %.6f\n", ups->prefix,
+             fssd->latency);
+    } else {
+      printf("# FSSD signal went LOW without a detected edge\n");
+    }
+    fflush(stdout);
+  } else {
+    (void)actionStart(&fssd->action);
+    /* there's nothing else to do here - regardless of whether the call fails.
+     * If it did fail, the power-off deadline may still save the day. */
+  }
+
+  if (ups->metrics != 0) {
+    refresh(ups, i2cUrgent);
+    if (ups->journal != 0) {
+      (void)journalSync(ups->journal);
+    }
+  }
+}
+
+/**\brief Print statistics
+ *
+ * Writes the loop's counters and how long the pins took to set up to stdout, in
+ * the same Prometheus-compatible format as the status output, followed by the
+ * latency histograms of the loop,
+ * the key scans, the input events, the GPIO pins, the I2C transfers and the
+ * waits for the bus by priority class.
+ *
+ * \param[in] ups The event loop state.
+ */
+static void statistics(const struct ups *ups) {
+  static const char *classes[I2C_PRIORITIES] = {"urgent", "normal", "bulk"};
+  const char *prefix = ups->prefix;
+  double seconds = since(&ups->start);
+  char name[64];
+  char labels[64];
+  int i;
+
+  if (ups->i2c != 0) {
+    printf("%s_i2c_transactions_total %lu\n", prefix, ups->i2c->transactions);
+    printf("%s_i2c_errors_total %lu\n", prefix, ups->i2c->errors);
+  }
+  printf("%s_wakeups_total %lu\n", prefix, ups->wakeups);
+  if (ups->schedule != 0) {
+    printf("%s_scan_interval_seconds %g\n", prefix,
+           ups->schedule->interval / 1e6);
+  }
+  if (seconds > 0) {
+    if (ups->i2c != 0) {
+      printf("%s_i2c_transactions_per_second %g\n", prefix,
+             ups->i2c->transactions / seconds);
+    }
+    printf("%s_wakeups_per_second %g\n", prefix, ups->wakeups / seconds);
+  }
+
+  if (ups->heartbeat != 0) {
+    heartbeatWrite(ups->heartbeat, stdout, prefix);
+    printf("%s_gpio_setup_seconds{pin=\"22\"} %.6f\n", prefix,
+           ups->heartbeat->pin.setup);
+  }
+  if ((ups->fssd != 0) && (ups->fssd->enabled == 1)) {
+    printf("%s_gpio_setup_seconds{pin=\"27\"} %.6f\n", prefix,
+           ups->fssd->pin.setup);
+  }
+  if ((ups->fssd != 0) && (ups->fssd->latency >= 0)) {
+    printf("%s_fssd_edge_to_action_seconds %.6f\n", prefix,
+           ups->fssd->latency);
+  }
+
+  (void)snprintf(name, sizeof(name), "%s_loop", prefix);
+  latencyWrite(&ups->loop, stdout, name, "");
+  if (ups->keys != 0) {
+    (void)snprintf(name, sizeof(name), "%s_key_scan", prefix);
+    latencyWrite(&ups->keys->scans, stdout, name, "");
+    (void)snprintf(name, sizeof(name), "%s_input_write", prefix);
+    latencyWrite(&ups->keys->writes, stdout, name, "");
+  }
+  if (ups->heartbeat != 0) {
+    (void)snprintf(name, sizeof(name), "%s_gpio", prefix);
+    latencyWrite(&ups->heartbeat->pin.latency, stdout, name, "pin=\"22\"");
+    if ((ups->fssd != 0) && (ups->fssd->enabled == 1)) {
+      latencyWrite(&ups->fssd->pin.latency, stdout, name, "pin=\"27\"");
+    }
+  }
+  if (ups->i2c != 0) {
+    (void)snprintf(name, sizeof(name), "%s_i2c_transfer", prefix);
+    for (i = 0; i < ups->i2c->transfers; i++) {
+      const struct i2cTransfer *transfer = &ups->i2c->transfer[i];
+
+      (void)snprintf(labels, sizeof(labels),
+                     "addr=\"0x%02x\",reg=\"0x%02x\",op=\"%s\"",
+                     transfer->addr, transfer->reg,
+                     transfer->write ? "write" : "read");
+      latencyWrite(&transfer->latency, stdout, name, labels);
+    }
+
+    (void)snprintf(name, sizeof(name), "%s_i2c_wait", prefix);
+    for (i = 0; i < I2C_PRIORITIES; i++) {
+      if (ups->i2c->wait[i].count > 0) {
+        (void)snprintf(labels, sizeof(labels), "class=\"%s\"", classes[i]);
+        latencyWrite(&ups->i2c->wait[i], stdout, name, labels);
+      }
+    }
+  }
+  (void)fflush(stdout);
+}
+
+/**\brief Do whatever is due.
+ *
+ * Looks after the FSSD action's timeouts and deadlines, sends the heartbeat's
+ * next edge, scans the keys and refreshes the snapshot, if it's time for any of
+ * those, and drops exporter clients that ran out of time.
+ *
+ * \param[in,out] ups The event loop state.
+ */
+static void work(struct ups *ups) {
+  struct heartbeat *heartbeat = ups->heartbeat;
+  struct fssd *fssd = ups->fssd;
+  struct timespec t;
+
+  if ((fssd != 0) && actionDue(&fssd->action, &t) && (since(&t) >= 0)) {
+    if (actionPoll(&fssd->action) != 0) {
+      printf("Could not power off after the deadline; ERRNO=%d.\n", errno);
+    }
+  }
+  /* the action's timeouts and deadlines don't wait for the pulse train. */
+
+  if ((heartbeat != 0) && (since(&heartbeat->next) >= 0)) {
+    char pulse;
+
+    if (!heartbeat->high && (fssd != 0)) {
+      if (fssd->enabled == 1) {
+        monitor(ups, gpioGet(&fssd->pin), NULL);
+        /* sample the pin once per period, in case edges can't be detected or
+         * one was missed. We ignore the error condition on the gpioGet()
+         * because the only thing to do in that case is to re-issue that, and
+         * we'll do that in 500ms. */
+      }
+    }
+
+    pulse = ups->initial || (fssd == 0) || (fssd->enabled == 0) ||
+            fssd->wasHigh || fssd->triggered;
+    /* only send the pulse train if the FSSD signal scanned HIGH at some point;
+     * this means that the pulse train is not sent if the PIco has not been
+     * installed. If processing the FSSD signal is disabled, assume it's HIGH.
+     * The Pi is still up while it's shutting down, so keep it going then. */
+
+    if (heartbeatEdge(heartbeat, pulse) == 1) {
+      ups->initial = 0;
+    }
+  }
+
+  if ((ups->keys != 0) &&
+      due(&ups->schedule->next, ups->schedule->interval)) {
+    char release[PICO_KEYS];
+    char held;
+
+    memcpy(release, ups->keys->release, sizeof(release));
+    ups->i2c->priority = i2cUrgent;
+    held = keysScan(ups->keys, ups->i2c, ups->block, ups->schedule);
+    (void)clock_gettime(CLOCK_MONOTONIC, &ups->schedule->next);
+    keysReschedule(ups->schedule, held);
+    /* the next scan is scheduled from now rather than from when this one was
+       due, so a scan that ran early on another wakeup stays in step with it. */
+
+    if ((ups->shm != 0) &&
+        (memcmp(release, ups->keys->release, sizeof(release)) != 0)) {
+      publish(ups);
+    }
+  }
+
+  if (ups->exporter != 0) {
+    exporterExpire(ups->exporter);
+  }
+
+  if ((ups->metrics != 0) && due(&ups->next, ups->refresh)) {
+    refresh(ups, i2cBulk);
+    advance(&ups->next, ups->refresh);
+    if (since(&ups->next) > 0) {
+      ups->next = ups->metrics->refreshed;
+      advance(&ups->next, ups->refresh);
+      /* don't try to catch up on refreshes we've missed. */
+    }
+  }
+}
+
+/**\brief Arm the timer.
+ *
+ * Arms the timer for the earliest deadline of anything that's done on a
+ * schedule, unless it's already armed for that.
+ *
+ * \param[in,out] ups The event loop state.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int arm(struct ups *ups) {
+  struct itimerspec spec;
+  struct timespec t;
+
+  memset(&spec, 0, sizeof(spec));
+
+  if (ups->heartbeat != 0) {
+    earlier(&spec.it_value, &ups->heartbeat->next);
+  }
+  if (ups->keys != 0) {
+    earlier(&spec.it_value, &ups->schedule->next);
+  }
+  if (ups->metrics != 0) {
+    earlier(&spec.it_value, &ups->next);
+  }
+  if ((ups->fssd != 0) && actionDue(&ups->fssd->action, &t)) {
+    earlier(&spec.it_value, &t);
+  }
+  if ((ups->exporter != 0) && exporterDue(ups->exporter, &t)) {
+    earlier(&spec.it_value, &t);
+  }
+
+  if ((spec.it_value.tv_sec == ups->armed.tv_sec) &&
+      (spec.it_value.tv_nsec == ups->armed.tv_nsec)) {
+    return 0;
+  }
+
+  ups->armed = spec.it_value;
+
+  return timerfd_settime(ups->timer, TFD_TIMER_ABSTIME, &spec, 0);
+}
+
+/**\brief Handle signals.
+ *
+ * Reads the signals that came in from the signalfd, and acts on them.
+ *
+ * \param[in,out] ups The event loop state.
+ */
+static void receiveSignals(struct ups *ups) {
+  struct signalfd_siginfo info;
+
+  while (read(ups->signals, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+    case SIGUSR1:
+      statistics(ups);
+      break;
+    case SIGTERM:
+    case SIGINT:
+      ups->terminate = 1;
+      break;
+    case SIGCHLD:
+      if (ups->fssd != 0) {
+        (void)actionPoll(&ups->fssd->action);
+      }
+      break;
+    }
+  }
+}
+
+/**\brief Handle an event.
+ *
+ * \param[in,out] ups The event loop state.
+ * \param[in]     fd  The file descriptor that had the event.
+ */
+static void dispatch(struct ups *ups, int fd) {
+  if (fd == ups->timer) {
+    uint64_t expirations;
+
+    (void)read(ups->timer, &expirations, sizeof(expirations));
+    ups->armed.tv_sec = 0;
+    ups->armed.tv_nsec = 0;
+  } else if (fd == ups->signals) {
+    receiveSignals(ups);
+  } else if ((ups->fssd != 0) && (fd == ups->fssd->pin.fd)) {
+    struct timespec edge;
+    int rv = gpioEvent(&ups->fssd->pin, &edge);
+
+    if (rv >= 0) {
+      monitor(ups, rv, &edge);
+    }
+  } else if ((ups->exporter != 0) && (fd == ups->exporter->fd)) {
+    (void)exporterAccept(ups->exporter);
+  } else if ((ups->exporter != 0) &&
+             (exporterHandle(ups->exporter, fd, ups->metrics, ups->i2c) !=
+              -1)) {
+    /* that was one of the exporter's clients. */
+  } else if ((ups->query != 0) && (fd == ups->query->fd)) {
+    (void)queryAccept(ups->query);
+  } else if (ups->query != 0) {
+    (void)queryReceive(ups->query, fd);
+  }
+}
+
+/**\brief Watch a file descriptor.
+ *
+ * \param[in] ups    The event loop state.
+ * \param[in] fd     The file descriptor to add to the epoll instance.
+ * \param[in] events The epoll events to wait for.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+static int watch(const struct ups *ups, int fd, unsigned int events) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+
+  return epoll_ctl(ups->epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**\brief Signals the loop handles.
+ *
+ * \param[out] signals Set to SIGUSR1, SIGTERM, SIGINT and SIGCHLD.
+ */
+static void handled(sigset_t *signals) {
+  sigemptyset(signals);
+  sigaddset(signals, SIGUSR1);
+  sigaddset(signals, SIGTERM);
+  sigaddset(signals, SIGINT);
+  sigaddset(signals, SIGCHLD);
+}
+
+/**\brief Set up the event loop.
+ *
+ * Creates the epoll instance and the timer, and blocks the signals that the
+ * loop handles, so they stay pending until upsRun() picks them up. The parts of
+ * the daemon are all unset; set the ones to use before calling upsRun(). It's
+ * fine to daemon() in between.
+ *
+ * \param[out] ups    The event loop state to initialise.
+ * \param[in]  prefix The prefix of the metric names in the statistics.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int upsOpen(struct ups *ups, const char *prefix) {
+  sigset_t signals;
+
+  memset(ups, 0, sizeof(*ups));
+  ups->prefix = prefix;
+  ups->block = 1;
+  ups->initial = 1;
+  ups->timer = -1;
+  ups->signals = -1;
+
+  ups->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (ups->epoll < 0) {
+    return -1;
+  }
+
+  ups->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if ((ups->timer < 0) || (watch(ups, ups->timer, EPOLLIN) < 0)) {
+    return -2;
+  }
+
+  handled(&signals);
+  if (sigprocmask(SIG_BLOCK, &signals, 0) < 0) {
+    return -3;
+  }
+
+  return 0;
+}
+
+/**\brief Run the event loop.
+ *
+ * Runs the parts of the daemon that have been set, until SIGTERM or SIGINT
+ * comes in. SIGUSR1 prints the loop's statistics, and so does exiting.
+ *
+ * The signalfd is only created here: epoll reports a signalfd's signals to the
+ * process that added it, so one added before daemon() would never wake up the
+ * daemon.
+ *
+ * \param[in,out] ups The event loop state.
+ *
+ * \returns 0 on success, negative numbers if the loop couldn't be run.
+ */
+int upsRun(struct ups *ups) {
+  struct epoll_event events[UPS_EVENTS];
+  sigset_t signals;
+  int n, i;
+
+  handled(&signals);
+  ups->signals = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  if ((ups->signals < 0) || (watch(ups, ups->signals, EPOLLIN) < 0)) {
+    return -1;
+  }
+
+  if ((ups->fssd != 0) && (ups->fssd->enabled == 1) &&
+      (ups->fssd->pin.events != 0)) {
+    (void)watch(ups, ups->fssd->pin.fd,
+                (ups->fssd->pin.events & POLLPRI) ? EPOLLPRI : EPOLLIN);
+    /* this fails for regular files, e.g. pico-emu's, in which case the pin
+       is still sampled once per period. */
+  }
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ups->start);
+  ups->woke = ups->start;
+  ups->next = ups->start;
+
+  if (ups->heartbeat != 0) {
+    heartbeatStart(ups->heartbeat);
+  }
+  if (ups->schedule != 0) {
+    ups->schedule->interval = ups->schedule->idle;
+    ups->schedule->next = ups->start;
+  }
+
+  while (!ups->terminate) {
+    work(ups);
+
+    if (arm(ups) < 0) {
+      return -2;
+    }
+
+    latencyRecord(&ups->loop, &ups->woke, 0);
+    n = epoll_wait(ups->epoll, events, UPS_EVENTS, -1);
+    latencyStart(&ups->woke);
+    ups->wakeups++;
+
+    for (i = 0; i < n; i++) {
+      dispatch(ups, events[i].data.fd);
+    }
+
+    if (ups->query != 0) {
+      ups->i2c->priority = i2cNormal;
+      (void)queryAnswer(ups->query, ups->i2c, ups->block);
+      /* all the queries that came in together are answered together, with
+         as few reads as possible. */
+    }
+  }
+
+  if (ups->heartbeat != 0) {
+    (void)heartbeatStop(ups->heartbeat);
+  }
+
+  statistics(ups);
+
+  return 0;
+}
+
+/**\brief Tear down the event loop.
+ *
+ * Closes the epoll instance, the timer and the signalfd. The parts of the
+ * daemon are left alone.
+ *
+ * \param[in,out] ups The event loop state.
+ *
+ * \returns 0 on success, negative numbers on failure.
+ */
+int upsClose(struct ups *ups) {
+  int rv = 0;
+
+  if ((ups->signals >= 0) && (close(ups->signals) < 0)) {
+    rv = -1;
+  }
+  if ((ups->timer >= 0) && (close(ups->timer) < 0)) {
+    rv = -1;
+  }
+  if ((ups->epoll >= 0) && (close(ups->epoll) < 0)) {
+    rv = -1;
+  }
+
+  ups->signals = -1;
+  ups->timer = -1;
+  ups->epoll = -1;
+
+  return rv;
+}
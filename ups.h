@@ -0,0 +1,215 @@
+/**\file
+ * \brief PIco event loop.
+ *
+ * The main loop shared by the daemons: one epoll instance that waits on a
+ * timerfd for everything that's done on a schedule, a signalfd for the signals
+ * we care about, and the file descriptors of the servers and of pin #27. Each
+ * part - the heartbeat and FSSD signal, key scanning, and the status snapshot
+ * with its outputs - is optional, so picod and pico-i2cd each run the parts
+ * they're about, and pico-upsd runs all of them in one process, sharing one I2C
+ * handle and one snapshot between them.
+ *
+ * The timer is only ever armed for the earliest deadline. Scheduled work may
+ * run up to half its interval early if the loop is awake anyway, so that e.g.
+ * idle key scans end up on the same wakeups as the heartbeat's edges instead
+ * of having wakeups of their own.
+ *
+ * \copyright
+ * This programme is released as open source, under the terms of an MIT/X style
+ * licence. See the accompanying LICENSE file for details.
+ *
+ * \see Source Code Repository: https://github.com/ef-gy/rpi-ups-pico
+ * \see Licence Terms: https://github.com/ef-gy/rpi-ups-pico/blob/master/LICENSE
+ */
+
+#if !defined(PICO_UPS_H)
+#define PICO_UPS_H
+
+/* for struct timespec */
+#include <time.h>
+
+#include "i2c.h"
+#include "keys.h"
+#include "metrics.h"
+#include "shm.h"
+#include "journal.h"
+#include "exporter.h"
+#include "query.h"
+#include "heartbeat.h"
+#include "latency.h"
+
+/**\brief Maximum events per wakeup
+ *
+ * The most epoll events the loop handles per wakeup; any others are handled on
+ * the next one.
+ */
+#define UPS_EVENTS 32
+
+/**\brief Event loop state
+ *
+ * The parts of a daemon that the loop looks after, and the loop's own state.
+ * The parts are set up by the caller; any that are NULL aren't used.
+ */
+struct ups {
+  /**\brief Metric prefix
+   *
+   * The prefix of the names in the statistics, e.g. "pico" or "picod".
+   */
+  const char *prefix;
+
+  /**\brief I2C state
+   *
+   * The PIco's I2C bus, for the keys, the snapshot and the queries.
+   */
+  struct i2c *i2c;
+
+  /**\brief Use block transfers
+   *
+   * Nonzero to read and write the PIco's registers in blocks if possible.
+   */
+  char block;
+
+  /**\brief Key state
+   *
+   * The input device and the keys, if the keys are to be scanned.
+   */
+  struct keys *keys;
+
+  /**\brief Key scan schedule
+   *
+   * How often to scan the keys; must be set along with 'keys'.
+   */
+  struct schedule *schedule;
+
+  /**\brief Status snapshot
+   *
+   * The cached status, if it's to be refreshed regularly for the outputs.
+   */
+  struct metrics *metrics;
+
+  /**\brief Refresh interval
+   *
+   * Microseconds between refreshes of the snapshot.
+   */
+  unsigned int refresh;
+
+  /**\brief Textfile directory
+   *
+   * Where to write the snapshot for node_exporter after each refresh.
+   */
+  const char *directory;
+
+  /**\brief Shared memory segment
+   *
+   * Where to publish the snapshot and the key states.
+   */
+  struct shm *shm;
+
+  /**\brief Journal
+   *
+   * Where to append each snapshot.
+   */
+  struct journal *journal;
+
+  /**\brief Prometheus exporter
+   *
+   * The HTTP server that serves the snapshot; it must have been opened with
+   * the loop's epoll instance.
+   */
+  struct exporter *exporter;
+
+  /**\brief Query server
+   *
+   * The Unix domain socket server that answers queries; it must have been
+   * opened with the loop's epoll instance.
+   */
+  struct query *query;
+
+  /**\brief Heartbeat
+   *
+   * The pulse train on pin #22.
+   */
+  struct heartbeat *heartbeat;
+
+  /**\brief FSSD monitor
+   *
+   * The FSSD signal on pin #27 and what to do about it. The pin is only used if
+   * the monitor is enabled.
+   */
+  struct fssd *fssd;
+
+  /**\brief Initial pulse
+   *
+   * Nonzero until the first pulse has been sent. The pulse train is only kept
+   * up once the FSSD signal has been seen HIGH, which means there's a PIco;
+   * the first pulse is sent regardless, in case the PIco waits for one.
+   */
+  char initial;
+
+  /**\brief epoll instance
+   *
+   * What the loop waits in.
+   */
+  int epoll;
+
+  /**\brief Timer
+   *
+   * The timerfd that is armed for the earliest deadline.
+   */
+  int timer;
+
+  /**\brief Signals
+   *
+   * The signalfd for SIGUSR1, SIGTERM, SIGINT and SIGCHLD.
+   */
+  int signals;
+
+  /**\brief Armed deadline
+   *
+   * The CLOCK_MONOTONIC time the timer is armed for, or zero if it isn't.
+   */
+  struct timespec armed;
+
+  /**\brief Start time
+   *
+   * The CLOCK_MONOTONIC time the loop was started at.
+   */
+  struct timespec start;
+
+  /**\brief Next refresh
+   *
+   * The CLOCK_MONOTONIC time the snapshot is to be refreshed at next.
+   */
+  struct timespec next;
+
+  /**\brief Wakeup time
+   *
+   * When epoll_wait() last returned.
+   */
+  struct timespec woke;
+
+  /**\brief Wakeups
+   *
+   * The number of times the loop woke up, for whatever reason.
+   */
+  unsigned long wakeups;
+
+  /**\brief Loop latency
+   *
+   * How long the loop stayed awake each time it woke up, from epoll_wait()
+   * returning until it went back to sleep.
+   */
+  struct latency loop;
+
+  /**\brief Termination request
+   *
+   * Set once SIGTERM or SIGINT has come in.
+   */
+  char terminate;
+};
+
+int upsOpen(struct ups *ups, const char *prefix);
+int upsRun(struct ups *ups);
+int upsClose(struct ups *ups);
+
+#endif